@@ -1,5 +1,10 @@
 #include <stdio.h>
 #include "axistreamfifo.h"
+#include "trace.h"
+
+//Set this to talk to a software model instead of real hardware (see
+//fifo_model.h)
+int asfifo_use_model = 0;
 
 //My naming styles are over the map
 #define X(x) #x
@@ -56,19 +61,19 @@ void print_interrupt_info(unsigned ISR) {
 
 //Returns what was previously in ISR
 unsigned clear_ints(volatile AXIStream_FIFO *base) {
-    unsigned ISR = base->ISR;
-    base->ISR = 0xFFFFFFFF;
+    unsigned ISR = RD_REG(base, ISR);
+    WR_REG(base, ISR, 0xFFFFFFFF);
     return ISR;
 }
 
 //Issues a reset to the TX logic. Returns 0 on successful reset, -1 on error
 int reset_TX(volatile AXIStream_FIFO *base) {
-    base->ISR = TRC_MASK; //Clear Transmit Reset Complete bit
+    WR_REG(base, ISR, TRC_MASK); //Clear Transmit Reset Complete bit
     
-    base->TDFR = 0xA5; //Issue reset command
+    WR_REG(base, TDFR, 0xA5); //Issue reset command
     
     //Check if reset happened succesfully
-    unsigned ISR = base->ISR;
+    unsigned ISR = RD_REG(base, ISR);
     
     if (ISR & TRC_MASK) return 0;
     else return -1;
@@ -76,12 +81,12 @@ int reset_TX(volatile AXIStream_FIFO *base) {
 
 //Issues a reset to the RX logic. Returns 0 on successful reset, -1 on error
 int reset_RX(volatile AXIStream_FIFO *base) {
-    base->ISR = RRC_MASK; //Clear Transmit Reset Complete bit
+    WR_REG(base, ISR, RRC_MASK); //Clear Transmit Reset Complete bit
     
-    base->RDFR = 0xA5; //Issue reset command
+    WR_REG(base, RDFR, 0xA5); //Issue reset command
     
     //Check if reset happened succesfully
-    unsigned ISR = base->ISR;
+    unsigned ISR = RD_REG(base, ISR);
     
     if (ISR & RRC_MASK) return 0;
     else return -1;
@@ -89,12 +94,12 @@ int reset_RX(volatile AXIStream_FIFO *base) {
 
 //Issues a reset to the AXI-Stream FIFO. Returns 0 on successful reset, -1 on error
 int reset_all(volatile AXIStream_FIFO *base) {
-    base->ISR = RRC_MASK | TRC_MASK; //Clear Transmit and Receive Reset Complete bits
+    WR_REG(base, ISR, RRC_MASK | TRC_MASK); //Clear Transmit and Receive Reset Complete bits
     
-    base->SRR = 0xA5; //Issue reset command
+    WR_REG(base, SRR, 0xA5); //Issue reset command
     
     //Check if reset happened succesfully
-    unsigned ISR = base->ISR;
+    unsigned ISR = RD_REG(base, ISR);
     
     if ((ISR & RRC_MASK) && (ISR & TRC_MASK)) return 0;
     else return -1;
@@ -103,7 +108,7 @@ int reset_all(volatile AXIStream_FIFO *base) {
 //Of course, the AXI Stream FIFO has bizarre behaviour for this quantity, but 
 //here it is anyway. It is measured in 32-bit words
 unsigned tx_fifo_word_vacancy(volatile AXIStream_FIFO *base) {
-    unsigned TDFV = base->TDFV;
+    unsigned TDFV = RD_REG(base, TDFV);
     return TDFV & 0x1FFFF; //Why is this a 17 bit number?
 }
 
@@ -132,7 +137,7 @@ void unchecked_send_buf(volatile AXIStream_FIFO *base, char *buf, int len) {
         //Somewhere along the way, the PS reverses the order of the bytes in 
         //32-bit transfers before they get into the PL; this is why we had to
         //manually fiddle with the endianness. "A fix for a fix"...
-        base->TDFD = u.w;
+        WR_REG(base, TDFD, u.w);
     }
     
     //Deal with the annoying last partial word
@@ -140,9 +145,9 @@ void unchecked_send_buf(volatile AXIStream_FIFO *base, char *buf, int len) {
     for (i = 0; i < num_remaining; i++) {
         u.byte[3-i] = *buf++;
     }
-    base->TDFD = u.w;
+    WR_REG(base, TDFD, u.w);
     
-    base->TLR = len;
+    WR_REG(base, TLR, len);
 }
 
 //Sends an array of 32 bit values. Does not check anything; it's up to you to be
@@ -152,19 +157,21 @@ void unchecked_send_words(volatile AXIStream_FIFO *base, unsigned *vals, int wor
     for (i = 0; i < words; i++) {        
         //Somewhere along the way, the PS reverses the order of the bytes in 
         //32-bit transfers, so this is fine
-        base->TDFD = vals[i];
+        WR_REG(base, TDFD, vals[i]);
     }
     
-    base->TLR = words;
+    WR_REG(base, TLR, words);
 }
 
 //Call this to check for errors after sending something. Clears the TX-related
 //error interrupts. Returns 1 if error occurred, 0 if no error
 int tx_err(volatile AXIStream_FIFO *base) {
-    unsigned ISR = base->ISR;
-    base->ISR |= TX_ERR_MASK;
-    if (ISR & TX_ERR_MASK) return 1;
-    else return 0;
+    unsigned ISR = RD_REG(base, ISR);
+    WR_REG(base, ISR, RD_REG(base, ISR) | TX_ERR_MASK);
+    if (ISR & TX_ERR_MASK) {
+        trace_emit(TR_TX_ERR, ISR, 0);
+        return 1;
+    } else return 0;
 }
 
 //Sends buf, but checks if there is room first, and checks for error interrupts
@@ -176,7 +183,7 @@ int send_buf(volatile AXIStream_FIFO *base, char *buf, int len) {
     if (vcy < ((len+3)/4)) return -E_TX_FIFO_NO_ROOM;
     
     //Clear error interrupts so we don't get confused by old messages
-    base->ISR = TX_ERR_MASK;
+    WR_REG(base, ISR, TX_ERR_MASK);
     
     //Actually send the buffer
     unchecked_send_buf(base, buf, len);
@@ -199,7 +206,7 @@ int send_words(volatile AXIStream_FIFO *base, unsigned *vals, int words) {
     if (vcy < words) return -E_TX_FIFO_NO_ROOM;
     
     //Clear error interrupts so we don't get confused by old messages
-    base->ISR = TX_ERR_MASK;
+    WR_REG(base, ISR, TX_ERR_MASK);
     
     //Actually send the buffer
     unchecked_send_words(base, vals, words);
@@ -212,10 +219,39 @@ int send_words(volatile AXIStream_FIFO *base, unsigned *vals, int words) {
     return ASFIFO_SUCCESS;
 }
 
+//Sends as many of the words as will fit as a single packet, using *vcy as a 
+//cached copy of the TX vacancy. Returns the number of words sent (0 if the 
+//FIFO is full), or a negative error code.
+int send_words_burst(volatile AXIStream_FIFO *base, unsigned *vals, int words, unsigned *vcy) {
+    //Only bother the hardware when our cached vacancy has run out
+    if (*vcy == 0) {
+        *vcy = tx_fifo_word_vacancy(base);
+        if (*vcy == 0) return 0;
+    }
+    
+    if (words > *vcy) words = *vcy;
+    if (words <= 0) return 0;
+    
+    //Clear error interrupts so we don't get confused by old messages
+    WR_REG(base, ISR, TX_ERR_MASK);
+    
+    unchecked_send_words(base, vals, words);
+    *vcy -= words;
+    
+    //Check if an error occurred
+    if (tx_err(base)) {
+        //Who knows what the FIFO actually accepted; make sure we re-read TDFV
+        *vcy = 0;
+        return -E_ERR_IRQ;
+    }
+    
+    return words;
+}
+
 //Tells you how many words are in the receive FIFO (kind of; the AXI Stream 
 //FIFO has very weird behaviour for this)
 unsigned rx_fifo_word_occupancy(volatile AXIStream_FIFO *base) {
-    unsigned RDFO = base->RDFO;
+    unsigned RDFO = RD_REG(base, RDFO);
     return RDFO & 0x1FFFF; //Why is this a 17 bit number?
 }
 
@@ -226,45 +262,46 @@ unsigned rx_fifo_word_occupancy(volatile AXIStream_FIFO *base) {
 //However, there is one key difference: if this function returns 0, it doesn't
 //mean it's the end of the packet. Instead, to use this function, you must do
 //
-//  rw_state_t   my_fifo_state = READ_WORDS_IDLE;
+//  rw_state_t   my_fifo_state = RW_STATE_INITIALIZER;
 //  do {
 //		...
 //      int num_read = unchecked_read_words(fifo_base, buf, num_to_read, &my_fifo_state);
 //      ...
-//  while (my_fifo_state != READ_WORDS_IDLE);
+//  while (my_fifo_state.status != READ_WORDS_IDLE);
 //
 //NOTE: you must maintain a separate state for each FIFO!
 //
 //Does not check if the transfer will be legal; this can cause all kinds of 
 //issues! Also, does not support partial words transfers
 int unchecked_read_words(volatile AXIStream_FIFO *base, unsigned *dst, int words, rw_state_t *state) {
-    static int words_to_send;
-    static int words_sent;
-    static int partial_internal;
-    
-    if (*state == READ_WORDS_IDLE) {
-        unsigned RLR = base->RLR;
-        partial_internal = RLR & 0x80000000;
-        words_to_send = (RLR & 0x1FFFF) / 4;
-        words_sent = 0;
-        *state = READ_WORDS_TRANSFERRING;
+    if (state->status == READ_WORDS_IDLE) {
+        unsigned RLR = RD_REG(base, RLR);
+        state->partial = RLR & 0x80000000;
+        state->words_to_send = (RLR & 0x1FFFF) / 4;
+        state->words_sent = 0;
+        state->status = READ_WORDS_TRANSFERRING;
     } else {
         //Not sure how, but sometimes words_sent becomes greater than words_to_send 
-        if (words_sent >= words_to_send && !partial_internal) {
-            *state = READ_WORDS_IDLE;
+        if (state->words_sent >= state->words_to_send && !state->partial) {
+            state->status = READ_WORDS_IDLE;
             return 0;
-        } else if (partial_internal) {
+        } else if (state->partial) {
             //Get updated number of things to send
-            unsigned RLR = base->RLR;
-            partial_internal = RLR & 0x80000000;
-            words_to_send = (RLR & 0x1FFFF) / 4;
+            unsigned RLR = RD_REG(base, RLR);
+            state->partial = RLR & 0x80000000;
+            state->words_to_send = (RLR & 0x1FFFF) / 4;
         }
     }
     
+    //Copy these into locals so the compiler doesn't keep writing them back
+    //to memory in between the (uncached) RDFD reads
+    int words_sent = state->words_sent;
+    int words_to_send = state->words_to_send;
     int i;
     for(i = 0; words_sent < words_to_send && i < words; words_sent++, i++) {
-        *dst++ = base->RDFD;
+        *dst++ = RD_REG(base, RDFD);
     }
+    state->words_sent = words_sent;
     
     return i;
 }
@@ -272,17 +309,15 @@ int unchecked_read_words(volatile AXIStream_FIFO *base, unsigned *dst, int words
 //Call this to check for errors after receiving something. Clears the RX-related
 //error interrupts. Returns 1 if error occurred, 0 if no error
 int rx_err(volatile AXIStream_FIFO *base) {
-    unsigned ISR = base->ISR;
-#ifdef DEBUG_ON
-    fprintf(stderr, "rx_err: ISR=0x%08x\n", ISR);
-    fflush(stderr);
-#endif
+    unsigned ISR = RD_REG(base, ISR);
     
     //Clear RX-related interrupts
-    base->ISR = RX_ERR_MASK;
+    WR_REG(base, ISR, RX_ERR_MASK);
     
-    if (ISR & RX_ERR_MASK) return 1;
-    else return 0;
+    if (ISR & RX_ERR_MASK) {
+        trace_emit(TR_RX_ERR, ISR, 0);
+        return 1;
+    } else return 0;
 }
 
 //Same as unchecked_read_words, but checks for errors. Basically combines 
@@ -292,12 +327,12 @@ int rx_err(volatile AXIStream_FIFO *base) {
 //However, there is one key difference: if this function returns 0, it doesn't
 //mean it's the end of the packet. Instead, to use this function, you must do
 //
-//  rw_state_t   my_fifo_state = READ_WORDS_IDLE;
+//  rw_state_t   my_fifo_state = RW_STATE_INITIALIZER;
 //  do {
 //		...
 //      int num_read = unchecked_read_words(fifo_base, buf, num_to_read, &my_fifo_state);
 //      ...
-//  while (my_fifo_state != READ_WORDS_IDLE);
+//  while (my_fifo_state.status != READ_WORDS_IDLE);
 //
 //NOTE: you must maintain a separate state for each FIFO!
 //
@@ -310,7 +345,7 @@ int read_words(volatile AXIStream_FIFO *base, asfifo_mode_t mode, unsigned *dst,
 	}
 	
     //Double-check that there is something in the FIFO
-    if (mode == STORE_AND_FORWARD && *state == READ_WORDS_IDLE) {
+    if (mode == STORE_AND_FORWARD && state->status == READ_WORDS_IDLE) {
         unsigned occ = rx_fifo_word_occupancy(base);
         if (occ == 0) return /*-E_RX_FIFO_EMPTY*/ 0;
     }
@@ -318,14 +353,69 @@ int read_words(volatile AXIStream_FIFO *base, asfifo_mode_t mode, unsigned *dst,
     //weird thing to do
     
     //Clear RX-related interrupts so we don't get confused by old messages
-    base->ISR = RX_ERR_MASK;
+    WR_REG(base, ISR, RX_ERR_MASK);
         
     int num_read = unchecked_read_words(base, dst, words, state);
     
-    if (base->ISR & RX_ERR_MASK) return -E_ERR_IRQ;
+    if (RD_REG(base, ISR) & RX_ERR_MASK) return -E_ERR_IRQ;
     else return num_read;
 }
 
+//Bulk version of read_words. Drains the whole packet (or, in cut-through 
+//mode, as much of it as RLR says is there) into dst, and checks for errors
+//once.
+//Returns the number of words read, or a negative error code.
+int read_packet(volatile AXIStream_FIFO *base, asfifo_mode_t mode, unsigned *dst, int words, rw_state_t *state) {
+    if (state == NULL) {
+        return -E_NULL_ARG;
+    }
+    
+    //Double-check that there is something in the FIFO
+    if (mode == STORE_AND_FORWARD && state->status == READ_WORDS_IDLE) {
+        unsigned occ = rx_fifo_word_occupancy(base);
+        if (occ == 0) return 0;
+    }
+    
+    //Clear RX-related interrupts so we don't get confused by old messages
+    WR_REG(base, ISR, RX_ERR_MASK);
+    
+    //One RLR read per call, at most: at the start of a packet, or in 
+    //cut-through mode, to find out how much more of it has arrived. Anything
+    //that shows up after that waits for the next call, rather than costing
+    //another RLR read per chunk
+    if (state->status == READ_WORDS_IDLE || state->partial) {
+        unsigned RLR = RD_REG(base, RLR);
+        if (state->status == READ_WORDS_IDLE) {
+            state->words_sent = 0;
+            state->status = READ_WORDS_TRANSFERRING;
+        }
+        state->partial = RLR & 0x80000000;
+        state->words_to_send = (RLR & 0x1FFFF) / 4;
+    }
+    
+    //Copy these into locals so the compiler doesn't keep writing them back
+    //to memory in between the (uncached) RDFD reads
+    int words_sent = state->words_sent;
+    int total = state->words_to_send - words_sent;
+    if (total > words) total = words;
+    if (total < 0) total = 0;
+    int i;
+    for (i = 0; i < total; i++) {
+        *dst++ = RD_REG(base, RDFD);
+    }
+    words_sent += total;
+    state->words_sent = words_sent;
+    
+    //If that was the end of the packet, say so now (even if dst filled up
+    //right there), so the caller can tell it got all of it
+    if (words_sent >= state->words_to_send && !state->partial) {
+        state->status = READ_WORDS_IDLE;
+    }
+    
+    if (RD_REG(base, ISR) & RX_ERR_MASK) return -E_ERR_IRQ;
+    else return total;
+}
+
 //Get string for an error code
 char const* asfifo_strerror(int code) {
     return ASFIFO_ERRCODE_STRINGS[-code];
@@ -1,6 +1,8 @@
 #ifndef AXISTREAMFIFO_H
 #define AXISTREAMFIFO_H 1
 
+#include <stddef.h>
+
 typedef struct {
     unsigned ISR;  //Interrupt status register
     unsigned IER;  //Interrupt enable register
@@ -17,6 +19,26 @@ typedef struct {
     unsigned RDR;  //RX DEST
 } AXIStream_FIFO;
 
+//Every register access goes through these two macros. On real hardware they
+//are plain volatile loads and stores (plus one well-predicted branch). When
+//asfifo_use_model is set, base points at a software model of the FIFO (see
+//fifo_model.h) and the access is handed to the model instead
+extern int asfifo_use_model;
+unsigned fifo_model_read(volatile AXIStream_FIFO *base, unsigned off);
+void fifo_model_write(volatile AXIStream_FIFO *base, unsigned off, unsigned val);
+
+#define RD_REG(base, reg) \
+    (__builtin_expect(asfifo_use_model, 0) ? \
+        fifo_model_read((base), offsetof(AXIStream_FIFO, reg)) : (base)->reg)
+
+#define WR_REG(base, reg, val) do { \
+    if (__builtin_expect(asfifo_use_model, 0)) { \
+        fifo_model_write((base), offsetof(AXIStream_FIFO, reg), (val)); \
+    } else { \
+        (base)->reg = (val); \
+    } \
+} while (0)
+
 #define RPURE_MASK 0x80000000 //Receive Packet Underrun Error
 #define RPORE_MASK 0x40000000 //Receive Packet Overrun Read Error
 #define RPUE_MASK  0x20000000 //Receive Packet Underrun Error
@@ -90,6 +112,14 @@ int send_buf(volatile AXIStream_FIFO *base, char *buf, int len);
 //everything was fine.
 int send_words(volatile AXIStream_FIFO *base, unsigned *vals, int words);
 
+//Sends as many of the words as will fit as a single packet, using *vcy as a 
+//cached copy of the TX vacancy. TDFV is only read again when the cached value
+//has run out, so a burst costs one ISR clear, the TDFD writes, one TLR write
+//and one error check. Start with *vcy = 0 and keep passing the same variable
+//in; it is decremented by however many words were sent. Returns the number of
+//words sent (0 if the FIFO is full), or a negative error code.
+int send_words_burst(volatile AXIStream_FIFO *base, unsigned *vals, int words, unsigned *vcy);
+
 //Tells you how many words are in the receive FIFO (kind of; the AXI Stream 
 //FIFO has very weird behaviour for this)
 unsigned rx_fifo_word_occupancy(volatile AXIStream_FIFO *base);
@@ -102,8 +132,25 @@ typedef enum _asfifo_mode_t {
 typedef enum {
     READ_WORDS_IDLE,
     READ_WORDS_TRANSFERRING
+} rw_status_t;
+
+//Everything unchecked_read_words needs to remember about the packet it's in 
+//the middle of. This used to live in static variables, which meant you could
+//only ever read from one FIFO
+typedef struct {
+    rw_status_t status;
+    int words_to_send;
+    int words_sent;
+    int partial;
 } rw_state_t;
 
+#define RW_STATE_INITIALIZER {\
+    .status = READ_WORDS_IDLE,\
+    .words_to_send = 0,\
+    .words_sent = 0,\
+    .partial = 0\
+}
+
 //Reads a number of words out from the AXI-Stream FIFO. Has the same semantics
 //as the read() system call; returns number of words read, and will not read 
 //more than you ask for.
@@ -111,12 +158,12 @@ typedef enum {
 //However, there is one key difference: if this function returns 0, it doesn't
 //mean it's the end of the packet. Instead, to use this function, you must do
 //
-//  rw_state_t   my_fifo_state = READ_WORDS_IDLE;
+//  rw_state_t   my_fifo_state = RW_STATE_INITIALIZER;
 //  do {
 //		...
 //      int num_read = unchecked_read_words(fifo_base, buf, num_to_read, &my_fifo_state);
 //      ...
-//  while (my_fifo_state != READ_WORDS_IDLE);
+//  while (my_fifo_state.status != READ_WORDS_IDLE);
 //
 //NOTE: you must maintain a separate state for each FIFO!
 //
@@ -135,12 +182,12 @@ int rx_err(volatile AXIStream_FIFO *base);
 //However, there is one key difference: if this function returns 0, it doesn't
 //mean it's the end of the packet. Instead, to use this function, you must do
 //
-//  rw_state_t   my_fifo_state = READ_WORDS_IDLE;
+//  rw_state_t   my_fifo_state = RW_STATE_INITIALIZER;
 //  do {
 //		...
 //      int num_read = unchecked_read_words(fifo_base, buf, num_to_read, &my_fifo_state);
 //      ...
-//  while (my_fifo_state != READ_WORDS_IDLE);
+//  while (my_fifo_state.status != READ_WORDS_IDLE);
 //
 //NOTE: you must maintain a separate state for each FIFO!
 //
@@ -149,6 +196,19 @@ int rx_err(volatile AXIStream_FIFO *base);
 //pass that information in as a parameter.
 int read_words(volatile AXIStream_FIFO *base, asfifo_mode_t mode, unsigned *dst, int words, rw_state_t *state);
 
+//Bulk version of read_words. Reads RLR once, then drains the whole packet 
+//(or, in cut-through mode, as much of it as RLR said had arrived) into dst 
+//with back-to-back RDFD reads, and checks for errors once at the end. Never 
+//reads more than words words; if the packet is bigger than that (or still
+//coming in), state->status is left as READ_WORDS_TRANSFERRING and the next
+//call picks up where this one left off. Once it has read the last word of a
+//packet, state->status is READ_WORDS_IDLE.
+//Returns the number of words read (0 if there was nothing to read), or a 
+//negative error code.
+//
+//NOTE: you must maintain a separate state for each FIFO!
+int read_packet(volatile AXIStream_FIFO *base, asfifo_mode_t mode, unsigned *dst, int words, rw_state_t *state);
+
 //Get string for an error code
 char const* asfifo_strerror(int code);
 #endif
@@ -0,0 +1,159 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "axistreamfifo.h"
+#include "fifo_model.h"
+#include "backend.h"
+
+//Physical address of offset 0 in /dev/mpsoc_axiregs
+#define AXIREGS_BASE 0xA0000000
+
+int backend_parse(backend *be, char const *str) {
+    if (!strcmp(str, "axiregs")) {
+        be->kind = BACKEND_AXIREGS;
+    } else if (!strcmp(str, "devmem")) {
+        be->kind = BACKEND_DEVMEM;
+    } else if (!strncmp(str, "uio:", 4)) {
+        if (strlen(str + 4) == 0 || strlen(str + 4) >= sizeof(be->dev)) {
+            fprintf(stderr, "Error: bad UIO device in [%s]\n", str);
+            return -1;
+        }
+        be->kind = BACKEND_UIO;
+        strcpy(be->dev, str + 4);
+    } else if (!strcmp(str, "sim") || !strncmp(str, "sim:", 4)) {
+        be->kind = BACKEND_SIM;
+        if (str[3] == ':' && fifo_model_parse(&be->model_cfg, str + 4) < 0) {
+            fprintf(stderr, "Error: could not parse FIFO model settings [%s]\n", str + 4);
+            return -1;
+        }
+    } else {
+        fprintf(stderr, "Error: backend must be axiregs, devmem, uio:DEV or sim[:SETTINGS]; you entered [%s]\n", str);
+        return -1;
+    }
+    return 0;
+}
+
+//Reads a hex number out of a sysfs file. Returns 0 on success, -1 on error
+static int read_sysfs_hex(char const *path, unsigned long *val) {
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) return -1;
+    int rc = fscanf(fp, "%lx", val);
+    fclose(fp);
+    return (rc == 1) ? 0 : -1;
+}
+
+int backend_open(backend *be) {
+    switch (be->kind) {
+    case BACKEND_AXIREGS:
+        be->fd = open("/dev/mpsoc_axiregs", O_RDWR | O_SYNC);
+        if (be->fd < 0) {
+            perror("Could not open /dev/mpsoc_axiregs");
+            return -1;
+        }
+        break;
+    case BACKEND_DEVMEM:
+        be->fd = open("/dev/mem", O_RDWR | O_SYNC);
+        if (be->fd < 0) {
+            perror("Could not open /dev/mem");
+            return -1;
+        }
+        break;
+    case BACKEND_UIO: {
+        //Find out where the device's first region is (e.g. for /dev/uio0,
+        ///sys/class/uio/uio0/maps/map0/addr)
+        char const *name = strrchr(be->dev, '/');
+        name = (name == NULL) ? be->dev : name + 1;
+        char path[128];
+        snprintf(path, sizeof(path), "/sys/class/uio/%s/maps/map0/addr", name);
+        if (read_sysfs_hex(path, &be->region_addr) < 0) {
+            fprintf(stderr, "Could not read %s\n", path);
+            return -1;
+        }
+        snprintf(path, sizeof(path), "/sys/class/uio/%s/maps/map0/size", name);
+        if (read_sysfs_hex(path, &be->region_size) < 0) {
+            fprintf(stderr, "Could not read %s\n", path);
+            return -1;
+        }
+
+        be->fd = open(be->dev, O_RDWR | O_SYNC);
+        if (be->fd < 0) {
+            fprintf(stderr, "Could not open %s: %s\n", be->dev, strerror(errno));
+            return -1;
+        }
+        break;
+    }
+    case BACKEND_SIM:
+        asfifo_use_model = 1;
+        break;
+    }
+
+    return 0;
+}
+
+volatile AXIStream_FIFO *backend_map(backend *be, unsigned long phys, asfifo_mode_t mode, int gen, void **cookie) {
+	unsigned long pg_aligned = (phys | 0xFFF) - 0xFFF; //Mask out lower bits
+	unsigned long pg_off = phys & 0xFFF; //Get only lower bits
+    unsigned long off;
+
+    switch (be->kind) {
+    case BACKEND_AXIREGS:
+        off = pg_aligned - AXIREGS_BASE;
+        break;
+    case BACKEND_DEVMEM:
+        off = pg_aligned;
+        break;
+    case BACKEND_UIO:
+        //UIO only lets us map a region from the start, so map the whole
+        //thing and find the FIFO inside it
+        if (phys < be->region_addr || phys + sizeof(AXIStream_FIFO) > be->region_addr + be->region_size) {
+            fprintf(stderr, "Error: 0x%08lx is not inside %s (0x%08lx, size 0x%lx)\n", phys, be->dev, be->region_addr, be->region_size);
+            return NULL;
+        }
+        *cookie = mmap(0, be->region_size, PROT_READ | PROT_WRITE, MAP_SHARED, be->fd, 0);
+        if (*cookie == MAP_FAILED) return NULL;
+        return (volatile AXIStream_FIFO *) (*cookie + (phys - be->region_addr));
+    case BACKEND_SIM: {
+        volatile AXIStream_FIFO *fifo = fifo_model_create(&be->model_cfg, mode, gen);
+        *cookie = (fifo == NULL) ? MAP_FAILED : (void *) fifo;
+        return fifo;
+    }
+    default:
+        return NULL;
+    }
+
+	*cookie = mmap(
+		0, //addr: Can be used to pick & choose virtual addresses. Ignore it.
+		4096, //len: We'll (arbitrarily) map a whole page
+		PROT_READ | PROT_WRITE, //prot: We want to read and write this memory
+		MAP_SHARED, //flags: Allow others to use this memory
+		be->fd, //fildes: File descriptor for device file we're mmmapping
+		off //off: (Page-aligned) offset into FPGA memory
+	);
+    if (*cookie == MAP_FAILED) return NULL;
+
+    return (volatile AXIStream_FIFO *) (*cookie + pg_off);
+}
+
+void backend_unmap(backend *be, void *cookie) {
+    if (cookie == MAP_FAILED) return;
+
+    switch (be->kind) {
+    case BACKEND_UIO:
+        munmap(cookie, be->region_size);
+        break;
+    case BACKEND_SIM:
+        fifo_model_destroy((volatile AXIStream_FIFO *) cookie);
+        break;
+    default:
+        munmap(cookie, 4096);
+        break;
+    }
+}
+
+void backend_close(backend *be) {
+    if (be->fd != -1) close(be->fd);
+    be->fd = -1;
+}
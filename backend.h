@@ -0,0 +1,60 @@
+#ifndef BACKEND_H
+#define BACKEND_H 1
+
+#include "axistreamfifo.h"
+#include "fifo_model.h"
+
+//Where the FIFO registers come from:
+// - axiregs: mmap /dev/mpsoc_axiregs, whose offset 0 is physical address
+//   0xA0000000 (this is what we always did)
+// - devmem:  mmap /dev/mem at the FIFO's physical address
+// - uio:     mmap a UIO device's first memory region, and find the FIFO in
+//            it using the region's address from sysfs
+// - sim:     no hardware at all; each FIFO is a software model (see
+//            fifo_model.h)
+
+typedef enum _backend_kind {
+    BACKEND_AXIREGS,
+    BACKEND_DEVMEM,
+    BACKEND_UIO,
+    BACKEND_SIM
+} backend_kind;
+
+typedef struct _backend {
+    backend_kind kind;
+    char dev[64]; //UIO device
+    fifo_model_cfg model_cfg;
+
+    int fd;
+    unsigned long region_addr; //For UIO: physical address of the region
+    unsigned long region_size; //How much we mmap each time
+} backend;
+
+#define BACKEND_INITIALIZER { \
+    .kind = BACKEND_AXIREGS, \
+    .dev = "", \
+    .model_cfg = FIFO_MODEL_CFG_DEFAULT, \
+    .fd = -1, \
+    .region_addr = 0, \
+    .region_size = 4096 \
+}
+
+//Parses axiregs, devmem, uio:/dev/uioN, or sim[:depth=N,pkt=N,rate=N,cost=NS,stamp=1].
+//Returns 0 on success, -1 (after printing an error) if not
+int backend_parse(backend *be, char const *str);
+
+//Opens the device (if any). Returns 0 on success, -1 (after printing an
+//error) if not
+int backend_open(backend *be);
+
+//Maps the FIFO at phys. Sets *cookie to something to give backend_unmap
+//later, and returns a pointer to the FIFO's registers, or NULL on error. For
+//the sim backend, mode is the FIFO's RX mode and gen says whether anything
+//should be generating flits into it
+volatile AXIStream_FIFO *backend_map(backend *be, unsigned long phys, asfifo_mode_t mode, int gen, void **cookie);
+
+void backend_unmap(backend *be, void *cookie);
+
+void backend_close(backend *be);
+
+#endif
@@ -0,0 +1,590 @@
+#define _GNU_SOURCE             /* See feature_test_macros(7) */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+//End-to-end benchmark for dbg_guv_server. For every combination of rate and
+//packet size, this:
+// - starts the server with the sim backend (-D sim), with stamp=1 so that
+//   every flit is the time it went into the (software) RX FIFO
+// - connects over loopback and reads flits as fast as it can, working out
+//   each one's FIFO-to-socket latency
+// - sends commands back at a fixed rate
+// - samples each server thread's CPU time from /proc
+// - disconnects, waits for the server to exit, and picks the model's totals
+//   (generated/dropped/commands delivered) out of its stderr
+//
+//Results go to stdout as JSON. The server should be built without
+//DEBUG_ON (make bench does this), or it'll spend its time printing.
+
+#define MAX_LIST 16
+#define MAX_THREADS 64
+
+//Latency histogram: 1 us buckets up to LAT_MAX_US, and one overflow bucket
+#define LAT_MAX_US 100000
+
+typedef struct _bench_cfg {
+    char const *server;
+    char mode;
+    unsigned long long rates[MAX_LIST];
+    int num_rates;
+    int pkts[MAX_LIST];
+    int num_pkts;
+    double warmup_secs;
+    double secs;
+    unsigned long long cmd_rate; //Command words per second
+    int port;
+    char **extra; //Extra arguments for the server
+    int num_extra;
+} bench_cfg;
+
+typedef struct _thread_cpu {
+    int tid;
+    char name[32];
+    unsigned long long ticks;
+} thread_cpu;
+
+typedef struct _run_result {
+    unsigned long long words; //Received during the measurement window
+    unsigned long long bad_words; //Stamps from the future (shouldn't happen)
+    unsigned long long cmds_sent;
+    double secs; //Actual length of the measurement window
+
+    //From the model's stats line
+    unsigned long long generated;
+    unsigned long long dropped;
+    unsigned long long read;
+    unsigned long long cmds_delivered;
+    int have_model_stats;
+
+    unsigned long long *lat_hist; //LAT_MAX_US + 1 buckets
+    unsigned long long lat_max_ns;
+
+    thread_cpu cpu_start[MAX_THREADS];
+    int num_cpu_start;
+    thread_cpu cpu_end[MAX_THREADS];
+    int num_cpu_end;
+} run_result;
+
+//Shared between the main thread and the reader/commander threads
+typedef struct _run_state {
+    int sfd;
+    unsigned long long cmd_rate;
+    _Atomic int measuring;
+    _Atomic int stop;
+    run_result *res;
+} run_state;
+
+static unsigned long long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void *reader(void *arg) {
+    run_state *st = (run_state *) arg;
+    run_result *res = st->res;
+
+    static unsigned buf[16384];
+    int leftover = 0; //Bytes of a partial word at the start of buf
+
+    while (!st->stop) {
+        int len = recv(st->sfd, (char *) buf + leftover, sizeof(buf) - leftover, 0);
+        if (len <= 0) break;
+        //Everything in this chunk arrived just now
+        unsigned now = (unsigned) now_ns();
+
+        len += leftover;
+        int n = len / 4;
+        if (st->measuring) {
+            int i;
+            for (i = 0; i < n; i++) {
+                //Stamps are 32-bit nanoseconds, so this is right as long as
+                //nothing takes longer than 4 seconds
+                unsigned lat = now - buf[i];
+                if (lat > 0x80000000u) {
+                    res->bad_words++;
+                    continue;
+                }
+                unsigned us = lat / 1000;
+                res->lat_hist[us > LAT_MAX_US ? LAT_MAX_US : us]++;
+                if (lat > res->lat_max_ns) res->lat_max_ns = lat;
+            }
+            res->words += n;
+        }
+
+        leftover = len - n*4;
+        if (leftover) memmove(buf, (char *) buf + n*4, leftover);
+    }
+
+    return NULL;
+}
+
+static void *commander(void *arg) {
+    run_state *st = (run_state *) arg;
+
+    //Send in 1 ms ticks
+    unsigned long long start = now_ns();
+    unsigned long long sent = 0;
+    unsigned cmds[4096];
+    int i;
+    for (i = 0; i < 4096; i++) cmds[i] = 0xC0DE0000 | i;
+
+    while (!st->stop) {
+        unsigned long long due = (unsigned long long) ((double) st->cmd_rate * (now_ns() - start) / 1e9);
+        while (sent < due) {
+            int n = (due - sent > 4096) ? 4096 : due - sent;
+            int rc = send(st->sfd, cmds, n*4, MSG_NOSIGNAL);
+            if (rc <= 0) return NULL;
+            //We only ever send whole words
+            while (rc % 4) {
+                int more = send(st->sfd, (char *) cmds + rc, 4 - rc % 4, MSG_NOSIGNAL);
+                if (more <= 0) return NULL;
+                rc += more;
+            }
+            sent += rc / 4;
+            if (st->measuring) st->res->cmds_sent += rc / 4;
+        }
+
+        struct timespec ts = {
+            .tv_sec = 0,
+            .tv_nsec = 1000000
+        };
+        nanosleep(&ts, NULL);
+    }
+
+    return NULL;
+}
+
+//Reads every thread's utime+stime out of /proc/PID/task/*/stat. Returns how
+//many threads it found
+static int read_thread_cpu(pid_t pid, thread_cpu *out, int max) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/task", pid);
+    DIR *dir = opendir(path);
+    if (dir == NULL) return 0;
+
+    int n = 0;
+    struct dirent *ent;
+    while (n < max && (ent = readdir(dir)) != NULL) {
+        if (ent->d_name[0] == '.') continue;
+
+        char stat_path[300];
+        snprintf(stat_path, sizeof(stat_path), "/proc/%d/task/%s/stat", pid, ent->d_name);
+        FILE *fp = fopen(stat_path, "r");
+        if (fp == NULL) continue;
+        char line[1024];
+        char *ok = fgets(line, sizeof(line), fp);
+        fclose(fp);
+        if (ok == NULL) continue;
+
+        //The name is in parentheses and might have spaces in it, so find the
+        //last ')' and count fields from there
+        char *open = strchr(line, '(');
+        char *close = strrchr(line, ')');
+        if (open == NULL || close == NULL) continue;
+
+        thread_cpu *t = &out[n];
+        t->tid = atoi(ent->d_name);
+        int name_len = close - open - 1;
+        if (name_len >= (int) sizeof(t->name)) name_len = sizeof(t->name) - 1;
+        memcpy(t->name, open + 1, name_len);
+        t->name[name_len] = '\0';
+
+        //After the ')' come state (field 3), then fields 4-13, then utime
+        //(14) and stime (15)
+        unsigned long long utime, stime;
+        if (sscanf(close + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu", &utime, &stime) != 2) continue;
+        t->ticks = utime + stime;
+        n++;
+    }
+
+    closedir(dir);
+    return n;
+}
+
+static pid_t start_server(bench_cfg const *cfg, unsigned long long rate, int pkt, int port, int err_fd) {
+    char sim[128], port_str[16], mode[2] = {cfg->mode, '\0'};
+    snprintf(sim, sizeof(sim), "sim:rate=%llu,pkt=%d,stamp=1", rate, pkt);
+    snprintf(port_str, sizeof(port_str), "%d", port);
+
+    char *argv[32 + MAX_LIST];
+    int argc = 0;
+    argv[argc++] = (char *) cfg->server;
+    argv[argc++] = "-D";
+    argv[argc++] = sim;
+    argv[argc++] = "-p";
+    argv[argc++] = port_str;
+    int i;
+    for (i = 0; i < cfg->num_extra; i++) argv[argc++] = cfg->extra[i];
+    argv[argc++] = mode;
+    //The address doesn't matter to the model, but it has to be there
+    argv[argc++] = "0xA0000000";
+    argv[argc] = NULL;
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        int null_fd = open("/dev/null", O_WRONLY);
+        dup2(null_fd, 1);
+        dup2(err_fd, 2);
+        execv(cfg->server, argv);
+        fprintf(stderr, "Could not run %s: %s\n", cfg->server, strerror(errno));
+        _exit(127);
+    }
+    return pid;
+}
+
+//Keeps trying to connect until the server is listening. Returns the socket,
+//or -1 if it never comes up
+static int connect_server(int port, pid_t pid) {
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(port),
+        .sin_addr = {htonl(INADDR_LOOPBACK)}
+    };
+
+    int tries;
+    for (tries = 0; tries < 200; tries++) {
+        int sfd = socket(AF_INET, SOCK_STREAM, 0);
+        if (sfd < 0) return -1;
+        if (connect(sfd, (struct sockaddr *) &addr, sizeof(addr)) == 0) {
+            int one = 1;
+            setsockopt(sfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            return sfd;
+        }
+        close(sfd);
+
+        //Don't bother waiting if it already died
+        if (waitpid(pid, NULL, WNOHANG) == pid) return -1;
+        usleep(10000);
+    }
+    return -1;
+}
+
+//Waits up to secs for pid to exit, then kills it
+static void reap_server(pid_t pid, double secs) {
+    int i;
+    for (i = 0; i < secs * 100; i++) {
+        if (waitpid(pid, NULL, WNOHANG) == pid) return;
+        usleep(10000);
+    }
+    fprintf(stderr, "Server didn't exit; killing it\n");
+    kill(pid, SIGTERM);
+    for (i = 0; i < 100; i++) {
+        if (waitpid(pid, NULL, WNOHANG) == pid) return;
+        usleep(10000);
+    }
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+}
+
+static void read_model_stats(int err_fd, run_result *res) {
+    lseek(err_fd, 0, SEEK_SET);
+    FILE *fp = fdopen(dup(err_fd), "r");
+    if (fp == NULL) return;
+
+    char line[512];
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        unsigned long long gen, drop, rd, tx, pkts;
+        if (sscanf(line, "FIFO model: generated %llu words, dropped %llu, read %llu; TX got %llu words in %llu packets",
+                &gen, &drop, &rd, &tx, &pkts) == 5) {
+            res->generated = gen;
+            res->dropped = drop;
+            res->read = rd;
+            res->cmds_delivered = tx;
+            res->have_model_stats = 1;
+        } else {
+            //Pass everything else along, in case it's an error
+            fputs(line, stderr);
+        }
+    }
+    fclose(fp);
+}
+
+static double lat_percentile(run_result const *res, unsigned long long total, double p) {
+    unsigned long long want = (unsigned long long) (p * total);
+    if (want >= total) want = total - 1;
+    unsigned long long seen = 0;
+    int i;
+    for (i = 0; i <= LAT_MAX_US; i++) {
+        seen += res->lat_hist[i];
+        if (seen > want) return i;
+    }
+    return LAT_MAX_US;
+}
+
+//Returns 0 on success, -1 on error
+static int run_one(bench_cfg const *cfg, unsigned long long rate, int pkt, int port, run_result *res) {
+    char err_path[] = "/tmp/e2e_bench_XXXXXX";
+    int err_fd = mkstemp(err_path);
+    if (err_fd < 0) {
+        perror("Could not make temp file");
+        return -1;
+    }
+    unlink(err_path);
+
+    pid_t pid = start_server(cfg, rate, pkt, port, err_fd);
+    if (pid < 0) {
+        perror("Could not fork");
+        close(err_fd);
+        return -1;
+    }
+
+    int sfd = connect_server(port, pid);
+    if (sfd < 0) {
+        fprintf(stderr, "Could not connect to server on port %d\n", port);
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        read_model_stats(err_fd, res);
+        close(err_fd);
+        return -1;
+    }
+
+    run_state st = {
+        .sfd = sfd,
+        .cmd_rate = cfg->cmd_rate,
+        .measuring = 0,
+        .stop = 0,
+        .res = res
+    };
+    pthread_t rd_thread, cmd_thread;
+    pthread_create(&rd_thread, NULL, reader, &st);
+    if (cfg->cmd_rate > 0) pthread_create(&cmd_thread, NULL, commander, &st);
+
+    usleep(cfg->warmup_secs * 1e6);
+
+    res->num_cpu_start = read_thread_cpu(pid, res->cpu_start, MAX_THREADS);
+    unsigned long long start = now_ns();
+    st.measuring = 1;
+
+    usleep(cfg->secs * 1e6);
+
+    st.measuring = 0;
+    res->secs = (now_ns() - start) / 1e9;
+    res->num_cpu_end = read_thread_cpu(pid, res->cpu_end, MAX_THREADS);
+
+    //Hanging up makes the server clean up and exit (which is when the model
+    //prints its totals)
+    st.stop = 1;
+    shutdown(sfd, SHUT_RDWR);
+    pthread_join(rd_thread, NULL);
+    if (cfg->cmd_rate > 0) pthread_join(cmd_thread, NULL);
+    close(sfd);
+
+    reap_server(pid, 5);
+    read_model_stats(err_fd, res);
+    close(err_fd);
+    return 0;
+}
+
+static void print_result(bench_cfg const *cfg, unsigned long long rate, int pkt, run_result const *res, int rc, int first) {
+    printf("%s    {\n", first ? "" : ",\n");
+    printf("      \"mode\": \"%c\",\n", cfg->mode);
+    printf("      \"rate_words_per_sec\": %llu,\n", rate);
+    printf("      \"pkt_words\": %d,\n", pkt);
+    printf("      \"cmd_rate_words_per_sec\": %llu,\n", cfg->cmd_rate);
+    printf("      \"ok\": %s,\n", (rc == 0) ? "true" : "false");
+    printf("      \"secs\": %.3f,\n", res->secs);
+    printf("      \"words\": %llu,\n", res->words);
+    printf("      \"words_per_sec\": %.0f,\n", res->secs > 0 ? res->words / res->secs : 0.0);
+    printf("      \"bytes_per_sec\": %.0f,\n", res->secs > 0 ? res->words * 4 / res->secs : 0.0);
+    printf("      \"bad_stamps\": %llu,\n", res->bad_words);
+    if (res->have_model_stats) {
+        printf("      \"generated\": %llu,\n", res->generated);
+        printf("      \"dropped\": %llu,\n", res->dropped);
+        printf("      \"drop_ratio\": %.6f,\n", (res->generated + res->dropped) ? (double) res->dropped / (res->generated + res->dropped) : 0.0);
+        printf("      \"cmds_delivered\": %llu,\n", res->cmds_delivered);
+    }
+    printf("      \"cmds_sent\": %llu,\n", res->cmds_sent);
+
+    unsigned long long total = 0;
+    int i;
+    for (i = 0; i <= LAT_MAX_US; i++) total += res->lat_hist[i];
+    if (total > 0) {
+        printf("      \"latency_us\": {\"p50\": %.0f, \"p99\": %.0f, \"p999\": %.0f, \"max\": %.1f},\n",
+            lat_percentile(res, total, 0.5),
+            lat_percentile(res, total, 0.99),
+            lat_percentile(res, total, 0.999),
+            res->lat_max_ns / 1000.0);
+    }
+
+    //CPU use of every thread that was there for the whole window
+    long hz = sysconf(_SC_CLK_TCK);
+    printf("      \"cpu_pct\": {");
+    int printed = 0;
+    for (i = 0; i < res->num_cpu_end; i++) {
+        thread_cpu const *end = &res->cpu_end[i];
+        int j;
+        for (j = 0; j < res->num_cpu_start; j++) {
+            thread_cpu const *start = &res->cpu_start[j];
+            if (start->tid != end->tid) continue;
+            double pct = (res->secs > 0) ? 100.0 * (end->ticks - start->ticks) / hz / res->secs : 0.0;
+            printf("%s\"%s/%d\": %.1f", printed ? ", " : "", end->name, end->tid, pct);
+            printed = 1;
+            break;
+        }
+    }
+    printf("}\n");
+    printf("    }");
+}
+
+//Parses a comma-separated list of numbers. Returns how many, or -1 on error
+static int parse_list(char const *str, unsigned long long *out) {
+    char buf[256];
+    if (strlen(str) >= sizeof(buf)) return -1;
+    strcpy(buf, str);
+
+    int n = 0;
+    char *tok;
+    for (tok = strtok(buf, ","); tok != NULL; tok = strtok(NULL, ",")) {
+        if (n == MAX_LIST) return -1;
+        char *end;
+        out[n++] = strtoull(tok, &end, 0);
+        if (*end != '\0') return -1;
+    }
+    return n;
+}
+
+char *usage =
+"Usage: e2e_bench [options] [-- SERVER_OPTIONS...]\n"
+"\n"
+"  Runs dbg_guv_server against its software FIFO model and prints throughput,\n"
+"  drops, latency and per-thread CPU use as JSON. One run per combination of\n"
+"  -r and -k. Anything after -- is passed on to the server (e.g. -- -B -P 100,0,10,100)\n"
+"\n"
+"  Options:\n"
+"    -s PATH   Server to run (default: dbg_guv_server next to this program)\n"
+"    -m c|s    RX FIFO mode (default s)\n"
+"    -r RATES  Comma-separated flit rates in words/s; 0 means flat out\n"
+"              (default 1000000,4000000,0)\n"
+"    -k PKTS   Comma-separated packet sizes in words (default 16,256)\n"
+"    -t SECS   How long to measure each run (default 2)\n"
+"    -w SECS   Warmup before measuring (default 0.5)\n"
+"    -c RATE   Commands per second to send to the server (default 10000)\n"
+"    -p PORT   First port to use; each run uses the next one (default 6555)\n"
+;
+
+int main(int argc, char **argv) {
+    static char default_server[4096];
+    bench_cfg cfg = {
+        .server = NULL,
+        .mode = 's',
+        .rates = {1000000, 4000000, 0},
+        .num_rates = 3,
+        .pkts = {16, 256},
+        .num_pkts = 2,
+        .warmup_secs = 0.5,
+        .secs = 2,
+        .cmd_rate = 10000,
+        .port = 6555
+    };
+
+    unsigned long long tmp[MAX_LIST];
+    int opt, i, j;
+    while ((opt = getopt(argc, argv, "s:m:r:k:t:w:c:p:")) != -1) {
+        switch (opt) {
+        case 's':
+            cfg.server = optarg;
+            break;
+        case 'm':
+            if (strcmp(optarg, "c") && strcmp(optarg, "s")) {
+                fprintf(stderr, "Error: mode must be c or s\n");
+                return -1;
+            }
+            cfg.mode = optarg[0];
+            break;
+        case 'r':
+            cfg.num_rates = parse_list(optarg, cfg.rates);
+            if (cfg.num_rates <= 0) {
+                fprintf(stderr, "Error: bad rate list [%s]\n", optarg);
+                return -1;
+            }
+            break;
+        case 'k':
+            cfg.num_pkts = parse_list(optarg, tmp);
+            if (cfg.num_pkts <= 0) {
+                fprintf(stderr, "Error: bad packet size list [%s]\n", optarg);
+                return -1;
+            }
+            for (i = 0; i < cfg.num_pkts; i++) cfg.pkts[i] = tmp[i];
+            break;
+        case 't':
+            cfg.secs = atof(optarg);
+            break;
+        case 'w':
+            cfg.warmup_secs = atof(optarg);
+            break;
+        case 'c':
+            cfg.cmd_rate = strtoull(optarg, NULL, 0);
+            break;
+        case 'p':
+            cfg.port = atoi(optarg);
+            break;
+        default:
+            puts(usage);
+            return -1;
+        }
+    }
+    cfg.extra = argv + optind;
+    cfg.num_extra = argc - optind;
+    if (cfg.num_extra > MAX_LIST) {
+        fprintf(stderr, "Error: too many server options\n");
+        return -1;
+    }
+
+    if (cfg.secs <= 0 || cfg.warmup_secs < 0) {
+        fprintf(stderr, "Error: -t must be positive and -w can't be negative\n");
+        return -1;
+    }
+
+    if (cfg.server == NULL) {
+        char const *slash = strrchr(argv[0], '/');
+        int dir_len = (slash == NULL) ? 0 : slash - argv[0] + 1;
+        snprintf(default_server, sizeof(default_server), "%.*sdbg_guv_server", dir_len, argv[0]);
+        cfg.server = (dir_len > 0) ? default_server : "./dbg_guv_server";
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    run_result res;
+    res.lat_hist = malloc((LAT_MAX_US + 1) * sizeof(unsigned long long));
+    if (res.lat_hist == NULL) {
+        perror("Could not allocate latency histogram");
+        return -1;
+    }
+
+    printf("{\n  \"server\": \"%s\",\n  \"runs\": [\n", cfg.server);
+    int run = 0, failed = 0;
+    for (i = 0; i < cfg.num_rates; i++) {
+        for (j = 0; j < cfg.num_pkts; j++) {
+            unsigned long long *hist = res.lat_hist;
+            memset(&res, 0, sizeof(res));
+            memset(hist, 0, (LAT_MAX_US + 1) * sizeof(unsigned long long));
+            res.lat_hist = hist;
+
+            fprintf(stderr, "Run %d: rate %llu words/s, %d-word packets\n", run, cfg.rates[i], cfg.pkts[j]);
+            int rc = run_one(&cfg, cfg.rates[i], cfg.pkts[j], cfg.port + run, &res);
+            if (rc < 0) failed++;
+            print_result(&cfg, cfg.rates[i], cfg.pkts[j], &res, rc, run == 0);
+            fflush(stdout);
+            run++;
+        }
+    }
+    printf("\n  ]\n}\n");
+
+    free(res.lat_hist);
+    return failed ? 1 : 0;
+}
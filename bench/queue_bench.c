@@ -0,0 +1,474 @@
+#define _GNU_SOURCE             /* See feature_test_macros(7) */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include "queue.h"
+
+//Microbenchmarks for queue.c. Build with -DQUEUE_STATS_ON (make queue_bench
+//does) so we can also report how often each side had to look at the other
+//side's position, sleep, or wake the other side up.
+//
+//There are three groups:
+// - single: one thread fills the queue with one primitive and drains it with
+//   another, so there's never any contention. This is the bare cost of each
+//   call
+// - edge: the cases around an empty or full queue (polling an empty queue,
+//   filling it to exactly BUF_SIZE, copies that wrap around the end)
+// - spsc: a producer and a consumer thread, pinned to the same CPU or to two
+//   different ones, pushing a fixed number of bytes through
+//
+//Every line is one result; with -j they come out as JSON lines instead, so
+//they can be diffed against an older build.
+
+static int json = 0;
+static double min_secs = 0.2; //Keep repeating a test until it's run this long
+
+static unsigned long long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+//A queue with one (pretend) producer and consumer, so nothing fails
+static void queue_setup(queue *q) {
+    queue tmp = QUEUE_INITIALIZER;
+    *q = tmp;
+    q->num_producers = 1;
+    q->num_consumers = 1;
+}
+
+typedef struct _result {
+    char const *group;
+    char const *name;
+    int size; //Bytes per op
+    char const *cpus; //For spsc, "same" or "diff"
+    unsigned long long ops;
+    unsigned long long ns;
+    queue const *q; //For the counters
+} result;
+
+static void print_result(result const *r) {
+    double ns_op = (double) r->ns / r->ops;
+    double mb_s = (r->size > 0) ? (double) r->ops * r->size / r->ns * 1e3 : 0.0;
+
+    if (json) {
+        printf("{\"group\": \"%s\", \"name\": \"%s\", \"size\": %d, \"cpus\": \"%s\", \"ops\": %llu, "
+            "\"ns_per_op\": %.2f, \"mb_per_sec\": %.1f, "
+            "\"rd_refreshes\": %llu, \"wr_refreshes\": %llu, \"prod_sleeps\": %llu, \"cons_sleeps\": %llu, "
+            "\"prod_wakeups\": %llu, \"cons_wakeups\": %llu}\n",
+            r->group, r->name, r->size, r->cpus, r->ops, ns_op, mb_s,
+            r->q->rd_refreshes, r->q->wr_refreshes, r->q->prod_sleeps, r->q->cons_sleeps,
+            r->q->prod_wakeups, r->q->cons_wakeups);
+    } else {
+        printf("%-6s %-28s %5d %-4s %10.2f %10.1f %10llu %10llu %8llu %8llu %8llu %8llu\n",
+            r->group, r->name, r->size, r->cpus, ns_op, mb_s,
+            r->q->rd_refreshes, r->q->wr_refreshes, r->q->prod_sleeps, r->q->cons_sleeps,
+            r->q->prod_wakeups, r->q->cons_wakeups);
+    }
+    fflush(stdout);
+}
+
+static void print_header() {
+    if (json) return;
+    printf("%-6s %-28s %5s %-4s %10s %10s %10s %10s %8s %8s %8s %8s\n",
+        "group", "name", "size", "cpus", "ns/op", "MB/s",
+        "rd_refr", "wr_refr", "p_sleep", "c_sleep", "p_wake", "c_wake");
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//Single-threaded: fill with one primitive, drain with another
+
+typedef enum _prim {
+    P_ENQUEUE_SINGLE,
+    P_QUEUE_WRITE,
+    P_RESERVE_COMMIT,
+    P_DEQUEUE_SINGLE,
+    P_NB_DEQUEUE_SINGLE,
+    P_DEQUEUE_N,
+    P_NB_DEQUEUE_N,
+    P_DEQUEUE_AVAIL,
+    P_PEEK_RELEASE
+} prim;
+
+static char const *prim_names[] = {
+    "enqueue_single",
+    "queue_write",
+    "reserve+commit_write",
+    "dequeue_single",
+    "nb_dequeue_single",
+    "dequeue_n",
+    "nb_dequeue_n",
+    "dequeue_avail",
+    "peek+release_read"
+};
+
+static char src[BUF_SIZE], dst[BUF_SIZE];
+
+static void do_write(queue *q, prim p, int size) {
+    struct iovec iov[2];
+    switch (p) {
+    case P_ENQUEUE_SINGLE:
+        enqueue_single(q, src[0]);
+        break;
+    case P_QUEUE_WRITE:
+        queue_write(q, src, size);
+        break;
+    case P_RESERVE_COMMIT:
+        queue_reserve_write(q, size, size, iov);
+        memcpy(iov[0].iov_base, src, iov[0].iov_len);
+        memcpy(iov[1].iov_base, src + iov[0].iov_len, iov[1].iov_len);
+        queue_commit_write(q, size);
+        break;
+    default:
+        break;
+    }
+}
+
+static void do_read(queue *q, prim p, int size) {
+    struct iovec iov[2];
+    switch (p) {
+    case P_DEQUEUE_SINGLE:
+        dequeue_single(q, dst);
+        break;
+    case P_NB_DEQUEUE_SINGLE:
+        nb_dequeue_single(q, dst);
+        break;
+    case P_DEQUEUE_N:
+        dequeue_n(q, dst, size);
+        break;
+    case P_NB_DEQUEUE_N:
+        nb_dequeue_n(q, dst, size);
+        break;
+    case P_DEQUEUE_AVAIL:
+        dequeue_avail(q, dst, size);
+        break;
+    case P_PEEK_RELEASE:
+        queue_peek_read(q, size, size, iov);
+        memcpy(dst, iov[0].iov_base, iov[0].iov_len);
+        memcpy(dst + iov[0].iov_len, iov[1].iov_base, iov[1].iov_len);
+        queue_release_read(q, size);
+        break;
+    default:
+        break;
+    }
+}
+
+//Times wr (filling the queue) and rd (draining it) separately, and prints a
+//result for each (or just for rd, if print_wr is 0)
+static void bench_single(prim wr, prim rd, int size, int print_wr) {
+    static queue q;
+    queue_setup(&q);
+
+    int per_fill = BUF_SIZE / size;
+    unsigned long long wr_ns = 0, rd_ns = 0, ops = 0;
+    while (wr_ns + rd_ns < min_secs * 1e9) {
+        int rounds;
+        for (rounds = 0; rounds < 100; rounds++) {
+            int i;
+            unsigned long long t0 = now_ns();
+            for (i = 0; i < per_fill; i++) do_write(&q, wr, size);
+            unsigned long long t1 = now_ns();
+            for (i = 0; i < per_fill; i++) do_read(&q, rd, size);
+            unsigned long long t2 = now_ns();
+            wr_ns += t1 - t0;
+            rd_ns += t2 - t1;
+            ops += per_fill;
+        }
+    }
+
+    if (print_wr) {
+        result r = {"single", prim_names[wr], size, "-", ops, wr_ns, &q};
+        print_result(&r);
+    }
+    result r = {"single", prim_names[rd], size, "-", ops, rd_ns, &q};
+    print_result(&r);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//Edge cases
+
+static void bench_edges() {
+    static queue q;
+    unsigned long long ops, t0;
+    int i;
+
+    //Polling an empty queue: what the FIFO threads do most of the time
+    queue_setup(&q);
+    ops = 0;
+    t0 = now_ns();
+    while (now_ns() - t0 < min_secs * 1e9) {
+        for (i = 0; i < 1000; i++) nb_dequeue_n(&q, dst, 4);
+        ops += 1000;
+    }
+    //(Nothing actually moves, so call it size 0)
+    result r1 = {"edge", "nb_dequeue_n empty", 0, "-", ops, now_ns() - t0, &q};
+    print_result(&r1);
+
+    //Filling the queue to exactly BUF_SIZE and emptying it again, in one go
+    queue_setup(&q);
+    ops = 0;
+    t0 = now_ns();
+    while (now_ns() - t0 < min_secs * 1e9) {
+        for (i = 0; i < 1000; i++) {
+            queue_write(&q, src, BUF_SIZE);
+            dequeue_n(&q, dst, BUF_SIZE);
+        }
+        ops += 1000;
+    }
+    result r2 = {"edge", "write+read BUF_SIZE", BUF_SIZE, "-", ops, now_ns() - t0, &q};
+    print_result(&r2);
+
+    //The same, but starting halfway through the buffer so every copy wraps
+    queue_setup(&q);
+    queue_write(&q, src, BUF_SIZE/2);
+    dequeue_n(&q, dst, BUF_SIZE/2);
+    ops = 0;
+    t0 = now_ns();
+    while (now_ns() - t0 < min_secs * 1e9) {
+        for (i = 0; i < 1000; i++) {
+            queue_write(&q, src, BUF_SIZE);
+            dequeue_n(&q, dst, BUF_SIZE);
+        }
+        ops += 1000;
+    }
+    result r3 = {"edge", "write+read BUF_SIZE wrapped", BUF_SIZE, "-", ops, now_ns() - t0, &q};
+    print_result(&r3);
+
+    //A 64-byte write straddling the end of the buffer, against one that
+    //doesn't
+    int off;
+    for (off = 0; off < 2; off++) {
+        queue_setup(&q);
+        unsigned start = off ? BUF_SIZE - 32 : 0;
+        queue_write(&q, src, start);
+        dequeue_n(&q, dst, start);
+        ops = 0;
+        t0 = now_ns();
+        while (now_ns() - t0 < min_secs * 1e9) {
+            for (i = 0; i < 1000; i++) {
+                queue_write(&q, src, 64);
+                dequeue_n(&q, dst, 64);
+                //Put the positions back where they were
+                q.wr_pos -= 64;
+                q.rd_pos -= 64;
+                q.wr_cache = q.wr_pos;
+                q.rd_cache = q.rd_pos;
+            }
+            ops += 1000;
+        }
+        result r = {"edge", off ? "write+read 64 straddling" : "write+read 64 aligned", 64, "-", ops, now_ns() - t0, &q};
+        print_result(&r);
+    }
+
+    //A write that's too big has to fail without touching anything
+    queue_setup(&q);
+    if (queue_write(&q, src, BUF_SIZE + 1) != -1 || PTR_QUEUE_OCCUPANCY(&q) != 0) {
+        fprintf(stderr, "Error: queue_write of BUF_SIZE+1 bytes didn't fail cleanly\n");
+        exit(1);
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//One producer, one consumer
+
+typedef enum _spsc_kind {
+    SPSC_BLOCKING, //queue_write / dequeue_n
+    SPSC_POLLING, //queue_write / nb_dequeue_n, yielding when empty
+    SPSC_SPANS //reserve+commit / peek+release, as much as fits each time
+} spsc_kind;
+
+static char const *spsc_names[] = {
+    "queue_write/dequeue_n",
+    "queue_write/nb_dequeue_n",
+    "reserve/peek spans"
+};
+
+typedef struct _spsc_args {
+    queue *q;
+    spsc_kind kind;
+    int size;
+    unsigned long long bytes;
+    int cpu;
+    unsigned long long sum; //So the consumer's reads don't get optimized out
+} spsc_args;
+
+static void pin(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+        fprintf(stderr, "Warning: could not pin to CPU %d\n", cpu);
+    }
+}
+
+static void *spsc_producer(void *arg) {
+    spsc_args *a = (spsc_args *) arg;
+    pin(a->cpu);
+
+    char buf[BUF_SIZE];
+    memset(buf, 0x5A, sizeof(buf));
+    unsigned long long done = 0;
+    while (done < a->bytes) {
+        if (a->kind == SPSC_SPANS) {
+            struct iovec iov[2];
+            int n = queue_reserve_write(a->q, 1, a->size, iov);
+            if (n < 0) break;
+            memcpy(iov[0].iov_base, buf, iov[0].iov_len);
+            memcpy(iov[1].iov_base, buf, iov[1].iov_len);
+            queue_commit_write(a->q, n);
+            done += n;
+        } else {
+            if (queue_write(a->q, buf, a->size) < 0) break;
+            done += a->size;
+        }
+    }
+
+    queue_add_producers(a->q, -1);
+    return NULL;
+}
+
+static void *spsc_consumer(void *arg) {
+    spsc_args *a = (spsc_args *) arg;
+    pin(a->cpu);
+
+    char buf[BUF_SIZE];
+    unsigned long long done = 0;
+    while (done < a->bytes) {
+        if (a->kind == SPSC_SPANS) {
+            struct iovec iov[2];
+            int n = queue_peek_read(a->q, 1, a->size, iov);
+            if (n < 0) break;
+            memcpy(buf, iov[0].iov_base, iov[0].iov_len);
+            memcpy(buf + iov[0].iov_len, iov[1].iov_base, iov[1].iov_len);
+            queue_release_read(a->q, n);
+            done += n;
+        } else if (a->kind == SPSC_POLLING) {
+            int rc = nb_dequeue_n(a->q, buf, a->size);
+            if (rc < 0) break;
+            if (rc == 1) {
+                sched_yield();
+                continue;
+            }
+            done += a->size;
+        } else {
+            if (dequeue_n(a->q, buf, a->size) < 0) break;
+            done += a->size;
+        }
+        a->sum += buf[0];
+    }
+
+    return NULL;
+}
+
+static void bench_spsc(spsc_kind kind, int size, int prod_cpu, int cons_cpu, unsigned long long bytes) {
+    static queue q;
+    queue_setup(&q);
+
+    spsc_args prod = {&q, kind, size, bytes, prod_cpu, 0};
+    spsc_args cons = {&q, kind, size, bytes, cons_cpu, 0};
+
+    unsigned long long t0 = now_ns();
+    pthread_t pt, ct;
+    pthread_create(&ct, NULL, spsc_consumer, &cons);
+    pthread_create(&pt, NULL, spsc_producer, &prod);
+    pthread_join(pt, NULL);
+    pthread_join(ct, NULL);
+    unsigned long long ns = now_ns() - t0;
+
+    //For spans, an "op" is size bytes' worth, so ns/op compares with the rest
+    result r = {"spsc", spsc_names[kind], size, (prod_cpu == cons_cpu) ? "same" : "diff", bytes / size, ns, &q};
+    print_result(&r);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+char *usage =
+"Usage: queue_bench [-j] [-t SECS] [-b MB] [-c CPU0,CPU1]\n"
+"\n"
+"  Measures the queue.c primitives. See the top of queue_bench.c.\n"
+"\n"
+"  Options:\n"
+"    -j        Print JSON lines instead of a table\n"
+"    -t SECS   How long to run each single-threaded test (default 0.2)\n"
+"    -b MB     How much to push through each producer/consumer test\n"
+"              (default 64)\n"
+"    -c A,B    CPUs to use for the producer/consumer tests (default 0,1).\n"
+"              The \"same\" tests put both threads on A\n"
+;
+
+int main(int argc, char **argv) {
+    int cpu_a = 0, cpu_b = 1;
+    unsigned long long spsc_bytes = 64ULL << 20;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "jt:b:c:")) != -1) {
+        switch (opt) {
+        case 'j':
+            json = 1;
+            break;
+        case 't':
+            min_secs = atof(optarg);
+            break;
+        case 'b':
+            spsc_bytes = strtoull(optarg, NULL, 0) << 20;
+            break;
+        case 'c':
+            if (sscanf(optarg, "%d,%d", &cpu_a, &cpu_b) != 2) {
+                fprintf(stderr, "Error: -c takes two CPUs, like 0,1\n");
+                return -1;
+            }
+            break;
+        default:
+            puts(usage);
+            return -1;
+        }
+    }
+    if (min_secs <= 0 || spsc_bytes == 0) {
+        fprintf(stderr, "Error: -t and -b must be positive\n");
+        return -1;
+    }
+
+    int sizes[] = {1, 4, 64, 1024};
+    int num_sizes = sizeof(sizes) / sizeof(*sizes);
+    int i;
+
+    print_header();
+
+    //Single-character primitives
+    bench_single(P_ENQUEUE_SINGLE, P_DEQUEUE_SINGLE, 1, 1);
+    bench_single(P_ENQUEUE_SINGLE, P_NB_DEQUEUE_SINGLE, 1, 0);
+
+    for (i = 0; i < num_sizes; i++) {
+        int sz = sizes[i];
+        bench_single(P_QUEUE_WRITE, P_DEQUEUE_N, sz, 1);
+        bench_single(P_QUEUE_WRITE, P_NB_DEQUEUE_N, sz, 0);
+        bench_single(P_QUEUE_WRITE, P_DEQUEUE_AVAIL, sz, 0);
+        bench_single(P_RESERVE_COMMIT, P_PEEK_RELEASE, sz, 1);
+    }
+
+    bench_edges();
+
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    int pairs[2][2] = {{cpu_a, cpu_a}, {cpu_a, cpu_b}};
+    int p;
+    for (p = 0; p < 2; p++) {
+        if (pairs[p][0] >= ncpu || pairs[p][1] >= ncpu) {
+            fprintf(stderr, "Skipping producer/consumer on CPUs %d,%d: only %ld CPUs\n", pairs[p][0], pairs[p][1], ncpu);
+            continue;
+        }
+        for (i = 0; i < num_sizes; i++) {
+            int sz = sizes[i];
+            //Byte-at-a-time through two threads is slow; don't wait all day
+            unsigned long long bytes = (sz < 64) ? spsc_bytes / 16 : spsc_bytes;
+            bench_spsc(SPSC_BLOCKING, sz, pairs[p][0], pairs[p][1], bytes);
+            bench_spsc(SPSC_POLLING, sz, pairs[p][0], pairs[p][1], bytes);
+            bench_spsc(SPSC_SPANS, sz, pairs[p][0], pairs[p][1], bytes);
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,88 @@
+#define _GNU_SOURCE             /* See feature_test_macros(7) */
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "capture.h"
+
+int capture_open(capture_file *c, char const *path, uint64_t data_size, uint32_t flags) {
+    snprintf(c->path, sizeof(c->path), "%s", path);
+    c->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (c->fd < 0) {
+        fprintf(stderr, "Could not open capture file %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    //Actually allocate the blocks, so we don't find out the disk is full
+    //halfway through a capture (or take a hit allocating them later)
+    uint64_t total = CAPTURE_HDR_SIZE + data_size;
+    int rc = posix_fallocate(c->fd, 0, total);
+    if (rc != 0) {
+        fprintf(stderr, "Could not allocate %llu bytes for capture file %s: %s\n",
+            (unsigned long long) total, path, strerror(rc));
+        close(c->fd);
+        return -1;
+    }
+
+    void *p = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_SHARED, c->fd, 0);
+    if (p == MAP_FAILED) {
+        fprintf(stderr, "Could not map capture file %s: %s\n", path, strerror(errno));
+        close(c->fd);
+        return -1;
+    }
+    c->hdr = (capture_hdr *) p;
+    c->data = (unsigned char *) p + CAPTURE_HDR_SIZE;
+    c->size = data_size;
+    c->wr = 0;
+
+    //Fault every page in now (a write, so the filesystem gets its say too)
+    long page = sysconf(_SC_PAGESIZE);
+    uint64_t off;
+    for (off = 0; off < data_size; off += page) c->data[off] = 0;
+
+    capture_hdr hdr = {
+        .magic = CAPTURE_MAGIC,
+        .version = CAPTURE_VERSION,
+        .flags = flags,
+        .hdr_size = CAPTURE_HDR_SIZE,
+        .data_size = data_size,
+        .wr = 0,
+        .wraps = 0
+    };
+    memcpy(c->hdr, &hdr, sizeof(hdr));
+    return 0;
+}
+
+void capture_put(capture_file *c, void const *src, int len) {
+    unsigned char const *p = (unsigned char const *) src;
+    while (len > 0) {
+        uint64_t idx = c->wr % c->size;
+        uint64_t chunk = c->size - idx;
+        if (chunk > len) chunk = len;
+        memcpy(c->data + idx, p, chunk);
+        p += chunk;
+        len -= chunk;
+        c->wr += chunk;
+    }
+}
+
+void capture_commit(capture_file *c) {
+    //wraps first, so that anyone who sees the new wr sees the new wraps too
+    __atomic_store_n(&c->hdr->wraps, c->wr / c->size, __ATOMIC_RELAXED);
+    __atomic_store_n(&c->hdr->wr, c->wr, __ATOMIC_RELEASE);
+}
+
+void capture_print(FILE *fp, capture_file *c) {
+    uint64_t wr = __atomic_load_n(&c->hdr->wr, __ATOMIC_ACQUIRE);
+    fprintf(fp, "  capture: %llu bytes to %s; wrapped %llu times\n",
+        (unsigned long long) wr, c->path, (unsigned long long) (wr / c->size));
+    fflush(fp);
+}
+
+void capture_close(capture_file *c) {
+    msync(c->hdr, CAPTURE_HDR_SIZE + c->size, MS_SYNC);
+    munmap(c->hdr, CAPTURE_HDR_SIZE + c->size);
+    close(c->fd);
+}
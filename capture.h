@@ -0,0 +1,75 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H 1
+
+#include <stdio.h>
+#include <stdint.h>
+
+//Capture to disk (-C). Everything read out of an RX FIFO is also copied into
+//a file, which is used as a ring: once it's full, the oldest data gets
+//overwritten. The file is allocated up front and mmapped, so saving a burst
+//is just a memcpy into the page cache and a store to the header; we never
+//call write() or msync() on the data path, and the kernel writes the pages
+//back whenever it likes. The file survives us crashing (though not the board
+//losing power before the kernel has written it back), and can be copied off
+//and read later.
+//
+//The file is a capture_hdr, padded out to CAPTURE_HDR_SIZE bytes, followed by
+//data_size bytes of ring. Byte number p of the stream (counting from 0 since
+//the capture started) lives at offset CAPTURE_HDR_SIZE + p % data_size, so
+//the valid data is the last min(wr, data_size) bytes before wr. The data is
+//flits in the server's byte order or, if CAPTURE_FRAMED is set, frames as
+//described in frame.h. These are only ever unfiltered FRAME_FLITS frames
+//(never compressed, and with no replies to the client mixed in).
+//
+//Capturing starts as soon as the server does, not when a client connects.
+//
+//wr is only updated once the data before it is in place, so it's safe to
+//trust after a crash. If you read the file while we're still writing it,
+//read wr first, copy the data, then read wr again: anything that was more
+//than data_size bytes behind the second wr may have been overwritten.
+
+#define CAPTURE_MAGIC 0x50434744 //"DGCP" when read little-endian
+#define CAPTURE_VERSION 1
+#define CAPTURE_HDR_SIZE 4096
+
+//Bits in capture_hdr.flags
+#define CAPTURE_FRAMED (1<<0)
+
+typedef struct _capture_hdr {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t flags;
+    uint32_t hdr_size; //Always CAPTURE_HDR_SIZE, for now
+    uint64_t data_size;
+    uint64_t wr; //Bytes ever written
+    uint64_t wraps; //How many times we went past the end of the ring
+} capture_hdr; //No padding, so no need to pack it
+
+typedef struct _capture_file {
+    char path[256];
+    int fd;
+    capture_hdr *hdr; //Start of the mapping
+    unsigned char *data;
+    uint64_t size;
+    uint64_t wr; //Our copy of hdr->wr, including anything not committed yet
+} capture_file;
+
+//Creates (or overwrites) path as a capture file with a ring of the given
+//size, and maps it in. Every page is touched up front, so the RX path won't
+//fault on them the first time around. Returns 0 on success, -1 on error (and
+//prints why)
+int capture_open(capture_file *c, char const *path, uint64_t data_size, uint32_t flags);
+
+//Copies len bytes into the ring. Nobody sees them until capture_commit
+void capture_put(capture_file *c, void const *src, int len);
+
+//Publishes everything put since the last commit
+void capture_commit(capture_file *c);
+
+//Prints how much has been captured
+void capture_print(FILE *fp, capture_file *c);
+
+//Flushes the file to disk and unmaps it
+void capture_close(capture_file *c);
+
+#endif
@@ -10,293 +10,338 @@
 #include <pthread.h>
 #include <sched.h>
 #include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <signal.h>
 #include "axistreamfifo.h"
 #include "queue.h"
+#include "net_mgr.h"
+#include "fifo_mgr.h"
+#include "flit_ring.h"
+#include "fanout.h"
+#include "rtc.h"
+#include "irq.h"
+#include "poll_policy.h"
+#include "rt.h"
+#include "backend.h"
+#include "fifo_model.h"
+#include "stats.h"
+#include "lat.h"
+#include "trace.h"
+#include "capture.h"
+#include "replay.h"
 
 //I'm the first to admit it: this code has undergone a process known as...
 // ~~S~P~A~G~H~E~T~T~I~F~I~C~A~T~I~O~N~~
 //This comment is here to help my future self disentangle what's going on.
 //
-//There are four threads. By the way, "ingress" and "egress" are named from the
-//point of view of this program
+//Each pair of AXI-Stream FIFOs (one receiving flits, one sending commands)
+//is a "channel", and gets its own port. There are four threads per channel.
+//By the way, "ingress" and "egress" are named from the point of view of this
+//program
 //
 //net_tx: Reads from the egress queue, and writes to the socket for the client
 //net_mgr: Manages starting and stopping net_tx, and also reads from the client
 //         and places data into ingress queue
+//(both in net_mgr.c)
 //
 //fifo_tx: Reads from the egress queue, and writes to the AXI Stream FIFO that
 //         sends dbg_guv commands
-//fifo_mgr: Manages starting and stopping fifo_tx, and also reads from the FIFO
-//          and places data into ingress queue
+//fifo_mgr: Reads from the FIFO and places data into ingress queue. In shared
+//          mode, a single fifo_poller thread does this for every channel
+//(both in fifo_mgr.c)
 
-//The big idea: the egress queue being sent by fifo_tx is the ingress queue 
+//The big idea: the egress queue being sent by fifo_tx is the ingress queue
 //being filled by fifo_mgr. Likewise, the egress queue being sent by net_tx is
 //the ingress queue being filled by net_mgr.
+//
+//When the client disconnects, net_mgr takes down net_tx and tells both queues
+//that it's gone, which makes fifo_mgr and fifo_tx quit on their own.
+//
+//In fan-out mode (-F) it's a little different. fifo_mgr writes flits into a
+//flit_ring instead of the egress queue, and fanout_mgr (in fanout.c, but its
+//thread is still called net_mgr) takes the place of net_mgr and net_tx. It
+//accepts any number of clients and gives each one a pair of threads: one
+//that sends it flits out of the ring, and one that reads its commands into
+//the ingress queue. Clients coming and going doesn't stop anything; we run
+//until we get SIGINT or SIGTERM.
+//
+//Daemon mode (-d) is fan-out mode where new clients pick up where the last
+//one left off. The FIFOs are only reset once, when we start, and the ring
+//keeps catching flits while nobody is connected.
+//
+//With -w, fifo_mgr puts each packet into the egress queue as a frame (see
+//frame.h), and net_tx only sends whole frames, so the client can see where
+//packets begin and end. Commands come in frames too; fifo_tx acks command
+//packets (and answers option changes) by handing frames to fifo_mgr (over 
+//reply_queue), since only fifo_mgr may write to net_tx's queue. If the
+//client asks for compression, net_tx compresses flit frames on the way out.
+//
+//With -S, clients start with a handshake (see session.h) that gives them the
+//sequence number of every flit, and lets them resume from where they were if
+//their connection drops.
+//
+//Run-to-completion mode (-r) throws all of the above out. A single rtc_loop
+//thread (in rtc.c) serves every channel, moving flits from the RX FIFO
+//straight into the client's socket and commands from the socket straight
+//into the TX FIFO. No queues, no condvars, no other threads.
 
-typedef struct _net_mgr_info {
-    //Never modified by the thread
-    int server_sfd;
-    int stop;
-    
-    //These values shuldn't be touched by the main thread
-    pthread_mutex_t mutex;
-    pthread_cond_t can_write;
-    int client_sfd;
-    int client_is_connected;
-    
-    //The RX thread takes care of spinning up and down the TX thread
-    pthread_t tx_thread;
-    int tx_thread_started;
-    
-    queue *ingress;
-    queue *egress;
-} net_mgr_info;
-
-void* net_tx(void *arg) {
-#ifdef DEBUG_ON
-    static int total_sent = 0;
-    fprintf(stderr, "Entered network tx thread\n");
-    fflush(stderr);
-#endif
-    net_mgr_info *info = (net_mgr_info *) arg;
-    queue *q = info->egress;
-    
-    //Just to be safe, wait until the signal that we can write
-    pthread_mutex_lock(&info->mutex);
-    while (!info->client_is_connected) pthread_cond_wait(&info->can_write, &info->mutex);
-    pthread_mutex_unlock(&info->mutex);
-    
-#ifdef DEBUG_ON
-    fprintf(stderr, "Beginning tx thread loop\n");
-    fflush(stderr);
-#endif
-    char cmd[4];
-    
-    while(dequeue_n(q, cmd, 4) >= 0) {
-        int rc = write(info->client_sfd, cmd, 4);
-#ifdef DEBUG_ON
-        total_sent += 4;
-        fprintf(stderr, "Total sent: %d\n", total_sent);
-#endif
-        if (rc <= 0) {
-            break;
-        }
+//Quick and dirty; don't bother with dynamic allocation
+#define MAX_CHANNELS 16
+#define DEFAULT_PORT 5555
+#define DEFAULT_RING_MB 4
+#define DEFAULT_CAPTURE_MB 64
+
+typedef struct _channel {
+    //From the command line
+    asfifo_mode_t rx_mode;
+    unsigned long rd_fifo_phys;
+    unsigned long wr_fifo_phys;
+    int cpu; //CPU to pin fifo_mgr to, or -1 to let Linux decide
+    char irq_path[64]; //UIO device for the RX FIFO's interrupt, or "" to poll
+
+    int sfd;
+    int port;
+    void *base_rx;
+    void *base_tx;
+    irq_src rx_irq;
+
+    queue net_rx_queue;
+    queue net_tx_queue;
+    queue reply_queue; //Only used with -w
+    _Atomic unsigned opts; //FRAME_OPT_* bits, with -w
+
+    //Counters for this channel, and which queues it uses (for printing them;
+    //NULL if this mode doesn't use that queue)
+    pipe_stats stats;
+    queue *stats_flit_q;
+    queue *stats_cmd_q;
+    net_mgr_info net_mgr_args;
+    fifo_mgr_info fifo_mgr_args;
+
+    //Only used with -H
+    pipe_lat lat;
+
+    //Only used with -C
+    capture_file capture;
+    int capture_ok;
+    _Atomic int attached; //A client has connected
+
+    //Only used with -X and -k
+    replay_script replay;
+    int replay_ok;
+    replay_recorder recorder;
+    int recorder_ok;
+
+    //Only used in fan-out mode
+    flit_ring ring;
+    int ring_ok;
+    fanout_info fanout_args;
+
+    //Only used in run-to-completion mode
+    rtc_info rtc_args;
+
+    pthread_t net_mgr_thread;
+    pthread_t fifo_mgr_thread;
+    pthread_t fifo_tx_thread;
+} channel;
+
+static channel channels[MAX_CHANNELS];
+static int num_channels = 0;
+
+//Parses a FIFO address and makes sure it's sane. Returns 0 on success, or -1
+//(after printing an error) if not
+static int parse_fifo_addr(char const *str, char const *name, unsigned long *phys) {
+    int rc = sscanf(str, "%lx", phys);
+    if (rc != 1) {
+        fprintf(stderr, "Error: could not parse %s = [%s]\n", name, str);
+        return -1;
     }
-    
-    pthread_exit(NULL);
+    //Check phys has 32 bit alignment
+    if (*phys & 0b11) {
+        printf("Error! Addresses must be 32-bit aligned\n");
+        return -1;
+    }
+
+    return 0;
 }
 
-void net_mgr_cleanup(void *arg) {
-#ifdef DEBUG_ON
-    fprintf(stderr, "Entered network manager cleanup\n");
-    fflush(stderr);
-#endif
-    net_mgr_info *info = (net_mgr_info *) arg;
-    queue *q = info->ingress;
-    
-    pthread_mutex_lock(&info->egress->mutex);
-    info->egress->num_producers = -1;
-    pthread_mutex_unlock(&info->egress->mutex);
-    
-    //No real need to lock/unlock mutex, but we'll do it for consistency
-    pthread_mutex_lock(&info->mutex);
-    if (info->tx_thread_started) {
-        pthread_cond_broadcast(&info->egress->can_cons);
-        pthread_join(info->tx_thread, NULL);
-    }
-    
-#ifdef DEBUG_ON
-    fprintf(stderr, "TX thread joined\n");
-    fflush(stderr);
-#endif
-    if(info->client_is_connected) {
-        close(info->client_sfd);
-        info->client_sfd = -1;
-        info->client_is_connected = 0;
+//Adds a channel. tx_str can be NULL if the same FIFO is used for both
+//directions, and irq_path can be NULL to poll the RX FIFO. Returns 0 on 
+//success, or -1 (after printing an error) if not
+static int add_channel(char const *mode_str, char const *rx_str, char const *tx_str, int cpu, char const *irq_path) {
+    if (num_channels >= MAX_CHANNELS) {
+        fprintf(stderr, "Error: can't have more than %d FIFO pairs\n", MAX_CHANNELS);
+        return -1;
     }
-    pthread_mutex_unlock(&info->mutex);
-    
-#ifdef DEBUG_ON
-    fprintf(stderr, "Closed socket\n");
-    fflush(stderr);
-#endif
-    
-    pthread_mutex_lock(&q->mutex);
-    q->num_producers--;
-    pthread_mutex_unlock(&q->mutex);
-}
+    channel *ch = &channels[num_channels];
 
-//Remember to increment arg->q->num_producers before spinning up this thread
-void* net_mgr(void *arg) {
-#ifdef DEBUG_ON
-    fprintf(stderr, "Entered network manager\n");
-    fflush(stderr);
-#endif
-    net_mgr_info *info = (net_mgr_info *) arg;
-    queue *q = info->ingress;
-    
-    info->client_is_connected = 0;
-    info->tx_thread_started = 0;
-    
-    pthread_cleanup_push(net_mgr_cleanup, arg);
-    
-    //Listen for and accept incoming connections
-    int rc = listen(info->server_sfd, 1);
-    if (rc < 0) {
-        perror("Could not listen on socket");
-        goto done;
-    }
-    
-    struct sockaddr_in client_addr; //In case we ever want to use it
-    unsigned client_addr_len = sizeof(client_addr);
-    int client_sfd = accept(info->server_sfd, (struct sockaddr*)&client_addr, &client_addr_len);
-    if (client_sfd < 0) {
-        perror("Could not accept incoming connection");
-        goto done;
-    }
-    info->client_sfd = client_sfd;
-    info->client_is_connected = 1;
-    
-    //We can spin up the TX thread
-    //Although we can't really do this for the call to accept, we'll at least
-    //use the mutex here to make sure that starting the TX thread and setting
-    //the tx_thread_started flag are performed atomically
-    pthread_mutex_lock(&info->mutex);
-    pthread_create(&info->tx_thread, NULL, net_tx, info); //Should be non-blocking, right?
-    pthread_setname_np(info->tx_thread, "net_mgr_tx");
-    info->tx_thread_started = 1;
-    pthread_mutex_unlock(&info->mutex);
-    
-    //Now we just read in a loop, constantly filling the queue
-    int len;
-    char buf[64];
-    while(1) {
-        pthread_mutex_lock(&info->mutex);
-        if (info->stop) {
-            pthread_mutex_unlock(&info->mutex);
-            break;
-        }
-        pthread_mutex_unlock(&info->mutex);
-        len = read(client_sfd, buf, 64);
-        if (len == 0) {
-            break;
-        } else if (len < 0) {
-            perror("Error reading from network");
-            break;
+    //Parse the mode string
+    if (strlen(mode_str) != 1 || (mode_str[0] != 'c' && mode_str[0] != 's')) {
+        fprintf(stderr, "FIFO mode must be \"c\" or \"s\"; you entered [%s]\n", mode_str);
+        return -1;
+    }
+    ch->rx_mode = (mode_str[0] == 'c') ? CUT_THROUGH : STORE_AND_FORWARD;
+
+    if (parse_fifo_addr(rx_str, "RX_ADDR", &ch->rd_fifo_phys) < 0) return -1;
+    if (tx_str == NULL) {
+        ch->wr_fifo_phys = ch->rd_fifo_phys;
+    } else if (parse_fifo_addr(tx_str, "TX_ADDR", &ch->wr_fifo_phys) < 0) {
+        return -1;
+    }
+
+    ch->cpu = cpu;
+    ch->irq_path[0] = '\0';
+    if (irq_path != NULL) {
+        if (strlen(irq_path) >= sizeof(ch->irq_path)) {
+            fprintf(stderr, "Error: interrupt device name [%s] is too long\n", irq_path);
+            return -1;
         }
-        
-        queue_write(q, buf, len);
+        strcpy(ch->irq_path, irq_path);
     }
-    
-    done:
-    pthread_cleanup_pop(1);
-    pthread_exit(NULL);
+    ch->rx_irq = (irq_src) IRQ_SRC_INITIALIZER;
+    ch->sfd = -1;
+    ch->base_rx = MAP_FAILED;
+    ch->base_tx = MAP_FAILED;
+
+    num_channels++;
+    return 0;
 }
 
-typedef struct _fifo_mgr_info {
-    volatile AXIStream_FIFO *rx_fifo;
-    asfifo_mode_t rx_mode;
-    volatile AXIStream_FIFO *tx_fifo;
-    int stop;
-    
-    pthread_mutex_t mutex;
-    
-    pthread_t tx_thread;
-    
-    queue *ingress;
-    queue *egress;
-} fifo_mgr_info;
-
-void *fifo_tx(void *arg) {
-#ifdef DEBUG_ON
-    fprintf(stderr, "Entered FIFO TX\n");
-    fflush(stderr);
-#endif
-    fifo_mgr_info *info = (fifo_mgr_info*) arg;
-    queue *q = info->egress;
-    
-    unsigned val;
-    
-    //Endianness? I'll just fix it if it's wrong.
-    while(dequeue_n(q, (char*) &val, sizeof(unsigned)) >= 0) {
-        int rc = send_words(info->tx_fifo, &val, 1);
-        if (rc < 0) {
-            break;
+//Parses a channel spec of the form c|s:0xRX_ADDR[:0xTX_ADDR][!UIO_DEV][@CPU]
+//and adds the channel. Returns 0 on success, -1 on error
+static int add_channel_spec(char const *spec) {
+    char buf[128];
+    if (strlen(spec) >= sizeof(buf)) {
+        fprintf(stderr, "Error: FIFO spec [%s] is too long\n", spec);
+        return -1;
+    }
+    strcpy(buf, spec);
+
+    char *irq_path = NULL;
+    char *bang = strchr(buf, '!');
+    if (bang != NULL) {
+        *bang = '\0';
+        irq_path = bang + 1;
+    }
+
+    int cpu = -1;
+    char *at = strchr(buf, '@');
+    if (at == NULL && irq_path != NULL) at = strchr(irq_path, '@');
+    if (at != NULL) {
+        *at = '\0';
+        if (sscanf(at + 1, "%d", &cpu) != 1 || cpu < 0) {
+            fprintf(stderr, "Error: could not parse CPU in [%s]\n", spec);
+            return -1;
         }
     }
-    
-    pthread_exit(NULL);    
+
+    char *mode_str = strtok(buf, ":");
+    char *rx_str = strtok(NULL, ":");
+    char *tx_str = strtok(NULL, ":");
+    if (mode_str == NULL || rx_str == NULL || strtok(NULL, ":") != NULL) {
+        fprintf(stderr, "Error: FIFO spec [%s] should look like c|s:0xRX_ADDR[:0xTX_ADDR][!UIO_DEV][@CPU]\n", spec);
+        return -1;
+    }
+    if (irq_path != NULL && irq_path[0] == '\0') {
+        fprintf(stderr, "Error: missing interrupt device after '!' in [%s]\n", spec);
+        return -1;
+    }
+
+    return add_channel(mode_str, rx_str, tx_str, cpu, irq_path);
 }
 
-void fifo_mgr_cleanup(void *arg) {
-#ifdef DEBUG_ON
-    fprintf(stderr, "Entered FIFO manager cleanup\n");
-    fflush(stderr);
-#endif
-    fifo_mgr_info *info = (fifo_mgr_info*) arg;
-    queue *q = info->ingress;
-    
-    pthread_cond_broadcast(&info->egress->can_cons);
-    pthread_join(info->tx_thread, NULL);
-    
-#ifdef DEBUG_ON
-    fprintf(stderr, "TX FIFO thread joined\n");
-    fflush(stderr);
-#endif
-    pthread_mutex_lock(&q->mutex);
-    q->num_producers--;
-    pthread_mutex_unlock(&q->mutex);
+//Reads channel specs out of a file, one per line. Blank lines and anything
+//after a '#' are ignored. Returns 0 on success, -1 on error
+static int read_config(char const *fname) {
+    FILE *fp = fopen(fname, "r");
+    if (fp == NULL) {
+        perror("Could not open config file");
+        return -1;
+    }
+
+    char line[256];
+    int rc = 0;
+    while (rc == 0 && fgets(line, sizeof(line), fp) != NULL) {
+        char *hash = strchr(line, '#');
+        if (hash != NULL) *hash = '\0';
+
+        char *spec = strtok(line, " \t\r\n");
+        if (spec == NULL) continue;
+        rc = add_channel_spec(spec);
+    }
+
+    fclose(fp);
+    return rc;
 }
 
-//Remember to increment number of producers before spinning up thread
-void* fifo_mgr(void *arg) {
-#ifdef DEBUG_ON
-    static int total_read = 0;
-    fprintf(stderr, "Entered FIFO manager\n");
-    fflush(stderr);
-#endif
-    fifo_mgr_info *info = (fifo_mgr_info*) arg;
-    //Assume FIFO is in a valid state. 
-    rw_state_t rx_fifo_state = READ_WORDS_IDLE;
-    
-    queue *q = info->ingress;
-    
-    pthread_create(&info->tx_thread, NULL, fifo_tx, info);
-    pthread_setname_np(info->tx_thread, "fifo_mgr_tx");
-    pthread_cleanup_push(fifo_mgr_cleanup, info);
-    
-    while (1) {
-        pthread_mutex_lock(&info->mutex);
-        if (info->stop) {
-            pthread_mutex_unlock(&info->mutex);
-            break;
-        }
-        pthread_mutex_unlock(&info->mutex);
-        
-        //Read from queue (which contains commands) and send them
-        //Endianness is gonna bite me here...
-        unsigned val;
-        int len = read_words(info->rx_fifo, info->rx_mode, &val, 1, &rx_fifo_state);
-        if (len == 1) {
-#ifdef DEBUG_ON
-            total_read += 4;
-            fprintf(stderr, "Total read: %d\n", total_read);
-#endif
-            queue_write(q, (char*) &val, sizeof(unsigned));
-        } else if (len == 0) {
-            sched_yield();
-        } else if (len < 0) {
-            fprintf(stderr, "Could not read from RX FIFO: %s\n", asfifo_strerror(len));
-            break;
-        }
+//Checks that a FIFO address is somewhere /dev/mpsoc_axiregs can reach.
+//Returns 0 if it is, or -1 (after printing an error) if not
+static int check_axiregs_addr(unsigned long phys, char const *name) {
+    if (phys < 0xA0000000 || phys > 0xA0FFFFFF) {
+        //I don't actually know the maximum allowable address
+        printf("%s 0x%08lx is out of range!\n", name, phys);
+        return -1;
     }
-    
-    pthread_cleanup_pop(1);
-    pthread_exit(NULL);
+    return 0;
 }
 
-char *usage = 
-"Usage: dbg_guv_server c|s 0xRX_ADDR [0xTX_ADDR]\n"
+//Gives thread names a channel number suffix, but only if there is more than
+//one channel (so single-channel setups look the same as they always did)
+static void channel_thread_name(char *dst, char const *name, int chan) {
+    if (num_channels > 1) snprintf(dst, 16, "%s%d", name, chan);
+    else snprintf(dst, 16, "%s", name);
+}
+
+//Starts a thread and names it. If cpu >= 0, the thread is pinned to that CPU.
+//Any -T rule for the name is applied on top of that. Returns 0 on success, 
+//or an error number from pthread_create
+static int start_thread(pthread_t *thread, void *(*fn)(void*), void *arg, char const *name, int cpu) {
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+
+    if (cpu >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(cpu, &cpus);
+        pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+    }
+
+    int rc = pthread_create(thread, &attr, fn, arg);
+    if (rc != 0 && cpu >= 0) {
+        fprintf(stderr, "Warning: could not pin %s to CPU %d (%s); running it unpinned\n", name, cpu, strerror(rc));
+        rc = pthread_create(thread, NULL, fn, arg);
+    }
+    pthread_attr_destroy(&attr);
+
+    if (rc != 0) {
+        fprintf(stderr, "Could not start %s: %s\n", name, strerror(rc));
+        return rc;
+    }
+    pthread_setname_np(*thread, name);
+    rt_apply(*thread, name);
+    return 0;
+}
+
+//Prints every channel's counters to fp. Called by the stats thread, and once
+//more when we exit
+static void dump_stats(FILE *fp, void *arg) {
+    int latency = *(int *) arg;
+    int i;
+    for (i = 0; i < num_channels; i++) {
+        channel *ch = &channels[i];
+        char name[64];
+        snprintf(name, sizeof(name), "FIFO pair %d (port %d, RX 0x%08lx)", i, ch->port, ch->rd_fifo_phys);
+        pipe_stats_print(fp, name, &ch->stats, ch->stats_flit_q, ch->stats_cmd_q);
+        if (latency) pipe_lat_print(fp, &ch->lat);
+        if (ch->capture_ok) capture_print(fp, &ch->capture);
+    }
+}
+
+char *usage =
+"Usage: dbg_guv_server [options] c|s 0xRX_ADDR [0xTX_ADDR]\n"
+"       dbg_guv_server [options] -f c|s:0xRX_ADDR[:0xTX_ADDR][!UIO_DEV][@CPU] [-f ...]\n"
+"       dbg_guv_server [options] -c CONFIG_FILE\n"
 "\n"
 "  Opens a server on port 5555. The first argument is a single char. \"c\" means\n"
 "  that the RX FIFO is in cut-through mode, and \"s\" means store-and-forward. This\n"
@@ -304,259 +349,729 @@ char *usage =
 "  address of the AXI-Stream FIFO that is receiving flits. TX_ADDR is the address\n"
 "  of the AXI-Stream FIFO that is sending commands (only supply it if it is\n"
 "  different from RX_ADDR\n"
+"\n"
+"  To serve several FIFO pairs from one process, give each one with -f (or put\n"
+"  one per line in CONFIG_FILE; '#' starts a comment). The Nth pair (counting\n"
+"  from 0) is served on port 5555+N. @CPU pins the thread that polls that\n"
+"  pair's RX FIFO. !UIO_DEV (e.g. !/dev/uio0) is the UIO device for the RX\n"
+"  FIFO's interrupt line; instead of spinning on an empty FIFO, that thread\n"
+"  sleeps until the FIFO interrupts. Without it (or if it can't be opened),\n"
+"  the FIFO is polled like before.\n"
+"\n"
+"  Options:\n"
+"    -b BATCH  Send at most BATCH bytes of flits to the client per write()\n"
+"              (default and maximum: 2048)\n"
+"    -B        Burst mode: send all queued commands (up to the TX FIFO's\n"
+"              vacancy) as a single multi-word AXI-Stream packet, instead of\n"
+"              one packet per 32-bit command word\n"
+"    -f SPEC   Add a FIFO pair (see above). Can be given many times\n"
+"    -c FILE   Read FIFO pairs from FILE\n"
+"    -i UIO    Same as !UIO_DEV, for a FIFO pair given the old way\n"
+"    -P SPIN,YIELD,MIN_US,MAX_US\n"
+"              What the FIFO threads do when there's nothing to do: poll\n"
+"              again SPIN times, then sched_yield() YIELD times (-1 means\n"
+"              forever), then sleep MIN_US microseconds, doubling each time\n"
+"              up to MAX_US. They go back to spinning as soon as there's\n"
+"              work. Default is 0,-1,10,1000 (i.e. just yield)\n"
+"    -T NAME=CPU[:PRIO]\n"
+"              Pin threads called NAME (net_mgr, net_mgr_tx, net_mgr_rx,\n"
+"              fifo_mgr, fifo_mgr_tx or rtc; the channel number on the end can\n"
+"              be left off) to CPU (\"-\" to leave them unpinned), and if PRIO\n"
+"              is given, run them SCHED_FIFO at that priority. Can be given\n"
+"              many times. Overrides @CPU. Beware of SCHED_FIFO threads that\n"
+"              spin; see -P\n"
+"    -L        Lock all memory with mlockall() and pre-fault thread stacks,\n"
+"              so the data path never takes a page fault\n"
+"    -D BACKEND\n"
+"              How to get at the FIFO registers:\n"
+"                axiregs      mmap /dev/mpsoc_axiregs (default)\n"
+"                devmem       mmap /dev/mem\n"
+"                uio:DEV      mmap the first region of UIO device DEV\n"
+"                sim[:OPTS]   No hardware; use a software model of each FIFO\n"
+"                             that generates counter flits. OPTS is a comma\n"
+"                             separated list of depth=WORDS (4096), pkt=WORDS\n"
+"                             (64), rate=WORDS_PER_SEC (0 = flat out),\n"
+"                             cost=NS (extra time per register access) and\n"
+"                             stamp=1 (flits are CLOCK_MONOTONIC timestamps\n"
+"                             instead of counters). Any !UIO_DEV/-i gets the\n"
+"                             model's interrupt instead\n"
+"    -p PORT   Use PORT for the first FIFO pair instead of 5555\n"
+"    -s        Shared mode: poll every RX FIFO from a single thread instead\n"
+"              of one thread per pair. It is pinned to the first pair's @CPU\n"
+"    -F MAX    Fan-out mode: let up to MAX clients connect to each port at\n"
+"              once. They all get the same flits, and any of them can send\n"
+"              commands. Runs until killed with SIGINT or SIGTERM\n"
+"    -R MB     In fan-out mode, keep at least MB megabytes of flits per FIFO\n"
+"              pair for clients to catch up with or resume from (default 4).\n"
+"              Each pair's ring takes up MB + MB/4 megabytes (its guard zone),\n"
+"              all of it locked in RAM with -L\n"
+"    -l skip|drop\n"
+"              In fan-out mode, what to do with a client that falls more than\n"
+"              the -R buffer behind: skip it ahead to the newest flits, or\n"
+"              disconnect it (default)\n"
+"    -d        Daemon mode: keep the FIFOs running between clients, and accept\n"
+"              clients one after another (one at a time unless -F is given).\n"
+"              Flits that arrive while nobody is connected are kept (up to the\n"
+"              -R buffer) and sent to the next client. Doesn't fork; runs until\n"
+"              SIGINT or SIGTERM\n"
+"    -S        Sessions: clients must start with the handshake in session.h,\n"
+"              which numbers the flits and lets a client that lost its\n"
+"              connection resume without a gap (as long as the flits it\n"
+"              missed are still within the -R buffer). Implies fan-out mode,\n"
+"              with up to 4 clients unless -F says otherwise (so that a client\n"
+"              can reconnect before we notice its old connection is dead)\n"
+"    -r        Run-to-completion mode: serve every FIFO pair from one thread\n"
+"              (pinned to the first pair's @CPU) that polls the FIFOs and the\n"
+"              sockets in a loop, instead of four threads per pair. Can't be\n"
+"              used with -s, -F, -d or -S\n"
+"    -M PORT   Serve a dump of the counters (flits, bytes, queue high water\n"
+"              marks, time blocked, idle reads, errors, short writes) to\n"
+"              anyone who connects to PORT. kill -USR1 prints the same thing\n"
+"              to stderr, with or without -M\n"
+"    -H        Keep latency histograms for each stage: RX FIFO read to\n"
+"              net_tx dequeue to socket write, and socket read to fifo_tx\n"
+"              dequeue to TX FIFO write. They're printed with the counters\n"
+"              (see -M). In fan-out mode only commands are timed, and -r\n"
+"              doesn't support it\n"
+"    -w        Framed protocol: instead of a bare stream of flits, send each\n"
+"              AXI-Stream packet as a frame with a length and flags (packet\n"
+"              continues in the next frame, RX error, flits lost); see\n"
+"              frame.h. RX errors are reported in the stream instead of\n"
+"              stopping the server. Commands come in frames too, and a\n"
+"              client can send several words as one TX packet and get an ack\n"
+"              for it, or ask for the flits to be compressed, or filtered\n"
+"              so that only the packets and words it wants are sent. Can't be\n"
+"              used with -r, -F, -d or -S\n"
+"    -C FILE[,MB]\n"
+"              Capture: also save everything read from the RX FIFO into FILE\n"
+"              (FILE.N for the Nth pair, if there's more than one), which is\n"
+"              used as a ring of MB megabytes (default 64); once it's full,\n"
+"              the oldest data is overwritten. See capture.h for the format.\n"
+"              With -w, it holds frames (unfiltered, and without acks).\n"
+"              Starts right away: until a client connects, flits only go\n"
+"              to FILE. Without -w, use -d to keep capturing after a\n"
+"              client leaves\n"
+"    -X FILE[,timed]\n"
+"              Replay: as soon as we start, send the commands in FILE to the\n"
+"              TX FIFO (FILE.N for the Nth pair, if there's more than one),\n"
+"              then carry on with commands from the client as usual. FILE is\n"
+"              either a recording made with -k, or text with one packet per\n"
+"              line (see replay.h). Packets go out as fast as the FIFO takes\n"
+"              them or, with \",timed\" and a recording, with the same gaps\n"
+"              between them as when they were recorded. Prints the time it\n"
+"              took, words/s and any TX errors at the end. Can't be used with\n"
+"              -r\n"
+"    -k FILE   Record every packet sent to the TX FIFO into FILE (FILE.N for\n"
+"              the Nth pair), with timestamps, for replaying with -X. Can't\n"
+"              be used with -r\n"
+"\n"
+"Every thread also keeps a trace of its last few thousand reads, writes and\n"
+"FIFO errors. kill -USR2 prints all of them to stderr, in order; so does a\n"
+"FIFO error, and so does exiting (in debug builds)\n"
 ;
 
 int main(int argc, char **argv) {
-    int fd = -1, sfd = -1;
-    void *base_rx = MAP_FAILED;
-    void *base_tx = MAP_FAILED;
-    
-    unsigned long rd_fifo_phys;
-    unsigned long wr_fifo_phys;
-    
+    trace_init();
+
+    int batch_size = BUF_SIZE;
+    int tx_burst = 0;
+    int port = DEFAULT_PORT;
+    int shared = 0;
+    int max_clients = 0;
+    int ring_mb = DEFAULT_RING_MB;
+    int skip_laggards = 0;
+    int daemon_mode = 0;
+    int sessions = 0;
+    int run_to_completion = 0;
+    char const *irq_path = NULL;
+    poll_policy_cfg poll_cfg = POLL_POLICY_CFG_DEFAULT;
+    int lock_memory = 0;
+    backend be = BACKEND_INITIALIZER;
+    int stats_port = -1;
+    int latency = 0;
+    int framed = 0;
+    char capture_path[200] = "";
+    int capture_mb = DEFAULT_CAPTURE_MB;
+    char replay_path[200] = "";
+    int replay_timed = 0;
+    char record_path[200] = "";
+
     int rc;
-    
-    if (argc < 3 || argc > 5) {
-        puts(usage);
-        return 0;
+    int i;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "b:Bf:c:i:P:T:LD:p:sF:R:l:dSrM:HwC:X:k:")) != -1) {
+        switch (opt) {
+        case 'b':
+            batch_size = atoi(optarg);
+            if (batch_size <= 0 || batch_size > BUF_SIZE) {
+                fprintf(stderr, "Batch size must be between 1 and %d; you entered [%s]\n", BUF_SIZE, optarg);
+                return -1;
+            }
+            break;
+        case 'B':
+            tx_burst = 1;
+            break;
+        case 'f':
+            if (add_channel_spec(optarg) < 0) return -1;
+            break;
+        case 'c':
+            if (read_config(optarg) < 0) return -1;
+            break;
+        case 'i':
+            irq_path = optarg;
+            break;
+        case 'P':
+            if (poll_policy_parse(&poll_cfg, optarg) < 0) {
+                fprintf(stderr, "Poll policy should look like SPIN,YIELD,MIN_US,MAX_US; you entered [%s]\n", optarg);
+                return -1;
+            }
+            break;
+        case 'T':
+            if (rt_add_rule(optarg) < 0) return -1;
+            break;
+        case 'L':
+            lock_memory = 1;
+            break;
+        case 'D':
+            if (backend_parse(&be, optarg) < 0) return -1;
+            break;
+        case 'p':
+            port = atoi(optarg);
+            if (port <= 0 || port > 65535) {
+                fprintf(stderr, "Invalid port [%s]\n", optarg);
+                return -1;
+            }
+            break;
+        case 's':
+            shared = 1;
+            break;
+        case 'F':
+            max_clients = atoi(optarg);
+            if (max_clients <= 0 || max_clients > FANOUT_MAX_CLIENTS) {
+                fprintf(stderr, "Max clients must be between 1 and %d; you entered [%s]\n", FANOUT_MAX_CLIENTS, optarg);
+                return -1;
+            }
+            break;
+        case 'R':
+            ring_mb = atoi(optarg);
+            if (ring_mb <= 0 || ring_mb > 4096) {
+                fprintf(stderr, "Ring size must be between 1 and 4096 MB; you entered [%s]\n", optarg);
+                return -1;
+            }
+            break;
+        case 'l':
+            if (!strcmp(optarg, "skip")) skip_laggards = 1;
+            else if (!strcmp(optarg, "drop")) skip_laggards = 0;
+            else {
+                fprintf(stderr, "Laggard policy must be \"skip\" or \"drop\"; you entered [%s]\n", optarg);
+                return -1;
+            }
+            break;
+        case 'd':
+            daemon_mode = 1;
+            break;
+        case 'S':
+            sessions = 1;
+            break;
+        case 'r':
+            run_to_completion = 1;
+            break;
+        case 'H':
+            latency = 1;
+            break;
+        case 'w':
+            framed = 1;
+            break;
+        case 'C': {
+            char *comma = strrchr(optarg, ',');
+            if (comma != NULL) {
+                *comma = '\0';
+                capture_mb = atoi(comma + 1);
+                if (capture_mb <= 0 || capture_mb > 65536) {
+                    fprintf(stderr, "Capture size must be between 1 and 65536 MB; you entered [%s]\n", comma + 1);
+                    return -1;
+                }
+            }
+            if (optarg[0] == '\0' || strlen(optarg) >= sizeof(capture_path) - 8) {
+                fprintf(stderr, "Invalid capture file name [%s]\n", optarg);
+                return -1;
+            }
+            strcpy(capture_path, optarg);
+            break;
+        }
+        case 'X': {
+            char *comma = strrchr(optarg, ',');
+            if (comma != NULL) {
+                if (strcmp(comma + 1, "timed")) {
+                    fprintf(stderr, "Replay option must be \"timed\"; you entered [%s]\n", comma + 1);
+                    return -1;
+                }
+                *comma = '\0';
+                replay_timed = 1;
+            }
+            if (optarg[0] == '\0' || strlen(optarg) >= sizeof(replay_path) - 8) {
+                fprintf(stderr, "Invalid replay file name [%s]\n", optarg);
+                return -1;
+            }
+            strcpy(replay_path, optarg);
+            break;
+        }
+        case 'k':
+            if (optarg[0] == '\0' || strlen(optarg) >= sizeof(record_path) - 8) {
+                fprintf(stderr, "Invalid recording file name [%s]\n", optarg);
+                return -1;
+            }
+            strcpy(record_path, optarg);
+            break;
+        case 'M':
+            stats_port = atoi(optarg);
+            if (stats_port <= 0 || stats_port > 65535) {
+                fprintf(stderr, "Invalid stats port [%s]\n", optarg);
+                return -1;
+            }
+            break;
+        default:
+            puts(usage);
+            return -1;
+        }
     }
-    
-    asfifo_mode_t rx_mode;
-    
-    //Parse the mode string
-    if (strlen(argv[1]) != 1 || (argv[1][0] != 'c' && argv[1][0] != 's')) {
-        fprintf(stderr, "First argument must be \"c\" or \"s\"; you entered [%s]\n", argv[1]);
+
+    //Shift things over so the positional arguments are where they always were
+    argc -= optind - 1;
+    argv += optind - 1;
+
+    if (num_channels == 0) {
+        //Good old-fashioned single FIFO pair on the command line
+        if (argc < 3 || argc > 4) {
+            puts(usage);
+            return 0;
+        }
+        rc = add_channel(argv[1], argv[2], (argc == 4) ? argv[3] : NULL, -1, irq_path);
+        if (rc < 0) return -1;
+    } else if (argc > 1) {
+        fprintf(stderr, "Error: can't mix -f/-c with FIFO addresses on the command line\n");
+        return -1;
+    } else if (irq_path != NULL) {
+        fprintf(stderr, "Error: -i is only for FIFO addresses on the command line; use !UIO_DEV with -f/-c\n");
+        return -1;
+    }
+
+    if (run_to_completion && (shared || max_clients > 0 || daemon_mode || sessions)) {
+        fprintf(stderr, "Error: -r can't be used with -s, -F, -d or -S\n");
         return -1;
     }
-    
-    if (argv[1][0] == 'c') rx_mode = CUT_THROUGH;
-    else if (argv[1][0] == 's') rx_mode = STORE_AND_FORWARD;
-    else {
-        fprintf(stderr, "Something is quite wrong with your arguments.\n%s", usage);
+    if (framed && (run_to_completion || max_clients > 0 || daemon_mode || sessions)) {
+        fprintf(stderr, "Error: -w can't be used with -r, -F, -d or -S\n");
         return -1;
     }
-    
-    if (argc == 3) {
-        //Get RX_ADDR from argv[2]
-        int rc = sscanf(argv[2], "%lx", &rd_fifo_phys);
-        if (rc != 1) {
-            fprintf(stderr, "Error: could not parse [%s]\n", argv[1]);
-            return -1;
+    if (run_to_completion && (replay_path[0] != '\0' || record_path[0] != '\0')) {
+        fprintf(stderr, "Error: -X and -k can't be used with -r\n");
+        return -1;
+    }
+    if (run_to_completion && latency) {
+        fprintf(stderr, "Warning: -H isn't supported with -r; ignoring it\n");
+        latency = 0;
+    }
+
+    //Daemon mode is just fan-out mode with resuming turned on, and sessions
+    //need the ring too
+    if (sessions && max_clients == 0) max_clients = 4;
+    if (daemon_mode && max_clients == 0) max_clients = 1;
+
+    //Do this before we allocate the flit rings or start any threads, so that
+    //all of it ends up locked. If it doesn't work, keep going anyway (it's
+    //already been logged)
+    if (lock_memory) rt_lock_memory();
+
+    //A client going away shouldn't kill the whole server
+    signal(SIGPIPE, SIG_IGN);
+
+    //In fan-out mode, we run until someone tells us to stop. Make sure only
+    //the main thread gets those signals (the threads inherit this mask)
+    sigset_t stop_sigs;
+    sigemptyset(&stop_sigs);
+    sigaddset(&stop_sigs, SIGINT);
+    sigaddset(&stop_sigs, SIGTERM);
+    if (max_clients > 0) pthread_sigmask(SIG_BLOCK, &stop_sigs, NULL);
+
+    //SIGUSR1 and SIGUSR2 are for the stats thread (which picks them up with a
+    //signalfd), so nobody else can get them
+    sigset_t stats_sigs;
+    sigemptyset(&stats_sigs);
+    sigaddset(&stats_sigs, SIGUSR1);
+    sigaddset(&stats_sigs, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &stats_sigs, NULL);
+
+    //Only /dev/mpsoc_axiregs has a fixed window; the other backends check
+    //addresses when they map them
+    if (be.kind == BACKEND_AXIREGS) {
+        for (i = 0; i < num_channels; i++) {
+            if (check_axiregs_addr(channels[i].rd_fifo_phys, "RX_ADDR") < 0) return -1;
+            if (check_axiregs_addr(channels[i].wr_fifo_phys, "TX_ADDR") < 0) return -1;
         }
-        //Check that rd_fifo_phys is in range
-        if (rd_fifo_phys < 0xA0000000 || rd_fifo_phys > 0xA0FFFFFF) {
-            //I don't actually know the maximum allowable address
-            printf("RX_ADDR is out of range!\n");
-            return -1;
+    }
+
+    if (port + num_channels - 1 > 65535) {
+        fprintf(stderr, "Error: not enough ports above %d for %d FIFO pairs\n", port, num_channels);
+        return -1;
+    }
+
+    //Before we screw around with mmap and hardware registers, get our servers
+    //up and running
+    for (i = 0; i < num_channels; i++) {
+        channel *ch = &channels[i];
+
+        ch->sfd = socket(AF_INET, SOCK_STREAM, 0);
+        if (ch->sfd < 0) {
+            perror("Could not open socket");
+            goto err_cleanup;
         }
 
-        //Check rd_fifo_phys has 32 bit alignment
-        if (rd_fifo_phys & 0b11) {
-            printf("Error! Addresses must be 32-bit aligned\n");
-            return -1;
-        }	
-        wr_fifo_phys = rd_fifo_phys;
-    } else {
-        //Get RX_ADDR from argv[2]
-        int rc = sscanf(argv[2], "%lx", &rd_fifo_phys);
-        if (rc != 1) {
-            fprintf(stderr, "Error: could not parse RX_ADDR = [%s]\n", argv[1]);
-            return -1;
+        struct sockaddr_in server_addr = {
+            .sin_family = AF_INET,
+            .sin_port = htons(port + i),
+            .sin_addr = {INADDR_ANY}
+        };
+
+        rc = bind(ch->sfd, (struct sockaddr *) &server_addr, sizeof(struct sockaddr_in));
+        if (rc < 0) {
+            fprintf(stderr, "Could not bind to port %d: %s\n", port + i, strerror(errno));
+            goto err_cleanup;
         }
-        //Check that rd_fifo_phys is in range
-        if (rd_fifo_phys < 0xA0000000 || rd_fifo_phys > 0xA0FFFFFF) {
-            //I don't actually know the maximum allowable address
-            printf("RX_ADDR is out of range!\n");
-            return -1;
+        ch->port = port + i;
+    }
+
+    stats_server_info stats_args = {
+        .sfd = -1,
+        .dump = dump_stats,
+        .arg = &latency
+    };
+    if (stats_port != -1) {
+        stats_args.sfd = socket(AF_INET, SOCK_STREAM, 0);
+        struct sockaddr_in stats_addr = {
+            .sin_family = AF_INET,
+            .sin_port = htons(stats_port),
+            .sin_addr = {INADDR_ANY}
+        };
+        if (stats_args.sfd < 0 || bind(stats_args.sfd, (struct sockaddr *) &stats_addr, sizeof(stats_addr)) < 0) {
+            fprintf(stderr, "Could not bind to stats port %d: %s\n", stats_port, strerror(errno));
+            if (stats_args.sfd >= 0) close(stats_args.sfd);
+            goto err_cleanup;
         }
+    }
 
-        //Check rd_fifo_phys has 32 bit alignment
-        if (rd_fifo_phys & 0b11) {
-            printf("Error! Addresses must be 32-bit aligned\n");
-            return -1;
-        }	
-        
-        //Get TX_ADDR from argv[3]
-        rc = sscanf(argv[3], "%lx", &wr_fifo_phys);
-        if (rc != 1) {
-            fprintf(stderr, "Error: could not parse TX_ADDR = [%s]\n", argv[2]);
-            return -1;
+    //At this point, all addresses are guaranteed safe. Proceed to open device
+    //files.
+
+    if (backend_open(&be) < 0) goto err_cleanup;
+
+    for (i = 0; i < num_channels; i++) {
+        channel *ch = &channels[i];
+        volatile AXIStream_FIFO *rx_fifo, *tx_fifo;
+
+        rx_fifo = backend_map(&be, ch->rd_fifo_phys, ch->rx_mode, 1, &ch->base_rx);
+        if (rx_fifo == NULL) {
+            perror("Could not mmap RX FIFO device memory");
+            goto err_cleanup;
         }
-        //Check that wr_fifo_phys is in range
-        if (wr_fifo_phys < 0xA0000000 || wr_fifo_phys > 0xA0FFFFFF) {
-            //I don't actually know the maximum allowable address
-            printf("TX_ADDR is out of range!\n");
-            return -1;
+
+        if (ch->wr_fifo_phys == ch->rd_fifo_phys) {
+            ch->base_tx = ch->base_rx;
+            tx_fifo = rx_fifo;
+        } else {
+            //Perform separate mmap for TX FIFO
+            tx_fifo = backend_map(&be, ch->wr_fifo_phys, ch->rx_mode, 0, &ch->base_tx);
+            if (tx_fifo == NULL) {
+                perror("Could not mmap TX FIFO device memory");
+                goto err_cleanup;
+            }
         }
 
-        //Check wr_fifo_phys has 32 bit alignment
-        if (wr_fifo_phys & 0b11) {
-            printf("Error! Addresses must be 32-bit aligned\n");
-            return -1;
+        //At this point, we have our rx_fifo and tx_fifo pointers and we can get
+        //to work. First, we rest the AXI Stream FIFO cores:
+
+        rc = reset_all(rx_fifo);
+        if (rc != 0) printf("Warning: RX FIFO 0x%08lx might not have reset correctly\n", ch->rd_fifo_phys);
+        //I mean, there's nothing we can do if interrupts are already on, but
+        //turn them off anyway
+        WR_REG(rx_fifo, IER, 0);
+        rc = reset_all(tx_fifo);
+        if (rc != 0) printf("Warning: TX FIFO 0x%08lx might not have reset correctly\n", ch->wr_fifo_phys);
+        WR_REG(tx_fifo, IER, 0);
+
+        //fifo_mgr turns the RX interrupts on when it wants to sleep. If we
+        //can't get at the interrupt, it just polls
+        if (ch->irq_path[0] != '\0') {
+            if (shared || run_to_completion) {
+                fprintf(stderr, "Warning: interrupts aren't used with -s or -r; polling RX FIFO 0x%08lx\n", ch->rd_fifo_phys);
+            } else if (be.kind == BACKEND_SIM) {
+                //The model fires an eventfd instead
+                if (irq_open_eventfd(&ch->rx_irq) < 0) {
+                    fprintf(stderr, "Warning: could not make eventfd (%s); polling RX FIFO 0x%08lx\n", strerror(errno), ch->rd_fifo_phys);
+                } else {
+                    fifo_model_attach_irq(rx_fifo, &ch->rx_irq);
+                }
+            } else if (irq_open_uio(&ch->rx_irq, ch->irq_path) < 0) {
+                fprintf(stderr, "Warning: could not open %s (%s); polling RX FIFO 0x%08lx\n", ch->irq_path, strerror(errno), ch->rd_fifo_phys);
+            }
+        }
+
+        //Set up the queues and the arguments for this channel's threads
+        ch->net_rx_queue = (queue) QUEUE_INITIALIZER;
+        ch->net_tx_queue = (queue) QUEUE_INITIALIZER;
+        queue_add_producers(&ch->net_rx_queue, 1);
+        queue_add_consumers(&ch->net_rx_queue, 1);
+        queue_add_producers(&ch->net_tx_queue, 1);
+        queue_add_consumers(&ch->net_tx_queue, 1);
+        ch->reply_queue = (queue) QUEUE_INITIALIZER;
+        queue_add_producers(&ch->reply_queue, 1);
+        queue_add_consumers(&ch->reply_queue, 1);
+        ch->opts = 0;
+
+        ch->stats = (pipe_stats) {0};
+        ch->stats_flit_q = (max_clients > 0 || run_to_completion) ? NULL : &ch->net_tx_queue;
+        ch->stats_cmd_q = run_to_completion ? NULL : &ch->net_rx_queue;
+
+        ch->net_mgr_args = (net_mgr_info) {
+            .stop = 0,
+            .server_sfd = ch->sfd,
+            .batch_size = batch_size,
+            .framed = framed,
+            .opts = &ch->opts,
+            .mutex = PTHREAD_MUTEX_INITIALIZER,
+            .can_write = PTHREAD_COND_INITIALIZER,
+            .ingress = &ch->net_rx_queue,
+            .egress = &ch->net_tx_queue,
+            .stats = &ch->stats,
+            .lat = latency ? &ch->lat : NULL
+        };
+        channel_thread_name(ch->net_mgr_args.tx_thread_name, "net_mgr_tx", i);
+
+        ch->fifo_mgr_args = (fifo_mgr_info) {
+            .stop = 0,
+            .rx_fifo = rx_fifo,
+            .rx_mode = ch->rx_mode,
+            .tx_fifo = tx_fifo,
+            .tx_burst = tx_burst,
+            .framed = framed,
+            .mutex = PTHREAD_MUTEX_INITIALIZER,
+            .rx_state = RW_STATE_INITIALIZER,
+            .done = 0,
+            .ingress = &ch->net_tx_queue,
+            .egress = &ch->net_rx_queue,
+            .ring = NULL,
+            .rx_irq = (ch->rx_irq.kind != IRQ_NONE) ? &ch->rx_irq : NULL,
+            .rx_wake = (ch->rx_irq.kind != IRQ_NONE) ? &ch->rx_irq : NULL,
+            .poll_cfg = &poll_cfg,
+            .replies = framed ? &ch->reply_queue : NULL,
+            .opts = &ch->opts,
+            .stats = &ch->stats,
+            .lat = latency ? &ch->lat : NULL
+        };
+
+        if (capture_path[0] != '\0') {
+            char path[sizeof(capture_path) + 16];
+            if (num_channels == 1) strcpy(path, capture_path);
+            else snprintf(path, sizeof(path), "%s.%d", capture_path, i);
+            if (capture_open(&ch->capture, path, (uint64_t) capture_mb * 1024 * 1024, framed ? CAPTURE_FRAMED : 0) < 0) {
+                goto err_cleanup;
+            }
+            ch->capture_ok = 1;
+            ch->fifo_mgr_args.capture = &ch->capture;
+        }
+
+        if (replay_path[0] != '\0') {
+            char path[sizeof(replay_path) + 16];
+            if (num_channels == 1) strcpy(path, replay_path);
+            else snprintf(path, sizeof(path), "%s.%d", replay_path, i);
+            if (replay_load(&ch->replay, path) < 0) goto err_cleanup;
+            ch->replay_ok = 1;
+            if (replay_timed && !ch->replay.timed) {
+                fprintf(stderr, "Warning: %s has no timestamps; replaying it at full speed\n", path);
+            }
+            ch->fifo_mgr_args.replay = &ch->replay;
+            ch->fifo_mgr_args.replay_timed = replay_timed;
+        }
+
+        if (record_path[0] != '\0') {
+            char path[sizeof(record_path) + 16];
+            if (num_channels == 1) strcpy(path, record_path);
+            else snprintf(path, sizeof(path), "%s.%d", record_path, i);
+            if (replay_record_open(&ch->recorder, path) < 0) goto err_cleanup;
+            ch->recorder_ok = 1;
+            ch->fifo_mgr_args.record = &ch->recorder;
+        }
+
+        if (max_clients > 0) {
+            unsigned long long flits = (unsigned long long) ring_mb * 1024 * 1024 / sizeof(unsigned);
+            if (flit_ring_init(&ch->ring, flits) < 0) {
+                fprintf(stderr, "Could not allocate %d MB flit ring\n", ring_mb);
+                goto err_cleanup;
+            }
+            ch->ring_ok = 1;
+            ch->fifo_mgr_args.ring = &ch->ring;
+
+            ch->fanout_args = (fanout_info) {
+                .server_sfd = ch->sfd,
+                .max_clients = max_clients,
+                .skip_laggards = skip_laggards,
+                .batch_size = batch_size,
+                .resume = daemon_mode,
+                .sessions = sessions,
+                .ring = &ch->ring,
+                .ingress = &ch->net_rx_queue,
+                .stats = &ch->stats,
+                .lat = latency ? &ch->lat : NULL,
+                .mutex = PTHREAD_MUTEX_INITIALIZER,
+                .stop = 0,
+                .next_id = 0,
+                .ingress_mutex = PTHREAD_MUTEX_INITIALIZER
+            };
+            channel_thread_name(ch->fanout_args.rx_thread_name, "net_mgr_rx", i);
+            channel_thread_name(ch->fanout_args.tx_thread_name, "net_mgr_tx", i);
         }
+
+        //net_mgr only takes one client, and after it leaves we're done, so
+        //there's only the time before it shows up to worry about
+        if (ch->capture_ok && max_clients == 0) {
+            ch->attached = 0;
+            ch->net_mgr_args.attached = &ch->attached;
+            ch->fifo_mgr_args.attached = &ch->attached;
+            ch->fifo_mgr_args.capture_only = 1;
+        }
+
+        ch->rtc_args = (rtc_info) RTC_INFO_INITIALIZER;
+        ch->rtc_args.server_sfd = ch->sfd;
+        ch->rtc_args.rx_fifo = rx_fifo;
+        ch->rtc_args.rx_mode = ch->rx_mode;
+        ch->rtc_args.tx_fifo = tx_fifo;
+        ch->rtc_args.tx_burst = tx_burst;
+        ch->rtc_args.batch_size = batch_size;
+        ch->rtc_args.capture = ch->fifo_mgr_args.capture;
+        ch->rtc_args.stats = &ch->stats;
     }
-    
-    //Before we screw around with mmap and hardware registers, get our server 
-    //up and running
-    
-    sfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (sfd < 0) {
-        perror("Could not open socket");
-        goto err_nothing;
-    }
-    
-    struct sockaddr_in server_addr = {
-        .sin_family = AF_INET,
-        .sin_port = htons(5555),
-        .sin_addr = {INADDR_ANY}
-    };
 
-    rc = bind(sfd, (struct sockaddr *) &server_addr, sizeof(struct sockaddr_in));
-    if (rc < 0) {
-        perror("Could not bind to port 5555");
-        goto err_close_socket;
+    //Runs for as long as we do
+    pthread_t stats_thread;
+    start_thread(&stats_thread, stats_server, &stats_args, "stats", -1);
+
+    if (run_to_completion) {
+        pthread_t rtc_thread;
+        rtc_info *chans[MAX_CHANNELS];
+        rtc_loop_info rtc_loop_args = {
+            .chans = chans,
+            .num_chans = num_channels,
+            .poll_cfg = &poll_cfg
+        };
+        for (i = 0; i < num_channels; i++) chans[i] = &channels[i].rtc_args;
+
+        if (start_thread(&rtc_thread, rtc_loop, &rtc_loop_args, "rtc", channels[0].cpu) != 0) goto err_cleanup;
+        pthread_join(rtc_thread, NULL);
+        goto cleanup;
     }
-    
-    //At this point, all addresses are guaranteed safe. Proceed to open device
-    //files.
-      
-    fd = open("/dev/mpsoc_axiregs", O_RDWR | O_SYNC);
-    if (fd < 0) {
-		perror("Could not open /dev/mpsoc_axiregs");
-		goto err_close_socket;
-    }
-
-    volatile AXIStream_FIFO *rx_fifo, *tx_fifo;
-
-    //Perform mmap for RX FIFO
-	unsigned long pg_aligned = (rd_fifo_phys | 0xFFF) - 0xFFF; //Mask out lower bits
-	unsigned long pg_off = rd_fifo_phys & 0xFFF; //Get only lower bits
-
-	base_rx = mmap(
-		0, //addr: Can be used to pick & choose virtual addresses. Ignore it.
-		4096, //len: We'll (arbitrarily) map a whole page
-		PROT_READ | PROT_WRITE, //prot: We want to read and write this memory
-		MAP_SHARED, //flags: Allow others to use this memory
-		fd, //fildes: File descriptor for device file we're mmmapping
-		(pg_aligned - 0xA0000000) //off: (Page-aligned) offset into FPGA memory
-	);
-    if (base_rx == MAP_FAILED) {
-		perror("Could not mmap RX FIFO device memory");
-		goto err_close_fd;
-	}
-    rx_fifo = (volatile AXIStream_FIFO *) (base_rx + pg_off);
-
-    if (wr_fifo_phys == rd_fifo_phys) {
-        base_tx = base_rx;
-        tx_fifo = rx_fifo;
-    } else {
-        //Perform separate mmap for TX FIFO
-        pg_aligned = (wr_fifo_phys | 0xFFF) - 0xFFF; //Mask out lower bits
-        pg_off = wr_fifo_phys & 0xFFF; //Get only lower bits
-
-        base_tx = mmap(
-            0, //addr: Can be used to pick & choose virtual addresses. Ignore it.
-            4096, //len: We'll (arbitrarily) map a whole page
-            PROT_READ | PROT_WRITE, //prot: We want to read and write this memory
-            MAP_SHARED, //flags: Allow others to use this memory
-            fd, //fildes: File descriptor for device file we're mmmapping
-            (pg_aligned - 0xA0000000) //off: (Page-aligned) offset into FPGA memory
-        );
-        if (base_tx == MAP_FAILED) {
-            perror("Could not mmap TX FIFO device memory");
-            goto err_unmap_rx;
+
+    //We're now ready to accept incoming connections. For each channel, spin up
+    //the thread to receive commands (which spins up the thread to send out
+    //logged flits), and the threads that send and receive from the FIFOs
+    char name[16];
+    for (i = 0; i < num_channels; i++) {
+        channel *ch = &channels[i];
+
+        channel_thread_name(name, "net_mgr", i);
+        if (max_clients > 0) {
+            start_thread(&ch->net_mgr_thread, fanout_mgr, &ch->fanout_args, name, -1);
+        } else {
+            start_thread(&ch->net_mgr_thread, net_mgr, &ch->net_mgr_args, name, -1);
+        }
+        channel_thread_name(name, "fifo_mgr_tx", i);
+        start_thread(&ch->fifo_tx_thread, fifo_tx, &ch->fifo_mgr_args, name, -1);
+        if (!shared) {
+            channel_thread_name(name, "fifo_mgr", i);
+            start_thread(&ch->fifo_mgr_thread, fifo_mgr, &ch->fifo_mgr_args, name, ch->cpu);
         }
-        tx_fifo = (volatile AXIStream_FIFO *) (base_tx + pg_off);
-    }
-    
-    //At this point, we have our rx_fifo and tx_fifo pointers and we can get to
-    //work. First, we rest the AXI Stream FIFO cores:
-    
-    rc = reset_all(rx_fifo);
-    if (rc != 0) puts("Warning: RX FIFO might not have reset correctly");
-    //I mean, there's nothing we can do if interrupts are already on, but turn
-    //them off anyway
-    rx_fifo->IER = 0;
-    rc = reset_all(tx_fifo);
-    if (rc != 0) puts("Warning: TX FIFO might not have reset correctly");
-    tx_fifo->IER = 0;
-    
-    //We're now ready to accept incoming connections. Spin up the thread to
-    //receive commands, and then a thread to send out logged flits. Also need
-    //the threads that send data to the FIFOs
-    queue net_rx_queue = QUEUE_INITIALIZER;
-    queue net_tx_queue = QUEUE_INITIALIZER;
-    net_rx_queue.num_producers++;
-    net_rx_queue.num_consumers++;
-    net_tx_queue.num_producers++;
-    net_tx_queue.num_consumers++;
-    
-    pthread_t net_mgr_thread, fifo_mgr_thread;
-    
-    net_mgr_info net_mgr_args = {
-        .stop = 0,
-        .server_sfd = sfd,
-        .mutex = PTHREAD_MUTEX_INITIALIZER,
-        .can_write = PTHREAD_COND_INITIALIZER,
-        .ingress = &net_rx_queue,
-        .egress = &net_tx_queue
-    }; 
-    
-    fifo_mgr_info fifo_mgr_args = {
-        .stop = 0,
-        .rx_fifo = rx_fifo,
-        .rx_mode = rx_mode,
-        .tx_fifo = tx_fifo,
-        .mutex = PTHREAD_MUTEX_INITIALIZER,
-        .ingress = &net_tx_queue,
-        .egress = &net_rx_queue
+    }
+
+    pthread_t poller_thread;
+    fifo_mgr_info *polled[MAX_CHANNELS];
+    fifo_poller_info poller_args = {
+        .fifos = polled,
+        .num_fifos = num_channels,
+        .poll_cfg = &poll_cfg
     };
+    if (shared) {
+        for (i = 0; i < num_channels; i++) polled[i] = &channels[i].fifo_mgr_args;
+        start_thread(&poller_thread, fifo_poller, &poller_args, "fifo_mgr", channels[0].cpu);
+    }
 
-    pthread_create(&net_mgr_thread, NULL, net_mgr, &net_mgr_args);
-    pthread_setname_np(net_mgr_thread, "net_mgr");
-    pthread_create(&fifo_mgr_thread, NULL, fifo_mgr, &fifo_mgr_args);
-    pthread_setname_np(fifo_mgr_thread, "fifo_mgr");
-    
-    
-    pthread_join(net_mgr_thread, NULL);
+    if (max_clients > 0) {
+        int sig;
+        sigwait(&stop_sigs, &sig);
+        fprintf(stderr, "Caught signal %d; shutting down\n", sig);
+        for (i = 0; i < num_channels; i++) {
+            fanout_stop(&channels[i].fanout_args);
+            flit_ring_close(&channels[i].ring);
+        }
+    }
+
+    for (i = 0; i < num_channels; i++) {
+        channel *ch = &channels[i];
+        pthread_join(ch->net_mgr_thread, NULL);
+#ifdef DEBUG_ON
+        fprintf(stderr, "RX thread joined\n");
+        fflush(stderr);
+#endif
+
+        //At this point, the signal to quit (i.e. client disconnected) has been
+        //caught. The FIFO threads notice on their own, but set the stop flag
+        //anyway just to be sure
+        pthread_mutex_lock(&ch->fifo_mgr_args.mutex);
+        ch->fifo_mgr_args.stop = 1;
+        pthread_mutex_unlock(&ch->fifo_mgr_args.mutex);
+
+        if (!shared) pthread_join(ch->fifo_mgr_thread, NULL);
+        pthread_join(ch->fifo_tx_thread, NULL);
 #ifdef DEBUG_ON
-    fprintf(stderr, "RX thread joined\n");
-    fflush(stderr);
+        fprintf(stderr, "FIFO threads joined\n");
+        fflush(stderr);
 #endif
-    
-    //At this point, the signal to quit (i.e. client disconnected) has been 
-    //caught. We now try to gracefully close the RX FIFO manager.
-    
-    pthread_mutex_lock(&fifo_mgr_args.mutex);
-    fifo_mgr_args.stop = 1;
-    pthread_mutex_unlock(&fifo_mgr_args.mutex);
-    
-    pthread_mutex_lock(&net_tx_queue.mutex);
-    net_tx_queue.num_consumers--;
-    pthread_mutex_unlock(&net_tx_queue.mutex);
-    pthread_cond_broadcast(&net_tx_queue.can_prod);
-    pthread_cond_broadcast(&net_tx_queue.can_cons);
-    
-    pthread_join(fifo_mgr_thread, NULL);
+    }
+    if (shared) pthread_join(poller_thread, NULL);
+
+cleanup:
+    dump_stats(stderr, &latency);
 #ifdef DEBUG_ON
-    fprintf(stderr, "FIFO RX thread joined\n");
-    fflush(stderr);
+    trace_dump(stderr);
 #endif
-    if (base_tx != MAP_FAILED && base_tx != base_rx) munmap(base_tx, 4096);
-    if (base_rx != MAP_FAILED) munmap(base_rx, 4096);
-    if (fd != -1) close(fd);
-    if (sfd != -1) close(sfd);
-    
+    for (i = 0; i < num_channels; i++) {
+        channel *ch = &channels[i];
+        if (ch->base_tx != ch->base_rx) backend_unmap(&be, ch->base_tx);
+        backend_unmap(&be, ch->base_rx);
+        if (ch->sfd != -1) close(ch->sfd);
+        if (ch->ring_ok) flit_ring_destroy(&ch->ring);
+        if (ch->capture_ok) capture_close(&ch->capture);
+        if (ch->replay_ok) replay_free(&ch->replay);
+        if (ch->recorder_ok) replay_record_close(&ch->recorder);
+        irq_close(&ch->rx_irq);
+    }
+    backend_close(&be);
+
     return 0;
-    
-    
-err_unmap_rx:
-    if (base_rx != MAP_FAILED) munmap(base_rx, 4096);
-err_close_fd:
-    if (fd != -1) close(fd);
-err_close_socket:
-    if (sfd != -1) close(sfd);
-err_nothing:
+
+
+err_cleanup:
+    for (i = 0; i < num_channels; i++) {
+        channel *ch = &channels[i];
+        if (ch->base_tx != ch->base_rx) backend_unmap(&be, ch->base_tx);
+        backend_unmap(&be, ch->base_rx);
+        if (ch->sfd != -1) close(ch->sfd);
+        if (ch->ring_ok) flit_ring_destroy(&ch->ring);
+        if (ch->capture_ok) capture_close(&ch->capture);
+        if (ch->replay_ok) replay_free(&ch->replay);
+        if (ch->recorder_ok) replay_record_close(&ch->recorder);
+        irq_close(&ch->rx_irq);
+    }
+    backend_close(&be);
     return -1;
 
 }
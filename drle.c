@@ -0,0 +1,120 @@
+#include "drle.h"
+
+//Appends v as a varint. Returns the new output length, or -1 if it doesn't
+//fit
+static int put_varint(unsigned char *out, int o, int max, unsigned v) {
+    while (v >= 0x80) {
+        if (o >= max) return -1;
+        out[o++] = (v & 0x7F) | 0x80;
+        v >>= 7;
+    }
+    if (o >= max) return -1;
+    out[o++] = v;
+    return o;
+}
+
+static unsigned zigzag(unsigned d) {
+    return (d << 1) ^ (unsigned) ((int) d >> 31);
+}
+
+static unsigned unzigzag(unsigned z) {
+    return (z >> 1) ^ -(z & 1);
+}
+
+//Difference between word i and the one before it
+static unsigned delta(unsigned const *words, int i) {
+    return words[i] - (i ? words[i-1] : 0);
+}
+
+//Writes the literals token for the lit words before words[end]
+static int put_literals(unsigned const *words, int end, int lit, unsigned char *out, int o, int max) {
+    if (lit == 0) return o;
+    if (o >= max) return -1;
+    out[o++] = lit - 1;
+    int i;
+    for (i = end - lit; i < end && o >= 0; i++) {
+        o = put_varint(out, o, max, zigzag(delta(words, i)));
+    }
+    return o;
+}
+
+int drle_encode(unsigned const *words, int n, unsigned char *out, int max) {
+    int o = 0;
+    int lit = 0; //How many words before words[i] still need to go out as literals
+    int i = 0;
+
+    while (i < n) {
+        unsigned d = delta(words, i);
+        int run = 1;
+        while (i + run < n && run < DRLE_MAX_COUNT && words[i+run] - words[i+run-1] == d) run++;
+
+        if (run >= DRLE_MIN_RUN) {
+            o = put_literals(words, i, lit, out, o, max);
+            if (o < 0 || o >= max) return -1;
+            lit = 0;
+            out[o++] = 0x80 | (run - 1);
+            o = put_varint(out, o, max, zigzag(d));
+            if (o < 0) return -1;
+            i += run;
+        } else {
+            lit++;
+            i++;
+            if (lit == DRLE_MAX_COUNT) {
+                o = put_literals(words, i, lit, out, o, max);
+                if (o < 0) return -1;
+                lit = 0;
+            }
+        }
+    }
+
+    return put_literals(words, i, lit, out, o, max);
+}
+
+//Reads a varint. Returns the new input position, or -1 if it runs off the end
+static int get_varint(unsigned char const *in, int pos, int len, unsigned *v) {
+    unsigned x = 0;
+    int shift;
+    for (shift = 0; shift < 35; shift += 7) {
+        if (pos >= len) return -1;
+        unsigned char b = in[pos++];
+        x |= (unsigned) (b & 0x7F) << shift;
+        if (!(b & 0x80)) {
+            *v = x;
+            return pos;
+        }
+    }
+    return -1;
+}
+
+int drle_decode(unsigned char const *in, int len, unsigned *words, int max_words) {
+    int pos = 0;
+    int n = 0;
+    unsigned prev = 0;
+
+    while (pos < len) {
+        unsigned char tag = in[pos++];
+        int count = (tag & 0x7F) + 1;
+        if (n + count > max_words) return -1;
+
+        unsigned z;
+        int i;
+        if (tag & 0x80) {
+            pos = get_varint(in, pos, len, &z);
+            if (pos < 0) return -1;
+            unsigned d = unzigzag(z);
+            for (i = 0; i < count; i++) {
+                prev += d;
+                words[n++] = prev;
+            }
+        } else {
+            for (i = 0; i < count; i++) {
+                pos = get_varint(in, pos, len, &z);
+                if (pos < 0) return -1;
+                prev += unzigzag(z);
+                words[n++] = prev;
+            }
+        }
+    }
+
+    return n;
+}
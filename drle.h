@@ -0,0 +1,37 @@
+#ifndef DRLE_H
+#define DRLE_H 1
+
+//Delta + run-length coding for 32-bit flits, used for FRAME_FLITS_Z frames
+//(see frame.h). Debug flits are mostly counters that go up by the same
+//amount every time, or the same word over and over, so we code the
+//differences between consecutive words (the first word is coded as its
+//difference from 0) and collapse runs of equal differences. It's simple
+//enough to be faster than the network, even on our boards.
+//
+//The coded data is a sequence of tokens. Each starts with a tag byte:
+//
+//  1ccccccc  Run: the next varint is a difference, which repeats c+1 times
+//  0ccccccc  Literals: c+1 varints follow, one difference each
+//
+//A varint is a zigzagged difference ((d << 1) ^ (d >> 31), so small negative
+//differences are small too), 7 bits at a time, least significant first, with
+//the top bit set on every byte but the last.
+//
+//This header and drle.c don't depend on anything else, so clients can just
+//use them to decode.
+
+//Most differences a token can cover
+#define DRLE_MAX_COUNT 128
+
+//Shorter runs aren't worth a token of their own
+#define DRLE_MIN_RUN 3
+
+//Codes n words into out. Returns the number of bytes written, or -1 if that
+//would be more than max (in which case you might as well send them as is)
+int drle_encode(unsigned const *words, int n, unsigned char *out, int max);
+
+//Decodes len bytes from in into words. Returns the number of words written,
+//or -1 if the data is bad or there would be more than max_words of them
+int drle_decode(unsigned char const *in, int len, unsigned *words, int max_words);
+
+#endif
@@ -0,0 +1,373 @@
+#define _GNU_SOURCE             /* See feature_test_macros(7) */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "queue.h"
+#include "flit_ring.h"
+#include "fanout.h"
+#include "session.h"
+#include "rt.h"
+
+//How long client threads sleep before checking if they should quit
+#define FANOUT_POLL_MS 100
+
+//Waits (for a little while) until the client's socket can take more data.
+//Returns 0 if it's time to try again, or -1 if the client is gone
+static int wait_writable(fanout_client *c) {
+    struct pollfd pfd = {
+        .fd = c->sfd,
+        .events = POLLOUT
+    };
+    int rc = poll(&pfd, 1, FANOUT_POLL_MS);
+    if (rc < 0 && errno != EINTR) return -1;
+    if (pfd.revents & (POLLERR | POLLHUP | POLLNVAL)) return -1;
+    return 0;
+}
+
+//Sends flits to one client, straight out of the ring. The ring never waits
+//for us, so we never block inside a send while looking at ring memory.
+//Instead, we use non-blocking sends, and if the socket is full we wait for
+//it outside of the send
+static void *fanout_client_tx(void *arg) {
+    fanout_client *c = (fanout_client *) arg;
+    fanout_info *info = c->server;
+    flit_ring *r = info->ring;
+
+    int max = info->batch_size / sizeof(unsigned);
+    if (max <= 0) max = 1;
+
+    struct iovec iov[2];
+    struct msghdr msg = {
+        .msg_iov = iov,
+        .msg_iovlen = 2
+    };
+
+    while (!atomic_load(&c->rx_done)) {
+        int n = flit_ring_peek_timed(r, c->pos, max, iov, FANOUT_POLL_MS);
+        if (n == 0) continue;
+        if (n == FLIT_RING_CLOSED) break;
+        if (n == FLIT_RING_LAPPED) {
+            if (!info->skip_laggards) {
+                fprintf(stderr, "Client %d fell too far behind; dropping it\n", c->id);
+                break;
+            }
+            unsigned long long head = flit_ring_head(r);
+            c->flits_skipped += head - c->pos;
+            c->pos = head;
+            continue;
+        }
+
+        int rc = sendmsg(c->sfd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+            if (wait_writable(c) < 0) break;
+            continue;
+        } else if (rc <= 0) {
+            break;
+        }
+        STATS_ADD_SHARED(info->stats, sock_tx_bytes, rc);
+        STATS_ADD_SHARED(info->stats, sock_writes, 1);
+        if (rc < n*sizeof(unsigned)) STATS_ADD_SHARED(info->stats, sock_short_writes, 1);
+
+        //The kernel took a partial word. Finish it off now (from a copy, so
+        //we can take our time) so that pos always lands on a word boundary
+        int partial = rc % sizeof(unsigned);
+        unsigned last;
+        if (partial != 0) {
+            unsigned long long idx = FLIT_RING_IDX(r, c->pos + rc/sizeof(unsigned));
+            last = r->buf[idx];
+        }
+
+        //Make sure the writer didn't lap us while the kernel was copying. If
+        //it did, what we sent could be garbage, and there's no way to take
+        //it back
+        if (flit_ring_check(r, c->pos) < 0) {
+            fprintf(stderr, "Client %d was overwritten while sending; dropping it\n", c->id);
+            break;
+        }
+
+        c->pos += rc / sizeof(unsigned);
+        c->flits_sent += rc / sizeof(unsigned);
+
+        if (partial != 0) {
+            char *rest = ((char *) &last) + partial;
+            int left = sizeof(unsigned) - partial;
+            while (left > 0) {
+                rc = send(c->sfd, rest, left, MSG_NOSIGNAL);
+                if (rc <= 0) goto done;
+                STATS_ADD_SHARED(info->stats, sock_tx_bytes, rc);
+                STATS_ADD_SHARED(info->stats, sock_writes, 1);
+                rest += rc;
+                left -= rc;
+            }
+            c->pos++;
+            c->flits_sent++;
+        }
+    }
+
+    done:
+    //Make sure the RX thread notices if we're the ones quitting
+    shutdown(c->sfd, SHUT_RDWR);
+    pthread_exit(NULL);
+}
+
+//Reads exactly len bytes. Returns 0 on success, or -1 on error or EOF
+static int read_all(int fd, void *buf, int len) {
+    char *p = (char *) buf;
+    while (len > 0) {
+        int rc = read(fd, p, len);
+        if (rc < 0 && errno == EINTR) continue;
+        if (rc <= 0) return -1;
+        p += rc;
+        len -= rc;
+    }
+    return 0;
+}
+
+//Writes exactly len bytes. Returns 0 on success, or -1 on error
+static int write_all(int fd, void const *buf, int len) {
+    char const *p = (char const *) buf;
+    while (len > 0) {
+        int rc = send(fd, p, len, MSG_NOSIGNAL);
+        if (rc < 0 && errno == EINTR) continue;
+        if (rc <= 0) return -1;
+        p += rc;
+        len -= rc;
+    }
+    return 0;
+}
+
+//Does the session handshake, and moves the client's position if it asked to
+//resume. Returns 0 on success, or -1 if the client should be dropped
+static int session_handshake(fanout_client *c) {
+    flit_ring *r = c->server->ring;
+
+    session_hello hello;
+    if (read_all(c->sfd, &hello, sizeof(hello)) < 0) return -1;
+
+    session_ack ack = {
+        .magic = SESSION_MAGIC,
+        .version = SESSION_VERSION,
+        .flags = 0,
+        .status = SESSION_OK
+    };
+
+    if (hello.magic != SESSION_MAGIC || hello.version != SESSION_VERSION) {
+        fprintf(stderr, "Client %d sent a bad hello; dropping it\n", c->id);
+        ack.status = SESSION_BAD_HELLO;
+        write_all(c->sfd, &ack, sizeof(ack));
+        return -1;
+    }
+
+    if (hello.flags & SESSION_RESUME) {
+        unsigned long long head = flit_ring_head(r);
+        unsigned long long tail = flit_ring_tail(r);
+        ack.flags |= SESSION_RESUME;
+
+        if (hello.resume_seq > head) {
+            ack.status = SESSION_BAD_SEQ;
+            c->pos = head;
+        } else if (hello.resume_seq < tail) {
+            ack.status = SESSION_GAP;
+            c->pos = tail;
+        } else {
+            c->pos = hello.resume_seq;
+        }
+        fprintf(stderr, "Client %d resuming from %llu (asked for %llu)\n",
+            c->id, c->pos, (unsigned long long) hello.resume_seq);
+    }
+
+    ack.start_seq = c->pos;
+    return write_all(c->sfd, &ack, sizeof(ack));
+}
+
+//Reads commands from one client and puts them into the shared ingress queue.
+//We only ever write whole words, so that commands from different clients
+//can't get mixed up with each other
+static void *fanout_client_rx(void *arg) {
+    fanout_client *c = (fanout_client *) arg;
+    fanout_info *info = c->server;
+
+    if (info->sessions && session_handshake(c) < 0) goto early_exit;
+
+    int rc = pthread_create(&c->tx_thread, NULL, fanout_client_tx, c);
+    if (rc != 0) {
+        fprintf(stderr, "Could not start TX thread for client %d: %s\n", c->id, strerror(rc));
+        goto early_exit;
+    }
+    pthread_setname_np(c->tx_thread, info->tx_thread_name);
+    rt_apply(c->tx_thread, info->tx_thread_name);
+
+    char buf[256];
+    int have = 0;
+    while (1) {
+        int len = read(c->sfd, buf + have, sizeof(buf) - have);
+        if (len == 0) {
+            break;
+        } else if (len < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        STATS_ADD_SHARED(info->stats, sock_rx_bytes, len);
+        STATS_ADD_SHARED(info->stats, sock_reads, 1);
+        have += len;
+
+        int whole = have - (have % sizeof(unsigned));
+        if (whole > 0) {
+            pthread_mutex_lock(&info->ingress_mutex);
+            if (info->lat != NULL) lat_mark_add(&info->lat->cmd_marks, QUEUE_WR_POS(info->ingress));
+            rc = queue_write(info->ingress, buf, whole);
+            pthread_mutex_unlock(&info->ingress_mutex);
+            if (rc < 0) break;
+
+            memmove(buf, buf + whole, have - whole);
+            have -= whole;
+        }
+    }
+
+    atomic_store(&c->rx_done, 1);
+    shutdown(c->sfd, SHUT_RDWR);
+    flit_ring_wake(info->ring);
+    pthread_join(c->tx_thread, NULL);
+
+    pthread_mutex_lock(&info->mutex);
+    if (c->pos > info->resume_pos) info->resume_pos = c->pos;
+    pthread_mutex_unlock(&info->mutex);
+
+    fprintf(stderr, "Client %d disconnected: sent %llu flits, skipped %llu\n",
+        c->id, c->flits_sent, c->flits_skipped);
+
+    close(c->sfd);
+    atomic_store(&c->done, 1);
+    pthread_exit(NULL);
+
+    early_exit:
+    close(c->sfd);
+    atomic_store(&c->done, 1);
+    pthread_exit(NULL);
+}
+
+//Joins and frees any clients that have finished. If all is nonzero, waits
+//for every client. Call with info->mutex held
+static void reap_clients(fanout_info *info, int all) {
+    int i;
+    for (i = 0; i < FANOUT_MAX_CLIENTS; i++) {
+        fanout_client *c = info->clients[i];
+        if (c == NULL) continue;
+        if (!all && !atomic_load(&c->done)) continue;
+
+        pthread_join(c->rx_thread, NULL);
+        free(c);
+        info->clients[i] = NULL;
+    }
+}
+
+//Accepts clients until fanout_stop is called
+void* fanout_mgr(void *arg) {
+#ifdef DEBUG_ON
+    fprintf(stderr, "Entered fan-out manager\n");
+    fflush(stderr);
+#endif
+    fanout_info *info = (fanout_info *) arg;
+
+    int rc = listen(info->server_sfd, FANOUT_MAX_CLIENTS);
+    if (rc < 0) {
+        perror("Could not listen on socket");
+        goto done;
+    }
+
+    while (1) {
+        struct sockaddr_in client_addr; //In case we ever want to use it
+        socklen_t client_addr_len = sizeof(client_addr);
+        int client_sfd = accept(info->server_sfd, (struct sockaddr*)&client_addr, &client_addr_len);
+
+        pthread_mutex_lock(&info->mutex);
+        if (info->stop) {
+            pthread_mutex_unlock(&info->mutex);
+            if (client_sfd >= 0) close(client_sfd);
+            break;
+        }
+        if (client_sfd < 0) {
+            pthread_mutex_unlock(&info->mutex);
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            perror("Could not accept incoming connection");
+            break;
+        }
+
+        reap_clients(info, 0);
+
+        int num_clients = 0, slot = -1;
+        int i;
+        for (i = 0; i < FANOUT_MAX_CLIENTS; i++) {
+            if (info->clients[i] != NULL) num_clients++;
+            else if (slot < 0) slot = i;
+        }
+        if (num_clients >= info->max_clients || slot < 0) {
+            pthread_mutex_unlock(&info->mutex);
+            fprintf(stderr, "Too many clients; refusing connection\n");
+            close(client_sfd);
+            continue;
+        }
+
+        fanout_client *c = calloc(1, sizeof(fanout_client));
+        if (c == NULL) {
+            pthread_mutex_unlock(&info->mutex);
+            close(client_sfd);
+            continue;
+        }
+        c->server = info;
+        c->id = info->next_id++;
+        c->sfd = client_sfd;
+        //New clients start with the newest data, unless we're resuming. In
+        //that case, start with whatever nobody was sent yet (or the oldest
+        //data in the ring, if some of that was already overwritten)
+        if (info->resume) {
+            unsigned long long tail = flit_ring_tail(info->ring);
+            c->pos = (info->resume_pos > tail) ? info->resume_pos : tail;
+        } else {
+            c->pos = flit_ring_head(info->ring);
+        }
+
+        rc = pthread_create(&c->rx_thread, NULL, fanout_client_rx, c);
+        if (rc != 0) {
+            fprintf(stderr, "Could not start thread for client: %s\n", strerror(rc));
+            close(client_sfd);
+            free(c);
+        } else {
+            pthread_setname_np(c->rx_thread, info->rx_thread_name);
+            rt_apply(c->rx_thread, info->rx_thread_name);
+            info->clients[slot] = c;
+            fprintf(stderr, "Client %d connected\n", c->id);
+        }
+        pthread_mutex_unlock(&info->mutex);
+    }
+
+    //Kick everyone off and wait for them to finish
+    pthread_mutex_lock(&info->mutex);
+    int i;
+    for (i = 0; i < FANOUT_MAX_CLIENTS; i++) {
+        if (info->clients[i] != NULL) shutdown(info->clients[i]->sfd, SHUT_RDWR);
+    }
+    reap_clients(info, 1);
+    pthread_mutex_unlock(&info->mutex);
+
+    done:
+    queue_add_producers(info->ingress, -1);
+    pthread_exit(NULL);
+}
+
+//Tells fanout_mgr to quit
+void fanout_stop(fanout_info *info) {
+    pthread_mutex_lock(&info->mutex);
+    info->stop = 1;
+    pthread_mutex_unlock(&info->mutex);
+
+    //This wakes up accept()
+    shutdown(info->server_sfd, SHUT_RDWR);
+}
@@ -0,0 +1,86 @@
+#ifndef FANOUT_H
+#define FANOUT_H 1
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include "queue.h"
+#include "flit_ring.h"
+#include "stats.h"
+#include "lat.h"
+
+//Fan-out mode. Instead of a single client and a queue, fifo_mgr writes flits
+//into a flit_ring and any number of clients can connect and get the same
+//stream. Each client gets two threads: one reading commands from it (which
+//go into the shared ingress queue, one client at a time) and one sending it
+//flits straight out of the ring from its own position.
+//
+//A client that falls too far behind is either dropped or skipped ahead to
+//the newest data, depending on skip_laggards. Either way it never holds up
+//fifo_mgr or the other clients.
+//
+//Normally a new client starts with the newest flits. With resume set (daemon
+//mode), it instead starts right after the last flit any earlier client was
+//sent, so whatever the ring caught while nobody was connected isn't lost (as
+//long as it still fits in the ring).
+//
+//With sessions set, each client starts with a handshake (see session.h) that
+//tells it the sequence number (i.e. ring position) of the first flit it'll
+//get, and lets it ask to resume from any position still in the ring.
+
+//Quick and dirty; don't bother with dynamic allocation
+#define FANOUT_MAX_CLIENTS 64
+
+struct _fanout_info;
+
+typedef struct _fanout_client {
+    struct _fanout_info *server;
+    int id;
+    int sfd;
+
+    //Only touched by the client's TX thread. pos is the position in the ring
+    //of the next flit we'll send
+    unsigned long long pos;
+    unsigned long long flits_sent;
+    unsigned long long flits_skipped;
+
+    pthread_t rx_thread;
+    pthread_t tx_thread;
+    _Atomic int rx_done;
+    _Atomic int done;
+} fanout_client;
+
+typedef struct _fanout_info {
+    //Never modified by the threads
+    int server_sfd;
+    int max_clients;
+    int skip_laggards; //If nonzero, skip slow clients ahead instead of dropping them
+    int batch_size; //Max number of bytes sent to a client in one go
+    int resume; //If nonzero, new clients pick up where the last one left off
+    int sessions; //If nonzero, clients start with the handshake in session.h
+    char rx_thread_name[16];
+    char tx_thread_name[16];
+    flit_ring *ring;
+    queue *ingress;
+    pipe_stats *stats; //Every client adds to the socket counters
+    pipe_lat *lat; //Latency histograms (-H; commands only), or NULL
+
+    //Protects stop and the client list
+    pthread_mutex_t mutex;
+    int stop;
+    fanout_client *clients[FANOUT_MAX_CLIENTS];
+    int next_id;
+    unsigned long long resume_pos; //Furthest any disconnected client got
+
+    //Only one client at a time can be writing commands into the ingress queue
+    pthread_mutex_t ingress_mutex;
+} fanout_info;
+
+//Accepts clients until fanout_stop is called, then kicks them all off and
+//quits. Remember to increment the number of producers on the ingress queue
+//before spinning up this thread; it decrements it when it's done
+void* fanout_mgr(void *arg);
+
+//Tells fanout_mgr to quit. Safe to call from any thread
+void fanout_stop(fanout_info *info);
+
+#endif
@@ -0,0 +1,714 @@
+#define _GNU_SOURCE             /* See feature_test_macros(7) */
+#include <stdio.h>
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/uio.h>
+#include "axistreamfifo.h"
+#include "queue.h"
+#include "fifo_mgr.h"
+#include "poll_policy.h"
+#include "trace.h"
+#include "frame.h"
+#include "capture.h"
+#include "replay.h"
+#include "filter.h"
+
+
+//Prints how the calling thread spent its time
+static void print_poll_stats(poll_policy *pp) {
+    char name[16];
+    pthread_getname_np(pthread_self(), name, sizeof(name));
+    poll_policy_print(pp, name);
+}
+
+//Puts one frame (header and len bytes of payload) into q with a single 
+//commit, so net_tx never sees half of one. Returns 0 on success, negative
+//otherwise
+static int write_frame(queue *q, unsigned type, unsigned flags, void const *payload, int len) {
+    frame_hdr hdr = {
+        .len = len,
+        .type = type,
+        .flags = flags
+    };
+    int total = sizeof(hdr) + len;
+    struct iovec iov[2];
+    if (queue_reserve_write(q, total, total, iov) < 0) return -1;
+    queue_span_put(iov, 0, &hdr, sizeof(hdr));
+    queue_span_put(iov, sizeof(hdr), payload, len);
+    queue_commit_write(q, total);
+    return 0;
+}
+
+//Burst version of fifo_tx. Grabs as many whole command words as are queued
+//(but no more than the TX FIFO has room for) and sends them as one packet
+static void fifo_tx_burst(fifo_mgr_info *info) {
+    queue *q = info->egress;
+    
+    unsigned words[BUF_SIZE/sizeof(unsigned)];
+    unsigned vcy = 0;
+    struct iovec iov[2];
+    int full = 0; //So we count each time the FIFO fills up only once
+    
+    poll_policy pp;
+    poll_policy_init(&pp, info->poll_cfg);
+    
+    while (1) {
+        //Make sure there's room in the TX FIFO before we take anything out of
+        //the queue. We only read TDFV when our cached copy runs out
+        if (vcy == 0) {
+            vcy = tx_fifo_word_vacancy(info->tx_fifo);
+            if (vcy == 0) {
+                if (!full) STATS_ADD(info->stats, tx_full, 1);
+                full = 1;
+                //Quit if net_mgr is gone, otherwise wait for the FIFO to drain
+                if (atomic_load(&q->num_producers) <= 0) break;
+                poll_policy_idle(&pp);
+                continue;
+            }
+            full = 0;
+        }
+        
+        int max = vcy*sizeof(unsigned);
+        if (max > BUF_SIZE) max = BUF_SIZE;
+        int len = queue_peek_read(q, sizeof(unsigned), max, iov);
+        if (len < 0) break;
+        
+        //Only take whole words. The client can give us a partial word, and 
+        //it just stays in the queue until the rest of it shows up. Also, a 
+        //word can straddle the wraparound, so we can't send directly out of
+        //the queue's storage
+        len -= len % sizeof(unsigned);
+        int first = (len < iov[0].iov_len) ? len : iov[0].iov_len;
+        memcpy(words, iov[0].iov_base, first);
+        memcpy((char*) words + first, iov[1].iov_base, len - first);
+        
+        if (info->lat != NULL) lat_marks_dequeued(&info->lat->cmd_marks, QUEUE_RD_POS(q) + len, &info->lat->cmd_queue);
+        
+        int rc = send_words_burst(info->tx_fifo, words, len/sizeof(unsigned), &vcy);
+        if (rc < 0) {
+            if (rc == -E_ERR_IRQ) STATS_ADD(info->stats, tx_errs, 1);
+            fprintf(stderr, "Could not write to TX FIFO: %s\n", asfifo_strerror(rc));
+            trace_dump(stderr);
+            break;
+        }
+        if (rc > 0) {
+            STATS_ADD(info->stats, tx_words, rc);
+            STATS_ADD(info->stats, tx_pkts, 1);
+            trace_emit(TR_FIFO_SENT, rc, atomic_load_explicit(&info->stats->tx_words, memory_order_relaxed));
+            if (info->record != NULL) replay_record(info->record, words, rc);
+            if (info->lat != NULL) {
+                lat_marks_sent(&info->lat->cmd_marks, QUEUE_RD_POS(q) + rc*sizeof(unsigned), &info->lat->cmd_send, &info->lat->cmd_total);
+            }
+        }
+        queue_release_read(q, rc*sizeof(unsigned));
+        poll_policy_busy(&pp);
+    }
+    
+    print_poll_stats(&pp);
+}
+
+//Sends n command words for fifo_tx_framed. If packet is nonzero they go out
+//as one packet, once the TX FIFO has room for all of them; otherwise they're
+//sent just like fifo_tx and fifo_tx_burst would. Returns 0 on success,
+//-E_ERR_IRQ if the TX FIFO raised an error (in which case the rest of the
+//words are dropped), or -1 if net_mgr went away while we were waiting for
+//room
+static int send_cmds(fifo_mgr_info *info, unsigned *words, int n, int packet, unsigned *vcy, poll_policy *pp) {
+    queue *q = info->egress;
+    int full = 0; //So we count each time the FIFO fills up only once
+    int sent = 0;
+    
+    while (sent < n) {
+        int rc;
+        if (packet) {
+            rc = send_words(info->tx_fifo, words, n);
+            if (rc == 0) rc = n;
+            *vcy = 0; //send_words doesn't keep our cached vacancy up to date
+        } else if (info->tx_burst) {
+            rc = send_words_burst(info->tx_fifo, words + sent, n - sent, vcy);
+            if (rc == 0) rc = -E_TX_FIFO_NO_ROOM;
+        } else {
+            rc = send_words(info->tx_fifo, words + sent, 1);
+            if (rc == 0) rc = 1;
+        }
+        
+        if (rc == -E_TX_FIFO_NO_ROOM) {
+            if (!full) STATS_ADD(info->stats, tx_full, 1);
+            full = 1;
+            //Quit if net_mgr is gone, otherwise wait for the FIFO to drain
+            if (atomic_load(&q->num_producers) <= 0) return -1;
+            poll_policy_idle(pp);
+            continue;
+        } else if (rc < 0) {
+            if (rc == -E_ERR_IRQ) STATS_ADD(info->stats, tx_errs, 1);
+            return rc;
+        }
+        
+        full = 0;
+        if (info->record != NULL) replay_record(info->record, words + sent, rc);
+        sent += rc;
+        STATS_ADD(info->stats, tx_words, rc);
+        STATS_ADD(info->stats, tx_pkts, 1);
+        trace_emit(TR_FIFO_SENT, rc, atomic_load_explicit(&info->stats->tx_words, memory_order_relaxed));
+        poll_policy_busy(pp);
+    }
+    
+    return 0;
+}
+
+//Biggest payload fifo_tx ever sends back to the client
+#define MAX_REPLY_LEN sizeof(frame_ack)
+
+//Hands a frame to fifo_mgr_poll to send to the client. The whole thing goes
+//into info->replies in one go, so fifo_mgr_poll never sees half of one. If
+//fifo_mgr is asleep waiting for an RX interrupt, we wake it so the reply
+//goes out now. Returns 0 on success, or negative if nobody is going to send it
+static int send_reply(fifo_mgr_info *info, unsigned type, void const *payload, int len) {
+    char buf[sizeof(frame_hdr) + MAX_REPLY_LEN];
+    frame_hdr hdr = {
+        .len = len,
+        .type = type,
+        .flags = 0
+    };
+    memcpy(buf, &hdr, sizeof(hdr));
+    memcpy(buf + sizeof(hdr), payload, len);
+    int rc = queue_write(info->replies, buf, sizeof(hdr) + len);
+    if (rc >= 0 && info->rx_wake != NULL) irq_wake(info->rx_wake);
+    return rc;
+}
+
+//Framed version of fifo_tx (see frame.h). Reads a frame at a time out of the
+//egress queue and deals with it: sends the commands in it, or changes the
+//connection's options or filter rules. Every FRAME_CMD_PACKET gets a 
+//frame_ack, every FRAME_SET_OPTS gets a FRAME_OPTS, and every 
+//FRAME_SET_FILTER gets a FRAME_FILTER, which go through info->replies for 
+//fifo_mgr_poll to send to the client
+static void fifo_tx_framed(fifo_mgr_info *info) {
+    queue *q = info->egress;
+    
+    unsigned words[FRAME_MAX_PACKET_WORDS];
+    unsigned vcy = 0;
+    unsigned seq = 0;
+    frame_hdr hdr;
+    
+    poll_policy pp;
+    poll_policy_init(&pp, info->poll_cfg);
+    
+    while (dequeue_n(q, (char*) &hdr, sizeof(hdr)) >= 0) {
+        unsigned left = hdr.len;
+        int rc = 0;
+        
+        if (hdr.type == FRAME_CMD_PACKET) {
+            frame_ack ack = {
+                .seq = seq++,
+                .status = FRAME_ACK_OK,
+                .words = hdr.len / sizeof(unsigned)
+            };
+            //A packet bigger than the TX FIFO would wait for room forever
+            if (left == 0 || left > sizeof(words) || left % sizeof(unsigned) != 0 || ack.words > info->tx_depth) {
+                ack.status = FRAME_ACK_BAD_LEN;
+            } else {
+                if (dequeue_n(q, (char*) words, left) < 0) break;
+                left = 0;
+                if (info->lat != NULL) lat_marks_dequeued(&info->lat->cmd_marks, QUEUE_RD_POS(q), &info->lat->cmd_queue);
+                rc = send_cmds(info, words, ack.words, 1, &vcy, &pp);
+                if (rc == -E_ERR_IRQ) ack.status = FRAME_ACK_TX_ERR;
+                if (info->lat != NULL) lat_marks_sent(&info->lat->cmd_marks, QUEUE_RD_POS(q), &info->lat->cmd_send, &info->lat->cmd_total);
+            }
+            if (rc == -1 || send_reply(info, FRAME_ACK, &ack, sizeof(ack)) < 0) break;
+        } else if (hdr.type == FRAME_SET_OPTS && left == sizeof(unsigned)) {
+            unsigned opts;
+            if (dequeue_n(q, (char*) &opts, sizeof(opts)) < 0) break;
+            left = 0;
+            //Turn on the ones we know about, and tell the client which
+            opts &= FRAME_OPT_COMPRESS;
+            atomic_store(info->opts, opts);
+            if (send_reply(info, FRAME_OPTS, &opts, sizeof(opts)) < 0) break;
+        } else if (hdr.type == FRAME_SET_FILTER) {
+            frame_filter_rule rules[FRAME_MAX_FILTER_RULES];
+            int32_t answer = -1;
+            if (left <= sizeof(rules) && left % sizeof(frame_filter_rule) == 0) {
+                if (left > 0 && dequeue_n(q, (char*) rules, left) < 0) break;
+                int n = left / sizeof(frame_filter_rule);
+                left = 0;
+                pthread_mutex_lock(&info->mutex);
+                if (filter_set_rules(&info->filter_next, rules, n) == 0) {
+                    answer = n;
+                    atomic_store(&info->filter_pending, 1);
+                }
+                pthread_mutex_unlock(&info->mutex);
+            }
+            if (send_reply(info, FRAME_FILTER, &answer, sizeof(answer)) < 0) break;
+        }
+        
+        //Loose words (or whatever is left of a frame we're skipping) a 
+        //buffer at a time. A partial word on the end is thrown away
+        while (left > 0) {
+            int len = (left < sizeof(words)) ? left : sizeof(words);
+            if (dequeue_n(q, (char*) words, len) < 0) goto done;
+            left -= len;
+            if (hdr.type != FRAME_CMDS) continue;
+            
+            if (info->lat != NULL) lat_marks_dequeued(&info->lat->cmd_marks, QUEUE_RD_POS(q), &info->lat->cmd_queue);
+            rc = send_cmds(info, words, len / sizeof(unsigned), 0, &vcy, &pp);
+            if (rc == -1) goto done;
+            if (info->lat != NULL) lat_marks_sent(&info->lat->cmd_marks, QUEUE_RD_POS(q), &info->lat->cmd_send, &info->lat->cmd_total);
+        }
+    }
+    
+    done:
+    print_poll_stats(&pp);
+}
+
+//How many TX errors fifo_tx_replay describes before it just counts them
+#define REPLAY_MAX_ERR_MSGS 10
+
+//Longest a timed replay sleeps at a time before checking if it's been told
+//to stop
+#define REPLAY_SLEEP_STEP_NS 50000000LL
+
+static int replay_stopped(fifo_mgr_info *info) {
+    pthread_mutex_lock(&info->mutex);
+    int stop = info->stop;
+    pthread_mutex_unlock(&info->mutex);
+    return stop;
+}
+
+//Sleeps until when (on CLOCK_MONOTONIC), a step at a time so that a long gap
+//in a recording can't keep us from stopping. Returns 0, or -1 if we were told
+//to stop
+static int replay_sleep_until(fifo_mgr_info *info, struct timespec const *when) {
+    while (!replay_stopped(info)) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long long left = (when->tv_sec - now.tv_sec) * 1000000000LL + (when->tv_nsec - now.tv_nsec);
+        if (left <= 0) return 0;
+        
+        struct timespec step = *when;
+        if (left > REPLAY_SLEEP_STEP_NS) {
+            long long ns = now.tv_nsec + REPLAY_SLEEP_STEP_NS;
+            step.tv_sec = now.tv_sec + ns / 1000000000LL;
+            step.tv_nsec = ns % 1000000000LL;
+        }
+        int rc;
+        do {
+            rc = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &step, NULL);
+        } while (rc == EINTR);
+        //Shouldn't happen, but if we can't sleep, just send it now
+        if (rc != 0) return 0;
+    }
+    return -1;
+}
+
+//Sends info->replay to the TX FIFO, one AXI-Stream packet per packet in the 
+//file, then prints how it went. Like fifo_tx_burst, we only read TDFV once
+//our cached vacancy runs out. Packets that get a TX error (or are too big for
+//the FIFO) are counted and we carry on, so one run shows every packet that 
+//upsets the hardware. Returns
+//0, or -1 if we were told to stop partway through
+static int fifo_tx_replay(fifo_mgr_info *info) {
+    replay_script *s = info->replay;
+    int timed = info->replay_timed && s->timed;
+    unsigned vcy = 0;
+    int full = 0; //So we count each time the FIFO fills up only once
+    unsigned long long num_full = 0;
+    unsigned long long words = 0;
+    int errs = 0;
+    int i;
+    
+    poll_policy pp;
+    poll_policy_init(&pp, info->poll_cfg);
+    
+    //Anything bigger than the FIFO would wait for room forever
+    unsigned depth = info->tx_depth;
+    
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    
+    for (i = 0; i < s->num_pkts; i++) {
+        replay_pkt *pkt = &s->pkts[i];
+        
+        if (pkt->words > depth) {
+            if (errs++ < REPLAY_MAX_ERR_MSGS) {
+                fprintf(stderr, "Replay of %s: packet %d (%u words) doesn't fit in the TX FIFO (%u words); skipping it\n", s->path, i, pkt->words, depth);
+            }
+            continue;
+        }
+        
+        if (timed) {
+            unsigned long long ns = start.tv_nsec + pkt->t_ns;
+            struct timespec when = {
+                .tv_sec = start.tv_sec + ns / 1000000000ULL,
+                .tv_nsec = ns % 1000000000ULL
+            };
+            if (replay_sleep_until(info, &when) < 0) {
+                goto stopped;
+            }
+        }
+        
+        //Wait until the whole packet fits, so it goes out in one piece
+        while (vcy < pkt->words) {
+            vcy = tx_fifo_word_vacancy(info->tx_fifo);
+            if (vcy >= pkt->words) break;
+            if (!full) {
+                STATS_ADD(info->stats, tx_full, 1);
+                num_full++;
+            }
+            full = 1;
+            
+            if (replay_stopped(info)) {
+                goto stopped;
+            }
+            poll_policy_idle(&pp);
+        }
+        full = 0;
+        
+        int rc = send_words_burst(info->tx_fifo, s->words + pkt->off, pkt->words, &vcy);
+        if (rc < 0) {
+            if (rc == -E_ERR_IRQ) STATS_ADD(info->stats, tx_errs, 1);
+            if (errs++ < REPLAY_MAX_ERR_MSGS) {
+                fprintf(stderr, "Replay of %s: packet %d (%u words): %s\n", s->path, i, pkt->words, asfifo_strerror(rc));
+            }
+            continue;
+        }
+        
+        words += rc;
+        STATS_ADD(info->stats, tx_words, rc);
+        STATS_ADD(info->stats, tx_pkts, 1);
+        trace_emit(TR_FIFO_SENT, rc, atomic_load_explicit(&info->stats->tx_words, memory_order_relaxed));
+        if (info->record != NULL) replay_record(info->record, s->words + pkt->off, rc);
+        poll_policy_busy(&pp);
+    }
+    
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    fprintf(stderr, "Replayed %s%s: %llu words in %d packets in %.6f s (%.0f words/s); "
+        "%d errors, TX FIFO full %llu times\n",
+        s->path, timed ? " (timed)" : "", words, s->num_pkts, secs,
+        (secs > 0) ? words / secs : 0.0, errs, num_full);
+    print_poll_stats(&pp);
+    return 0;
+    
+    stopped:
+    fprintf(stderr, "Replay of %s stopped after %d of %d packets\n", s->path, i, s->num_pkts);
+    print_poll_stats(&pp);
+    return -1;
+}
+
+void *fifo_tx(void *arg) {
+#ifdef DEBUG_ON
+    fprintf(stderr, "Entered FIFO TX\n");
+    fflush(stderr);
+#endif
+    fifo_mgr_info *info = (fifo_mgr_info*) arg;
+    queue *q = info->egress;
+    
+    //The TX FIFO was reset just before we started, and nobody else writes
+    //to it, so this is how deep it is
+    info->tx_depth = tx_fifo_word_vacancy(info->tx_fifo);
+    
+    //Anything the client sends waits in the egress queue until we're done
+    if (info->replay != NULL && fifo_tx_replay(info) < 0) pthread_exit(NULL);
+    
+    if (info->framed) {
+        fifo_tx_framed(info);
+        pthread_exit(NULL);
+    }
+    if (info->tx_burst) {
+        fifo_tx_burst(info);
+        pthread_exit(NULL);
+    }
+    
+    unsigned val;
+    
+    //Endianness? I'll just fix it if it's wrong.
+    while(dequeue_n(q, (char*) &val, sizeof(unsigned)) >= 0) {
+        if (info->lat != NULL) lat_marks_dequeued(&info->lat->cmd_marks, QUEUE_RD_POS(q), &info->lat->cmd_queue);
+        int rc = send_words(info->tx_fifo, &val, 1);
+        if (rc < 0) {
+            if (rc == -E_ERR_IRQ) STATS_ADD(info->stats, tx_errs, 1);
+            else if (rc == -E_TX_FIFO_NO_ROOM) STATS_ADD(info->stats, tx_full, 1);
+            trace_dump(stderr);
+            break;
+        }
+        STATS_ADD(info->stats, tx_words, 1);
+        STATS_ADD(info->stats, tx_pkts, 1);
+        if (info->record != NULL) replay_record(info->record, &val, 1);
+        trace_emit(TR_FIFO_SENT, 1, atomic_load_explicit(&info->stats->tx_words, memory_order_relaxed));
+        if (info->lat != NULL) lat_marks_sent(&info->lat->cmd_marks, QUEUE_RD_POS(q), &info->lat->cmd_send, &info->lat->cmd_total);
+    }
+    
+    pthread_exit(NULL);    
+}
+
+//Called once the RX side of a FIFO is finished, from whichever thread was 
+//polling it
+static void fifo_mgr_finish(fifo_mgr_info *info) {
+#ifdef DEBUG_ON
+    fprintf(stderr, "Entered FIFO manager cleanup\n");
+    fflush(stderr);
+#endif
+    info->done = 1;
+    queue_add_producers(info->ingress, -1);
+    //Nobody is going to send fifo_tx's replies anymore
+    if (info->replies != NULL) queue_add_consumers(info->replies, -1);
+}
+
+//Saves a burst to the capture file, as a FRAME_FLITS frame in framed mode.
+//This is what came out of the RX FIFO, before the client's filter rules get
+//to it, and the client's other frames (acks, FRAME_OPTS, FRAME_FILTER) never
+//go in. So it isn't the same as what the client got
+static void capture_burst(fifo_mgr_info *info, unsigned flags, void const *payload, int len) {
+    if (info->framed) {
+        frame_hdr hdr = {
+            .len = len,
+            .type = FRAME_FLITS,
+            .flags = flags
+        };
+        capture_put(info->capture, &hdr, sizeof(hdr));
+    }
+    capture_put(info->capture, payload, len);
+    capture_commit(info->capture);
+}
+
+//Framed mode: applies the client's filter rules to the len words we just
+//read into rx_buf, and keeps track of where packets start. flags are the
+//frame's, and get FRAME_FILTERED if we took words out. Returns how many words
+//to send, or -1 to send nothing at all
+static int filter_burst(fifo_mgr_info *info, int len, unsigned *flags) {
+    int first = !info->rx_mid_pkt;
+    int last = !(*flags & FRAME_PARTIAL);
+    info->rx_mid_pkt = !last;
+    //New rules can be swapped in halfway through a packet, so keep
+    //filter_drop and filter_sent right for the one going out now
+    if (info->filter.num_rules == 0) {
+        info->filter_drop = 0;
+        info->filter_sent = !last;
+        return len;
+    }
+    
+    if (first) info->filter_drop = !filter_packet(&info->filter, info->rx_buf[0]);
+    if (info->filter_drop) {
+        STATS_ADD(info->stats, rx_filtered, len);
+        return -1;
+    }
+    
+    int n = filter_words(&info->filter, info->rx_buf, len);
+    if (n < len) {
+        *flags |= FRAME_FILTERED;
+        STATS_ADD(info->stats, rx_filtered, len - n);
+    }
+    //Nothing left, but if we already sent part of this packet the client
+    //still needs to hear that it's over
+    if (n == 0 && !(last && info->filter_sent)) {
+        if (last) info->filter_sent = 0;
+        return -1;
+    }
+    info->filter_sent = !last;
+    return n;
+}
+
+//Polls the RX FIFO once, and places whatever it got into the ingress queue. 
+//Returns the number of words read (which can be 0), or -1 if this FIFO is 
+//finished
+int fifo_mgr_poll(fifo_mgr_info *info) {
+    queue *q = info->ingress;
+    
+    if (info->done) return -1;
+    
+    pthread_mutex_lock(&info->mutex);
+    int stop = info->stop;
+    pthread_mutex_unlock(&info->mutex);
+    
+    //If net_tx has quit, there's no point reading anything else. In fan-out
+    //mode clients come and go, so keep going until we're told to stop
+    if (stop || (info->ring == NULL && atomic_load(&q->num_consumers) <= 0)) {
+        fifo_mgr_finish(info);
+        return -1;
+    }
+    
+    //We're the only one allowed to write to the ingress queue, so replies 
+    //from fifo_tx (see fifo_tx_framed) go out from here, in between packets
+    if (info->replies != NULL) {
+        frame_hdr hdr;
+        char payload[MAX_REPLY_LEN];
+        while (nb_dequeue_n(info->replies, (char*) &hdr, sizeof(hdr)) == 0) {
+            //send_reply puts in whole frames, so the payload is already there
+            nb_dequeue_n(info->replies, payload, hdr.len);
+            if (write_frame(q, hdr.type, hdr.flags, payload, hdr.len) < 0) {
+                fifo_mgr_finish(info);
+                return -1;
+            }
+        }
+    }
+    
+    //New filter rules from fifo_tx. We check after sending the replies, so
+    //that everything after the client's FRAME_FILTER answer uses them
+    if (atomic_load(&info->filter_pending)) {
+        pthread_mutex_lock(&info->mutex);
+        info->filter = info->filter_next;
+        atomic_store(&info->filter_pending, 0);
+        pthread_mutex_unlock(&info->mutex);
+    }
+    
+    //A client showed up while we were only capturing. It gets everything
+    //from the next packet on
+    if (info->capture_only && atomic_load(info->attached) && !info->rx_mid_pkt) {
+        info->capture_only = 0;
+    }
+    
+    //Drain a whole packet (or as much of it as fits in our buffer) out of
+    //the RX FIFO, and enqueue all of it at once.
+    //Endianness is gonna bite me here...
+    int rc;
+    int len = read_packet(info->rx_fifo, info->rx_mode, info->rx_buf, RX_BURST_WORDS, &info->rx_state);
+    if (len > 0) {
+        STATS_ADD(info->stats, rx_flits, len);
+        STATS_ADD(info->stats, rx_reads, 1);
+        trace_emit(TR_FIFO_READ, len, atomic_load_explicit(&info->stats->rx_flits, memory_order_relaxed));
+        
+        //In framed mode: if we didn't get to the end of the packet, the rest
+        //of it goes in the next frame
+        unsigned flags = (info->rx_state.status != READ_WORDS_IDLE) ? FRAME_PARTIAL : 0;
+        if (info->capture != NULL) capture_burst(info, flags, info->rx_buf, len*sizeof(unsigned));
+        
+        //The client might only want some of it. The capture gets everything
+        int n = info->framed ? filter_burst(info, len, &flags) : len;
+        
+        if (info->ring != NULL) {
+            flit_ring_write(info->ring, info->rx_buf, len);
+        } else if (n >= 0 && !info->capture_only) {
+            //The mark has to go in before the flits do; see lat.h
+            if (info->lat != NULL) lat_mark_add(&info->lat->flit_marks, QUEUE_WR_POS(q));
+            if (info->framed) {
+                rc = write_frame(q, FRAME_FLITS, flags, info->rx_buf, n*sizeof(unsigned));
+            } else {
+                rc = queue_write(q, (char*) info->rx_buf, len*sizeof(unsigned));
+            }
+            if (rc < 0) {
+                fifo_mgr_finish(info);
+                return -1;
+            }
+        }
+    } else if (len == 0) {
+        STATS_ADD(info->stats, rx_polls_empty, 1);
+    } else if (len == -E_ERR_IRQ && info->framed) {
+        //The client can hear about this, so tell it and keep going. Whatever
+        //we read along with the error can't be trusted, so it's dropped.
+        //So is whatever is still in the RX FIFO: rx_state was set up from a
+        //bad RLR, so we can't tell where the next packet starts. Resetting
+        //the RX side means our next read starts on a real packet
+        STATS_ADD(info->stats, rx_errs, 1);
+        reset_RX(info->rx_fifo);
+        info->rx_state = (rw_state_t) RW_STATE_INITIALIZER;
+        info->rx_mid_pkt = 0;
+        info->filter_sent = 0;
+        if (info->capture != NULL) capture_burst(info, FRAME_ERR | FRAME_GAP, NULL, 0);
+        if (!info->capture_only && write_frame(q, FRAME_FLITS, FRAME_ERR | FRAME_GAP, NULL, 0) < 0) {
+            fifo_mgr_finish(info);
+            return -1;
+        }
+        return 0;
+    } else {
+        if (len == -E_ERR_IRQ) STATS_ADD(info->stats, rx_errs, 1);
+        fprintf(stderr, "Could not read from RX FIFO: %s\n", asfifo_strerror(len));
+        trace_dump(stderr);
+        fifo_mgr_finish(info);
+        return -1;
+    }
+    
+    return len;
+}
+
+//The interrupts we sleep on: a whole packet arrived, or the RX FIFO is 
+//getting full
+#define RX_IRQ_MASK (RC_MASK | RFPF_MASK)
+
+//Sleeps until the RX FIFO has something for us (or FIFO_IRQ_TIMEOUT_MS goes
+//by). We only turn the RX interrupts on while we're asleep; the rest of the
+//time we're draining the FIFO anyway and don't need to hear about it
+static void fifo_mgr_wait_irq(fifo_mgr_info *info) {
+    volatile AXIStream_FIFO *base = info->rx_fifo;
+    
+    WR_REG(base, ISR, RX_IRQ_MASK); //Forget about anything old
+    WR_REG(base, IER, RX_IRQ_MASK);
+    irq_arm(info->rx_irq);
+    
+    //Something could have shown up just before we turned the interrupts on,
+    //in which case we'd sleep through it
+    if (rx_fifo_word_occupancy(base) == 0) {
+        if (irq_wait(info->rx_irq, FIFO_IRQ_TIMEOUT_MS) < 0) {
+            //Something is wrong with the interrupt. Go back to spinning
+            perror("Could not wait for RX interrupt; falling back to polling");
+            info->rx_irq = NULL;
+        }
+    }
+    
+    WR_REG(base, IER, 0);
+    WR_REG(base, ISR, RX_IRQ_MASK);
+}
+
+//Remember to increment number of producers before spinning up thread
+void* fifo_mgr(void *arg) {
+#ifdef DEBUG_ON
+    fprintf(stderr, "Entered FIFO manager\n");
+    fflush(stderr);
+#endif
+    fifo_mgr_info *info = (fifo_mgr_info*) arg;
+    
+    poll_policy pp;
+    poll_policy_init(&pp, info->poll_cfg);
+    
+    int len;
+    while ((len = fifo_mgr_poll(info)) >= 0) {
+        if (len > 0) poll_policy_busy(&pp);
+        else if (info->rx_irq != NULL) {
+            poll_policy_block(&pp);
+            fifo_mgr_wait_irq(info);
+        } else {
+            poll_policy_idle(&pp);
+        }
+    }
+    
+    print_poll_stats(&pp);
+    
+    pthread_exit(NULL);
+}
+
+//Same as fifo_mgr, but round-robins over several FIFOs. We only count as idle
+//when none of them had anything for us
+void* fifo_poller(void *arg) {
+#ifdef DEBUG_ON
+    fprintf(stderr, "Entered shared FIFO poller\n");
+    fflush(stderr);
+#endif
+    fifo_poller_info *info = (fifo_poller_info*) arg;
+    
+    poll_policy pp;
+    poll_policy_init(&pp, info->poll_cfg);
+    
+    int num_alive;
+    do {
+        int total = 0;
+        num_alive = 0;
+        
+        int i;
+        for (i = 0; i < info->num_fifos; i++) {
+            int len = fifo_mgr_poll(info->fifos[i]);
+            if (len >= 0) {
+                num_alive++;
+                total += len;
+            }
+        }
+        
+        if (total > 0) poll_policy_busy(&pp);
+        else poll_policy_idle(&pp);
+    } while (num_alive > 0);
+    
+    print_poll_stats(&pp);
+    
+    pthread_exit(NULL);
+}
@@ -0,0 +1,131 @@
+#ifndef FIFO_MGR_H
+#define FIFO_MGR_H 1
+
+#include <pthread.h>
+#include "axistreamfifo.h"
+#include "queue.h"
+#include "flit_ring.h"
+#include "irq.h"
+#include "poll_policy.h"
+#include "stats.h"
+#include "lat.h"
+#include "capture.h"
+#include "replay.h"
+#include "filter.h"
+
+//Max number of words fifo_mgr reads out of the RX FIFO at a time. This is 
+//half the egress queue, so that we're not stuck waiting for net_tx to empty
+//the entire queue before we can write
+#define RX_BURST_WORDS (BUF_SIZE/sizeof(unsigned)/2)
+
+//When waiting on an RX interrupt, wake up this often anyway to check if we've
+//been told to stop (and in case a cut-through packet is trickling in too
+//slowly to trigger RC or RFPF)
+#define FIFO_IRQ_TIMEOUT_MS 50
+
+typedef struct _fifo_mgr_info {
+    volatile AXIStream_FIFO *rx_fifo;
+    asfifo_mode_t rx_mode;
+    volatile AXIStream_FIFO *tx_fifo;
+    int tx_burst; //If nonzero, send queued commands in multi-word packets
+    int framed; //If nonzero, flits go into the ingress queue as frames (see frame.h)
+    unsigned tx_depth; //Words the TX FIFO holds. fifo_tx sets this when it starts
+    int stop;
+    
+    pthread_mutex_t mutex;
+    
+    //Only touched by whichever thread is polling the RX FIFO
+    rw_state_t rx_state;
+    unsigned rx_buf[RX_BURST_WORDS];
+    int done;
+    int rx_mid_pkt; //In framed mode: the last read ended partway through a packet
+    flit_filter filter; //In framed mode: the client's filter rules
+    int filter_drop; //Dropping the rest of the current packet
+    int filter_sent; //Sent part of the current packet with FRAME_PARTIAL
+    
+    //In framed mode, fifo_tx puts new filter rules from the client here and
+    //sets filter_pending; whoever polls the RX FIFO swaps them in before its
+    //next read. filter_next is protected by mutex
+    flit_filter filter_next;
+    _Atomic int filter_pending;
+    
+    queue *ingress;
+    queue *egress;
+    
+    //In fan-out mode, flits go into this ring instead of the ingress queue
+    //(and nobody ever reads the ingress queue). NULL otherwise
+    flit_ring *ring;
+    
+    //If not NULL, fifo_mgr sleeps on this instead of spinning when the RX
+    //FIFO is empty
+    irq_src *rx_irq;
+    
+    //Same as rx_irq to start with, but fifo_mgr never sets it to NULL, so
+    //fifo_tx can always use it to wake fifo_mgr up when it queues a reply
+    irq_src *rx_wake;
+    
+    //What fifo_mgr and fifo_tx do while they have nothing to do
+    poll_policy_cfg const *poll_cfg;
+    
+    //In framed mode, fifo_tx puts frames for the client here (acks, and
+    //answers to FRAME_SET_OPTS), and whoever polls the RX FIFO sends them.
+    //NULL otherwise
+    queue *replies;
+    
+    //In framed mode, the FRAME_OPT_* bits the client turned on. Shared with
+    //net_tx
+    _Atomic unsigned *opts;
+    
+    //If not NULL, everything we read also goes here (-C)
+    capture_file *capture;
+    
+    //With -C (outside fan-out mode), we read from the start, and whatever we
+    //read before net_mgr sets *attached only goes to the capture. Otherwise
+    //we'd stall as soon as the ingress queue filled up with nobody to empty
+    //it. Whoever polls the RX FIFO clears capture_only at the first packet
+    //boundary after that, so a framed client never starts mid-packet
+    _Atomic int *attached;
+    int capture_only;
+    
+    //If not NULL, fifo_tx sends this to the TX FIFO before any commands from
+    //the client (-X); with its recorded timing if replay_timed is set
+    replay_script *replay;
+    int replay_timed;
+    
+    //If not NULL, fifo_tx saves every packet it sends here (-k)
+    replay_recorder *record;
+    
+    pipe_stats *stats;
+    pipe_lat *lat; //Latency histograms (-H), or NULL
+} fifo_mgr_info;
+
+//Reads commands from the egress queue and sends them to the TX FIFO. Quits 
+//once there are no more producers on the egress queue. In framed mode, the
+//commands come in frames, and command packets are acked through replies. 
+//With info->replay set, that gets sent first
+void *fifo_tx(void *arg);
+
+//Polls the RX FIFO once, and places whatever it got into the ingress queue 
+//(or the ring, in fan-out mode). Returns the number of words read (which can be 0), or -1 if this FIFO is 
+//finished: either we were told to stop, nobody is reading the ingress queue
+//anymore, or there was an error. Once it returns -1 it will keep doing so.
+int fifo_mgr_poll(fifo_mgr_info *info);
+
+//Calls fifo_mgr_poll in a loop until the FIFO is finished. Whenever the RX 
+//FIFO is empty, it either follows info->poll_cfg or (if info->rx_irq is set)
+//sleeps until the RX FIFO interrupts. Remember to increment number of producers on the 
+//ingress queue before spinning up thread
+void* fifo_mgr(void *arg);
+
+//Lets one thread poll several RX FIFOs. Quits once all of them are finished.
+//Keep in mind that if one channel's egress queue fills up, the poller waits
+//for it, so a slow client on one channel slows down all the others
+typedef struct _fifo_poller_info {
+    fifo_mgr_info **fifos;
+    int num_fifos;
+    poll_policy_cfg const *poll_cfg;
+} fifo_poller_info;
+
+void* fifo_poller(void *arg);
+
+#endif
@@ -0,0 +1,358 @@
+#define _GNU_SOURCE             /* See feature_test_macros(7) */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include "axistreamfifo.h"
+#include "irq.h"
+#include "fifo_model.h"
+
+#define REG(reg) offsetof(AXIStream_FIFO, reg)
+
+//How often a rate-limited generator wakes up
+#define GEN_PERIOD_NS 100000
+
+static fifo_model *model_of(volatile AXIStream_FIFO *base) {
+    return (fifo_model *) base;
+}
+
+//Burns access_ns nanoseconds, like a trip across the AXI bus would
+static void access_delay(fifo_model *m) {
+    if (m->cfg.access_ns <= 0) return;
+
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    do {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+    } while ((now.tv_sec - start.tv_sec) * 1000000000LL + (now.tv_nsec - start.tv_nsec) < m->cfg.access_ns);
+}
+
+//Fires the interrupt if an enabled one just went off. old is what ISR & IER
+//was before we changed anything. Call with the mutex held
+static void update_irq(fifo_model *m, unsigned old) {
+    if (m->irq != NULL && old == 0 && (m->ISR & m->IER) != 0) irq_raise(m->irq);
+}
+
+//Index into the RX rings
+#define RX_IDX(m, n) ((n) & ((m)->cfg.depth - 1))
+
+//Is the packet at pkt_rd the one the generator is still writing?
+static int cur_incomplete(fifo_model *m) {
+    return m->rx_open && m->pkt_rd == m->pkt_wr - 1;
+}
+
+static void reset_rx(fifo_model *m) {
+    m->rx_rd = m->rx_wr;
+    m->pkt_rd = m->pkt_wr;
+    m->rx_open = 0;
+    m->cur_active = 0;
+    m->cur_read = 0;
+    m->ISR |= RRC_MASK;
+}
+
+static void reset_tx(fifo_model *m) {
+    m->tx_pending = 0;
+    m->ISR |= TRC_MASK;
+}
+
+//Writes up to n generated words into the RX FIFO. Returns how many fit. Call
+//with the mutex held
+static int gen_push(fifo_model *m, int n) {
+    int depth = m->cfg.depth;
+    unsigned stamp = 0;
+    if (m->cfg.stamp) {
+        //One clock read per batch is plenty; they all arrive together
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        stamp = (unsigned) (now.tv_sec * 1000000000ULL + now.tv_nsec);
+    }
+
+    int i;
+    for (i = 0; i < n; i++) {
+        if (m->rx_wr - m->rx_rd >= depth) break;
+
+        if (!m->rx_open) {
+            m->rx_pkts[RX_IDX(m, m->pkt_wr)] = 0;
+            m->pkt_wr++;
+            m->rx_open = 1;
+        }
+        m->rx_words[RX_IDX(m, m->rx_wr)] = m->cfg.stamp ? stamp : m->gen_val;
+        m->gen_val++;
+        m->rx_wr++;
+
+        int *len = &m->rx_pkts[RX_IDX(m, m->pkt_wr - 1)];
+        (*len)++;
+        if (*len == m->cfg.pkt_words) {
+            m->rx_open = 0;
+            m->ISR |= RC_MASK;
+        }
+    }
+
+    if (m->rx_wr - m->rx_rd > depth - depth/4) m->ISR |= RFPF_MASK;
+    m->gen_words += i;
+    return i;
+}
+
+static void *fifo_model_gen(void *arg) {
+    fifo_model *m = (fifo_model *) arg;
+
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    unsigned long long produced = 0;
+
+    while (1) {
+        pthread_mutex_lock(&m->mutex);
+        int stop = m->stop;
+        pthread_mutex_unlock(&m->mutex);
+        if (stop) break;
+
+        if (m->cfg.rate == 0) {
+            //As fast as possible, but never drop anything
+            pthread_mutex_lock(&m->mutex);
+            unsigned old = m->ISR & m->IER;
+            int n = gen_push(m, m->cfg.pkt_words);
+            update_irq(m, old);
+            pthread_mutex_unlock(&m->mutex);
+            if (n == 0) sched_yield();
+            continue;
+        }
+
+        //Work out how many words we should have made by now
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        unsigned long long elapsed = (now.tv_sec - start.tv_sec) * 1000000000ULL + (now.tv_nsec - start.tv_nsec);
+        unsigned long long due = (unsigned long long) ((double) m->cfg.rate * elapsed / 1e9);
+        if (due > produced) {
+            int want = (due - produced > m->cfg.depth) ? m->cfg.depth : due - produced;
+            //If we're way behind (e.g. we got descheduled), don't try to
+            //catch up all at once. The older words we skip would have
+            //overflowed the FIFO anyway, so they're dropped before the rest
+            unsigned long long skipped = due - produced - want;
+
+            pthread_mutex_lock(&m->mutex);
+            unsigned old = m->ISR & m->IER;
+            m->gen_val += skipped;
+            m->dropped_words += skipped;
+            int n = gen_push(m, want);
+            //Whatever didn't fit is lost, just like on the board. Skip those
+            //values so the client can see the gap
+            m->gen_val += want - n;
+            m->dropped_words += want - n;
+            update_irq(m, old);
+            pthread_mutex_unlock(&m->mutex);
+
+            produced = due;
+        }
+
+        struct timespec ts = {
+            .tv_sec = 0,
+            .tv_nsec = GEN_PERIOD_NS
+        };
+        nanosleep(&ts, NULL);
+    }
+
+    pthread_exit(NULL);
+}
+
+unsigned fifo_model_read(volatile AXIStream_FIFO *base, unsigned off) {
+    fifo_model *m = model_of(base);
+    access_delay(m);
+
+    pthread_mutex_lock(&m->mutex);
+    unsigned old = m->ISR & m->IER;
+    unsigned val = 0;
+
+    switch (off) {
+    case REG(ISR):
+        val = m->ISR;
+        break;
+    case REG(IER):
+        val = m->IER;
+        break;
+    case REG(TDFV):
+        val = m->cfg.depth - m->tx_pending;
+        break;
+    case REG(RDFO):
+        val = m->rx_wr - m->rx_rd;
+        if (m->mode == STORE_AND_FORWARD && m->rx_open) {
+            //Don't count the packet that's still coming in
+            int open_len = m->rx_pkts[RX_IDX(m, m->pkt_wr - 1)];
+            int open_read = (m->cur_active && cur_incomplete(m)) ? m->cur_read : 0;
+            val -= open_len - open_read;
+        }
+        break;
+    case REG(RLR):
+        if (!m->cur_active) {
+            if (m->pkt_rd == m->pkt_wr || (m->mode == STORE_AND_FORWARD && cur_incomplete(m))) {
+                //Nothing to read. Cut-through just says "partial packet with
+                //nothing in it yet"; store-and-forward calls it an error
+                if (m->mode == STORE_AND_FORWARD) m->ISR |= RPURE_MASK;
+                else val = 0x80000000;
+                break;
+            }
+            m->cur_active = 1;
+            m->cur_read = 0;
+        }
+        val = m->rx_pkts[RX_IDX(m, m->pkt_rd)] * 4;
+        if (cur_incomplete(m)) val |= 0x80000000;
+        break;
+    case REG(RDFD):
+        if (!m->cur_active || m->cur_read >= m->rx_pkts[RX_IDX(m, m->pkt_rd)]) {
+            m->ISR |= RPUE_MASK;
+            break;
+        }
+        val = m->rx_words[RX_IDX(m, m->rx_rd)];
+        m->rx_rd++;
+        m->cur_read++;
+        m->read_words++;
+        if (!cur_incomplete(m) && m->cur_read == m->rx_pkts[RX_IDX(m, m->pkt_rd)]) {
+            m->pkt_rd++;
+            m->cur_active = 0;
+            m->cur_read = 0;
+        }
+        break;
+    default:
+        break;
+    }
+
+    update_irq(m, old);
+    pthread_mutex_unlock(&m->mutex);
+    return val;
+}
+
+void fifo_model_write(volatile AXIStream_FIFO *base, unsigned off, unsigned val) {
+    fifo_model *m = model_of(base);
+    access_delay(m);
+
+    pthread_mutex_lock(&m->mutex);
+    unsigned old = m->ISR & m->IER;
+
+    switch (off) {
+    case REG(ISR):
+        m->ISR &= ~val;
+        break;
+    case REG(IER):
+        m->IER = val;
+        break;
+    case REG(TDFR):
+        if (val == 0xA5) reset_tx(m);
+        break;
+    case REG(RDFR):
+        if (val == 0xA5) reset_rx(m);
+        break;
+    case REG(SRR):
+        if (val == 0xA5) {
+            reset_tx(m);
+            reset_rx(m);
+        }
+        break;
+    case REG(TDFD):
+        if (m->tx_pending >= m->cfg.depth) {
+            m->ISR |= TPOE_MASK;
+        } else {
+            m->tx_pending++;
+            m->tx_words++;
+        }
+        break;
+    case REG(TLR):
+        if (val == 0 || m->tx_pending == 0) {
+            m->ISR |= TSE_MASK;
+        } else {
+            //Off it goes. We don't care what the commands were
+            m->tx_pending = 0;
+            m->tx_pkts++;
+            m->ISR |= TC_MASK;
+        }
+        break;
+    default:
+        break;
+    }
+
+    update_irq(m, old);
+    pthread_mutex_unlock(&m->mutex);
+}
+
+volatile AXIStream_FIFO *fifo_model_create(fifo_model_cfg const *cfg, asfifo_mode_t mode, int gen) {
+    fifo_model *m = calloc(1, sizeof(fifo_model));
+    if (m == NULL) return NULL;
+
+    m->cfg = *cfg;
+    m->mode = mode;
+    pthread_mutex_init(&m->mutex, NULL);
+    m->rx_words = malloc(cfg->depth * sizeof(unsigned));
+    m->rx_pkts = malloc(cfg->depth * sizeof(int));
+    if (m->rx_words == NULL || m->rx_pkts == NULL) goto err;
+
+    if (gen) {
+        int rc = pthread_create(&m->gen_thread, NULL, fifo_model_gen, m);
+        if (rc != 0) {
+            fprintf(stderr, "Could not start FIFO model generator: %s\n", strerror(rc));
+            goto err;
+        }
+        pthread_setname_np(m->gen_thread, "fifo_model");
+        m->gen_started = 1;
+    }
+
+    return &m->regs;
+
+    err:
+    free(m->rx_words);
+    free(m->rx_pkts);
+    free(m);
+    return NULL;
+}
+
+void fifo_model_destroy(volatile AXIStream_FIFO *base) {
+    fifo_model *m = model_of(base);
+
+    pthread_mutex_lock(&m->mutex);
+    m->stop = 1;
+    pthread_mutex_unlock(&m->mutex);
+    if (m->gen_started) pthread_join(m->gen_thread, NULL);
+
+    fprintf(stderr, "FIFO model: generated %llu words, dropped %llu, read %llu; TX got %llu words in %llu packets\n",
+        m->gen_words, m->dropped_words, m->read_words, m->tx_words, m->tx_pkts);
+
+    pthread_mutex_destroy(&m->mutex);
+    free(m->rx_words);
+    free(m->rx_pkts);
+    free(m);
+}
+
+void fifo_model_attach_irq(volatile AXIStream_FIFO *base, irq_src *irq) {
+    fifo_model *m = model_of(base);
+    pthread_mutex_lock(&m->mutex);
+    m->irq = irq;
+    pthread_mutex_unlock(&m->mutex);
+}
+
+//Parses depth=N,pkt=N,rate=N,cost=NS,stamp=0|1
+int fifo_model_parse(fifo_model_cfg *cfg, char const *str) {
+    char buf[128];
+    if (strlen(str) >= sizeof(buf)) return -1;
+    strcpy(buf, str);
+
+    fifo_model_cfg tmp = *cfg;
+    char *tok;
+    for (tok = strtok(buf, ","); tok != NULL; tok = strtok(NULL, ",")) {
+        unsigned long long val;
+        char key[16];
+        if (sscanf(tok, "%15[^=]=%llu", key, &val) != 2) return -1;
+
+        if (!strcmp(key, "depth")) tmp.depth = val;
+        else if (!strcmp(key, "pkt")) tmp.pkt_words = val;
+        else if (!strcmp(key, "rate")) tmp.rate = val;
+        else if (!strcmp(key, "cost")) tmp.access_ns = val;
+        else if (!strcmp(key, "stamp")) tmp.stamp = (val != 0);
+        else return -1;
+    }
+
+    //depth has to be a power of two so the rings wrap cleanly
+    if (tmp.depth < 16 || tmp.depth > (1<<20) || (tmp.depth & (tmp.depth - 1))) return -1;
+    //A packet bigger than the FIFO could never finish arriving
+    if (tmp.pkt_words <= 0 || tmp.pkt_words > tmp.depth) return -1;
+
+    *cfg = tmp;
+    return 0;
+}
@@ -0,0 +1,106 @@
+#ifndef FIFO_MODEL_H
+#define FIFO_MODEL_H 1
+
+#include <pthread.h>
+#include "axistreamfifo.h"
+#include "irq.h"
+
+//A software model of the AXI-Stream FIFO, so the server can run (and be
+//profiled) on any Linux box. fifo_model_create gives you something that
+//looks like a mapped FIFO; set asfifo_use_model and RD_REG/WR_REG will send
+//every register access here.
+//
+//What's modelled:
+// - RX side: a generator thread writes packets of incrementing 32-bit
+//   counter values into the RX FIFO at a configurable rate. With stamp set,
+//   each flit is instead the low 32 bits of CLOCK_MONOTONIC (in ns) when it
+//   went into the FIFO, so a client on the same machine can work out how
+//   long it took to get there. In
+//   store-and-forward mode RLR/RDFO only see complete packets; in
+//   cut-through mode RLR reports a partial packet (bit 31 set) with however
+//   many bytes of it have arrived so far, same as the real thing
+// - TX side: TDFD writes fill the TX FIFO, and a TLR write sends them all
+//   off as one packet (which we just count). TDFV is the room left
+// - ISR is write-one-to-clear, and RC/TC/RFPF and the error bits (RPURE,
+//   RPUE, TPOE, TSE) are set when the real core would set them. If an IRQ
+//   source is attached, it fires whenever ISR & IER goes from 0 to nonzero
+// - Resets via TDFR/RDFR/SRR
+//
+//If the RX FIFO is full when the generator wants to write, those flits are
+//counted as dropped (the same thing that happens on the board when we can't
+//keep up), unless rate is 0, in which case the generator just waits.
+
+typedef struct _fifo_model_cfg {
+    int depth; //Size of each FIFO, in words
+    int pkt_words; //Size of generated packets, in words
+    unsigned long long rate; //Generated words per second, or 0 for as fast as possible
+    int access_ns; //Extra time each register access takes, to mimic the bus
+    int stamp; //If nonzero, flits are timestamps instead of counter values
+} fifo_model_cfg;
+
+#define FIFO_MODEL_CFG_DEFAULT { \
+    .depth = 4096, \
+    .pkt_words = 64, \
+    .rate = 0, \
+    .access_ns = 0, \
+    .stamp = 0 \
+}
+
+typedef struct _fifo_model {
+    //Must be first: &regs is the "base address" everyone else sees. The
+    //registers themselves are never touched
+    AXIStream_FIFO regs;
+
+    fifo_model_cfg cfg;
+    asfifo_mode_t mode;
+
+    pthread_mutex_t mutex; //Protects everything below
+    unsigned ISR;
+    unsigned IER;
+    irq_src *irq;
+
+    //RX FIFO: a ring of words, and a ring of packet lengths. The last packet
+    //might still be getting written by the generator (rx_open)
+    unsigned *rx_words;
+    unsigned rx_rd, rx_wr; //Free-running word counts
+    int *rx_pkts;
+    unsigned pkt_rd, pkt_wr; //Free-running packet counts
+    int rx_open;
+
+    //The packet being read out (the one at pkt_rd), once RLR has been read
+    int cur_active;
+    int cur_read;
+
+    //TX FIFO
+    int tx_pending;
+
+    //Generator
+    int stop;
+    unsigned gen_val;
+    pthread_t gen_thread;
+    int gen_started;
+
+    //Stats
+    unsigned long long gen_words;
+    unsigned long long dropped_words;
+    unsigned long long read_words;
+    unsigned long long tx_words;
+    unsigned long long tx_pkts;
+} fifo_model;
+
+//Makes a model FIFO. If gen is nonzero, starts its generator thread. Returns
+//the model's "base address", or NULL on error
+volatile AXIStream_FIFO *fifo_model_create(fifo_model_cfg const *cfg, asfifo_mode_t mode, int gen);
+
+//Stops the generator, prints stats, and frees the model
+void fifo_model_destroy(volatile AXIStream_FIFO *base);
+
+//Fires irq (which should be an eventfd source) whenever an enabled
+//interrupt goes off
+void fifo_model_attach_irq(volatile AXIStream_FIFO *base, irq_src *irq);
+
+//Parses a comma-separated list of depth=N, pkt=N, rate=N, cost=NS and
+//stamp=0|1 into cfg. Returns 0 on success, -1 on error
+int fifo_model_parse(fifo_model_cfg *cfg, char const *str);
+
+#endif
@@ -0,0 +1,120 @@
+#include "filter.h"
+
+#if !defined(FILTER_NO_SIMD) && defined(__SSE2__)
+#include <emmintrin.h>
+#define FILTER_VEC 1
+#elif !defined(FILTER_NO_SIMD) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define FILTER_VEC 1
+#endif
+
+int filter_set_rules(flit_filter *f, frame_filter_rule const *rules, int n) {
+    if (n < 0 || n > FRAME_MAX_FILTER_RULES) return -1;
+
+    flit_filter tmp = FLIT_FILTER_INITIALIZER;
+    int i;
+    for (i = 0; i < n; i++) {
+        filter_set *s;
+        if (rules[i].where == FRAME_FILTER_HEAD && rules[i].action == FRAME_FILTER_INCLUDE) s = &tmp.head_inc;
+        else if (rules[i].where == FRAME_FILTER_HEAD && rules[i].action == FRAME_FILTER_EXCLUDE) s = &tmp.head_exc;
+        else if (rules[i].where == FRAME_FILTER_WORD && rules[i].action == FRAME_FILTER_INCLUDE) s = &tmp.word_inc;
+        else if (rules[i].where == FRAME_FILTER_WORD && rules[i].action == FRAME_FILTER_EXCLUDE) s = &tmp.word_exc;
+        else return -1;
+
+        s->mask[s->n] = rules[i].mask;
+        s->value[s->n] = rules[i].value;
+        s->n++;
+    }
+    tmp.num_rules = n;
+
+    *f = tmp;
+    return 0;
+}
+
+static int match_any(filter_set const *s, unsigned w) {
+    int i;
+    for (i = 0; i < s->n; i++) {
+        if ((w & s->mask[i]) == s->value[i]) return 1;
+    }
+    return 0;
+}
+
+static int keep(filter_set const *inc, filter_set const *exc, unsigned w) {
+    if (match_any(exc, w)) return 0;
+    return inc->n == 0 || match_any(inc, w);
+}
+
+int filter_packet(flit_filter const *f, unsigned head) {
+    return keep(&f->head_inc, &f->head_exc, head);
+}
+
+#if defined(FILTER_VEC) && defined(__SSE2__)
+//All ones in each lane whose word matches one of the rules
+static __m128i match_any4(filter_set const *s, __m128i w) {
+    __m128i m = _mm_setzero_si128();
+    int i;
+    for (i = 0; i < s->n; i++) {
+        __m128i masked = _mm_and_si128(w, _mm_set1_epi32(s->mask[i]));
+        m = _mm_or_si128(m, _mm_cmpeq_epi32(masked, _mm_set1_epi32(s->value[i])));
+    }
+    return m;
+}
+
+//Bit j is set if words[j] should be kept
+static unsigned keep4(flit_filter const *f, unsigned const *words) {
+    __m128i w = _mm_loadu_si128((__m128i const *) words);
+    __m128i drop = match_any4(&f->word_exc, w);
+    __m128i inc = f->word_inc.n ? match_any4(&f->word_inc, w) : _mm_set1_epi32(-1);
+    return _mm_movemask_ps(_mm_castsi128_ps(_mm_andnot_si128(drop, inc)));
+}
+#elif defined(FILTER_VEC)
+static uint32x4_t match_any4(filter_set const *s, uint32x4_t w) {
+    uint32x4_t m = vdupq_n_u32(0);
+    int i;
+    for (i = 0; i < s->n; i++) {
+        uint32x4_t masked = vandq_u32(w, vdupq_n_u32(s->mask[i]));
+        m = vorrq_u32(m, vceqq_u32(masked, vdupq_n_u32(s->value[i])));
+    }
+    return m;
+}
+
+static unsigned keep4(flit_filter const *f, unsigned const *words) {
+    static uint32_t const bits[4] = {1, 2, 4, 8};
+    uint32x4_t w = vld1q_u32(words);
+    uint32x4_t drop = match_any4(&f->word_exc, w);
+    uint32x4_t inc = f->word_inc.n ? match_any4(&f->word_inc, w) : vdupq_n_u32(~0u);
+    uint32x4_t k = vandq_u32(vbicq_u32(inc, drop), vld1q_u32(bits));
+    //Add up the lanes. vaddvq_u32 would do it, but 32-bit ARM doesn't have it
+    uint32x2_t sum = vpadd_u32(vget_low_u32(k), vget_high_u32(k));
+    return vget_lane_u32(vpadd_u32(sum, sum), 0);
+}
+#endif
+
+int filter_words(flit_filter const *f, unsigned *words, int n) {
+    if (f->word_inc.n == 0 && f->word_exc.n == 0) return n;
+
+    int o = 0; //Where the next word we keep goes
+    int i = 0;
+#ifdef FILTER_VEC
+    for (; i + 4 <= n; i += 4) {
+        unsigned k = keep4(f, words + i);
+        //Nothing dropped so far, so nothing to move
+        if (k == 0xF && o == i) {
+            o += 4;
+            continue;
+        }
+        //Copy all four, but only move past the ones we keep. o never gets
+        //ahead of i + j, so this never overwrites a word we haven't copied
+        int j;
+        for (j = 0; j < 4; j++) {
+            words[o] = words[i + j];
+            o += (k >> j) & 1;
+        }
+    }
+#endif
+    for (; i < n; i++) {
+        words[o] = words[i];
+        o += keep(&f->word_inc, &f->word_exc, words[i]);
+    }
+    return o;
+}
@@ -0,0 +1,41 @@
+#ifndef FILTER_H
+#define FILTER_H 1
+
+#include <stdint.h>
+#include "frame.h"
+
+//Server-side flit filtering, for framed clients (see FRAME_SET_FILTER in
+//frame.h for what the rules mean). The rules are split up by where and
+//action when they're installed, so the RX path just walks a few short
+//arrays. Word rules are checked four words at a time with SSE2 or NEON when
+//we're built for them (define FILTER_NO_SIMD to use the plain C version
+//everywhere, e.g. to compare the two).
+
+typedef struct _filter_set {
+    int n;
+    uint32_t mask[FRAME_MAX_FILTER_RULES];
+    uint32_t value[FRAME_MAX_FILTER_RULES];
+} filter_set;
+
+typedef struct _flit_filter {
+    int num_rules; //0 means everything gets through
+    filter_set head_inc;
+    filter_set head_exc;
+    filter_set word_inc;
+    filter_set word_exc;
+} flit_filter;
+
+#define FLIT_FILTER_INITIALIZER {0}
+
+//Replaces f with the n rules. Returns 0 on success, or -1 if there are too
+//many or one has a bad where or action (in which case f is left alone)
+int filter_set_rules(flit_filter *f, frame_filter_rule const *rules, int n);
+
+//Returns nonzero if the packet starting with head should be kept
+int filter_packet(flit_filter const *f, unsigned head);
+
+//Takes the words that don't pass the word rules out of words, moving the
+//rest down to fill the holes. Returns how many are left
+int filter_words(flit_filter const *f, unsigned *words, int n);
+
+#endif
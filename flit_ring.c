@@ -0,0 +1,171 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "flit_ring.h"
+
+//Same trick as in queue.c: the writer stores head and then checks
+//num_waiting, and a waiting reader bumps num_waiting and then re-checks head.
+//Both use seq_cst, so either the reader sees the new data or the writer sees
+//that it has to wake someone up.
+
+//Allocates a ring where readers can fall at least the given number of flits
+//behind. Returns 0 on success, -1 on error
+int flit_ring_init(flit_ring *r, unsigned long long flits) {
+    unsigned long long size = flits + flits/4;
+    if (size < FLIT_RING_MIN_SIZE) size = FLIT_RING_MIN_SIZE;
+
+    r->buf = malloc(size * sizeof(unsigned));
+    if (r->buf == NULL) return -1;
+
+    r->size = size;
+    r->max_lag = size - size/5; //So the guard is a quarter of max_lag
+    atomic_init(&r->head, 0);
+    pthread_mutex_init(&r->mutex, NULL);
+    pthread_cond_init(&r->can_read, NULL);
+    atomic_init(&r->num_waiting, 0);
+    atomic_init(&r->closed, 0);
+    return 0;
+}
+
+//Frees the ring's storage. Make sure nobody is using it anymore
+void flit_ring_destroy(flit_ring *r) {
+    free(r->buf);
+    r->buf = NULL;
+    pthread_mutex_destroy(&r->mutex);
+    pthread_cond_destroy(&r->can_read);
+}
+
+//Appends n flits to the ring. Never blocks
+void flit_ring_write(flit_ring *r, unsigned const *vals, int n) {
+    unsigned long long head = atomic_load_explicit(&r->head, memory_order_relaxed);
+
+    //Never write more than the guard zone in one go, or we could clobber data
+    //that a reader was told was safe
+    unsigned long long guard = r->size - r->max_lag;
+    while (n > 0) {
+        int chunk = (n > guard) ? guard : n;
+
+        unsigned long long first = r->size - FLIT_RING_IDX(r, head);
+        if (first > chunk) first = chunk;
+        memcpy(r->buf + FLIT_RING_IDX(r, head), vals, first * sizeof(unsigned));
+        memcpy(r->buf, vals + first, (chunk - first) * sizeof(unsigned));
+
+        head += chunk;
+        vals += chunk;
+        n -= chunk;
+        atomic_store(&r->head, head);
+        //The store above only keeps the copies before it from moving after
+        //it. This keeps the next chunk's copy from moving ahead of it, so a
+        //reader can't see that chunk land without also seeing the new head
+        atomic_thread_fence(memory_order_release);
+    }
+
+    if (atomic_load(&r->num_waiting) > 0) {
+        pthread_mutex_lock(&r->mutex);
+        pthread_cond_broadcast(&r->can_read);
+        pthread_mutex_unlock(&r->mutex);
+    }
+}
+
+//Wakes up every reader and makes all future reads return FLIT_RING_CLOSED
+void flit_ring_close(flit_ring *r) {
+    pthread_mutex_lock(&r->mutex);
+    atomic_store(&r->closed, 1);
+    pthread_cond_broadcast(&r->can_read);
+    pthread_mutex_unlock(&r->mutex);
+}
+
+//Wakes up every reader sleeping in flit_ring_peek_timed
+void flit_ring_wake(flit_ring *r) {
+    pthread_mutex_lock(&r->mutex);
+    pthread_cond_broadcast(&r->can_read);
+    pthread_mutex_unlock(&r->mutex);
+}
+
+//Position of the next flit that will be written
+unsigned long long flit_ring_head(flit_ring *r) {
+    return atomic_load(&r->head);
+}
+
+//Position of the oldest flit a reader is still allowed to start from
+unsigned long long flit_ring_tail(flit_ring *r) {
+    unsigned long long head = atomic_load(&r->head);
+    return (head > r->max_lag) ? head - r->max_lag : 0;
+}
+
+//Returns 0 if the data at position pos is still in the ring, or
+//FLIT_RING_LAPPED if it might have been overwritten
+int flit_ring_check(flit_ring *r, unsigned long long pos) {
+    //Pairs with the fence in flit_ring_write: the caller's copy out of the
+    //ring has to be done before we look at head
+    atomic_thread_fence(memory_order_acquire);
+    unsigned long long head = atomic_load(&r->head);
+    if (head > pos && head - pos > r->max_lag) return FLIT_RING_LAPPED;
+    return 0;
+}
+
+//Does the actual work for flit_ring_peek and flit_ring_peek_timed. A timeout
+//of -1 means wait forever
+static int peek(flit_ring *r, unsigned long long pos, int max, struct iovec iov[2], int timeout_ms) {
+    unsigned long long head = atomic_load(&r->head);
+
+    if (atomic_load(&r->closed)) return FLIT_RING_CLOSED;
+
+    if (head <= pos) {
+        //Nothing for us yet; go to sleep
+        struct timespec deadline;
+        if (timeout_ms >= 0) {
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += timeout_ms / 1000;
+            deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+            if (deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+        }
+
+        pthread_mutex_lock(&r->mutex);
+        atomic_fetch_add(&r->num_waiting, 1);
+        while ((head = atomic_load(&r->head)) <= pos && !atomic_load(&r->closed)) {
+            if (timeout_ms < 0) {
+                pthread_cond_wait(&r->can_read, &r->mutex);
+            } else {
+                //Timed readers give up after any wakeup (see flit_ring_wake)
+                pthread_cond_timedwait(&r->can_read, &r->mutex, &deadline);
+                head = atomic_load(&r->head);
+                break;
+            }
+        }
+        atomic_fetch_sub(&r->num_waiting, 1);
+        pthread_mutex_unlock(&r->mutex);
+
+        if (atomic_load(&r->closed)) return FLIT_RING_CLOSED;
+        if (head <= pos) return 0;
+    }
+
+    if (head - pos > r->max_lag) return FLIT_RING_LAPPED;
+
+    unsigned long long n = head - pos;
+    if (n > max) n = max;
+
+    unsigned long long first = r->size - FLIT_RING_IDX(r, pos);
+    if (first > n) first = n;
+    iov[0].iov_base = r->buf + FLIT_RING_IDX(r, pos);
+    iov[0].iov_len = first * sizeof(unsigned);
+    iov[1].iov_base = r->buf;
+    iov[1].iov_len = (n - first) * sizeof(unsigned);
+
+    return n;
+}
+
+//Waits until there is data at position pos, then gives you (at most max of)
+//the flits starting at pos as two spans
+int flit_ring_peek(flit_ring *r, unsigned long long pos, int max, struct iovec iov[2]) {
+    return peek(r, pos, max, iov, -1);
+}
+
+//Same as flit_ring_peek, but returns 0 if nothing showed up within timeout_ms
+int flit_ring_peek_timed(flit_ring *r, unsigned long long pos, int max, struct iovec iov[2], int timeout_ms) {
+    return peek(r, pos, max, iov, timeout_ms);
+}
@@ -0,0 +1,97 @@
+#ifndef FLIT_RING_H
+#define FLIT_RING_H 1
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/uio.h>
+
+//A ring of 32-bit flits with one writer and any number of readers. Unlike
+//queue, the writer never waits for anybody: it just keeps going and
+//overwrites the oldest data. Each reader keeps its own position, so the
+//stream is only stored once no matter how many readers there are, and a slow
+//reader can't hold up the writer or the other readers.
+//
+//Positions are counted in flits since the ring was created, and never wrap
+//(well, not for a few thousand years). The flit at position p lives at
+//buf[p % size] until position p + size is written.
+//
+//A reader that falls so far behind that it's in danger of being overwritten
+//is "lapped". We don't let readers get all the way to size flits behind; on
+//top of max_lag, the ring has a guard zone of another quarter of max_lag, so
+//that a reader copying out of the ring doesn't have its data overwritten
+//underneath it.
+
+#define FLIT_RING_CACHE_LINE 64
+
+//Smallest ring we'll bother with, in flits
+#define FLIT_RING_MIN_SIZE 4096
+
+typedef struct _flit_ring {
+    unsigned *buf;
+    unsigned long long size; //In flits
+    unsigned long long max_lag; //How far behind a reader is allowed to get
+
+    //Only written by the writer. This is the position of the next flit that
+    //will be written (i.e. the total number of flits ever written)
+    _Atomic unsigned long long head __attribute__((aligned(FLIT_RING_CACHE_LINE)));
+
+    //Slow path stuff, for readers that have to wait for data
+    pthread_mutex_t mutex __attribute__((aligned(FLIT_RING_CACHE_LINE)));
+    pthread_cond_t can_read;
+    _Atomic int num_waiting;
+    _Atomic int closed;
+} flit_ring;
+
+//Where position pos lives in buf. The ring isn't a power of two (that could
+//nearly double its size), so this is a real division, but we only do it once
+//per chunk, not per flit
+#define FLIT_RING_IDX(r, pos) ((pos) % (r)->size)
+
+#define FLIT_RING_CLOSED -1
+#define FLIT_RING_LAPPED -2
+
+//Allocates a ring where readers can fall at least the given number of flits
+//behind before they get lapped. The ring is a quarter bigger than that, to
+//make room for the guard zone (and never smaller than FLIT_RING_MIN_SIZE 
+//flits). Returns 0 on success, -1 on error
+int flit_ring_init(flit_ring *r, unsigned long long flits);
+
+//Frees the ring's storage. Make sure nobody is using it anymore
+void flit_ring_destroy(flit_ring *r);
+
+//Appends n flits to the ring. Never blocks
+void flit_ring_write(flit_ring *r, unsigned const *vals, int n);
+
+//Wakes up every reader and makes all future reads return FLIT_RING_CLOSED
+void flit_ring_close(flit_ring *r);
+
+//Wakes up every reader sleeping in flit_ring_peek_timed (which then returns
+//0), so that they can check whatever else they need to check
+void flit_ring_wake(flit_ring *r);
+
+//Position of the next flit that will be written
+unsigned long long flit_ring_head(flit_ring *r);
+
+//Position of the oldest flit a reader is still allowed to start from
+unsigned long long flit_ring_tail(flit_ring *r);
+
+//Waits until there is data at position pos, then gives you the flits starting
+//at pos (but no more than max) as at most two spans of the ring's storage (the
+//second one being the part that wrapped around; its length is 0 if nothing
+//wrapped). Returns the number of flits, FLIT_RING_LAPPED if pos is too old,
+//or FLIT_RING_CLOSED if the ring was closed.
+//
+//Since the writer never waits for you, only use the spans for a quick copy
+//(e.g. a non-blocking send), and call flit_ring_check afterwards if you need
+//to know the data was still good
+int flit_ring_peek(flit_ring *r, unsigned long long pos, int max, struct iovec iov[2]);
+
+//Same as flit_ring_peek, but gives up after timeout_ms milliseconds (or if
+//someone calls flit_ring_wake) and returns 0 if there still wasn't any data
+int flit_ring_peek_timed(flit_ring *r, unsigned long long pos, int max, struct iovec iov[2], int timeout_ms);
+
+//Returns 0 if the data at position pos is still in the ring, or
+//FLIT_RING_LAPPED if it might have been overwritten
+int flit_ring_check(flit_ring *r, unsigned long long pos);
+
+#endif
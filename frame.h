@@ -0,0 +1,119 @@
+#ifndef FRAME_H
+#define FRAME_H 1
+
+//Wire format for the framed protocol (see -w in dbg_guv_server.c). This
+//header doesn't depend on anything else, so clients can just include it.
+//
+//Normally the flits come out as one long stream of 32-bit words, and there's
+//no way to tell where one AXI-Stream packet ended and the next one started.
+//With -w, the server sends a sequence of frames instead. Each one is a
+//frame_hdr followed by len bytes of payload, and a FRAME_FLITS frame holds
+//one whole AXI-Stream packet (or, if the packet is bigger than we read out of
+//the FIFO in one go, a piece of it with FRAME_PARTIAL set; the rest of the
+//packet comes in the frames right after it). So a client can read a header,
+//then read exactly len bytes, and never has to guess where packets start.
+//
+//Commands go the other way in frames too. A FRAME_CMDS frame holds loose
+//command words, which are sent exactly like they are without -w (one packet
+//each, or bursts with -B). A FRAME_CMD_PACKET frame holds up to
+//FRAME_MAX_PACKET_WORDS words that are sent as a single AXI-Stream packet,
+//once the TX FIFO has room for all of them (so a packet bigger than the TX
+//FIFO is rejected, even if it's within FRAME_MAX_PACKET_WORDS). Every
+//FRAME_CMD_PACKET gets a FRAME_ACK back (in between the flit frames) saying
+//how it went, as soon as it's sent, even if no flits are coming in. Acks come
+//back in the order the packets were sent; frame_ack.seq counts them from 0.
+//
+//A client can turn on optional features for its connection by sending a
+//FRAME_SET_OPTS frame with the FRAME_OPT_* bits it wants. The server answers
+//with a FRAME_OPTS frame holding the bits it actually turned on (the same
+//way as acks). With FRAME_OPT_COMPRESS, flit frames may come as
+//FRAME_FLITS_Z instead of FRAME_FLITS: same flags, but the payload is a
+//uint32_t word count followed by the words coded as described in drle.h.
+//The server only does this when it makes the frame smaller, so expect both
+//kinds (and some FRAME_FLITS_Z frames before the FRAME_OPTS answer shows up).
+//
+//A client that only cares about some of the traffic can have the server drop
+//the rest before it's sent, by sending a FRAME_SET_FILTER frame holding up to
+//FRAME_MAX_FILTER_RULES frame_filter_rules (or none, to turn filtering off).
+//These replace whatever rules were there before. A rule matches a word w if
+//(w & mask) == value. FRAME_FILTER_HEAD rules look at the first word of each
+//AXI-Stream packet and keep or drop the whole packet; FRAME_FILTER_WORD rules
+//look at every word of the packets that are kept. Either way, a word (or
+//packet) is dropped if it matches any FRAME_FILTER_EXCLUDE rule, or if there
+//are FRAME_FILTER_INCLUDE rules and it doesn't match any of them. So to only
+//get packets from guvs 3 and 5, when the guv address is in the top byte of
+//the header, send two FRAME_FILTER_HEAD include rules with mask 0xFF000000
+//and values 0x03000000 and 0x05000000. The server answers with a
+//FRAME_FILTER frame (the same way as acks) holding an int32_t: the number of
+//rules now in place, or -1 if it didn't like them (too many, or bad where or
+//action), in which case the old rules stay. Every flit read after the answer
+//is filtered with the new rules. Frames that had words taken out of them
+//have FRAME_FILTERED set; packets dropped whole leave no trace. A packet
+//that's been filtered down to nothing is not sent at all, except to finish a
+//packet that was already partly sent (an empty frame without FRAME_PARTIAL).
+//
+//Everything is in the server's byte order (little-endian on all our boards),
+//just like the flits themselves.
+
+#include <stdint.h>
+
+//Values for frame_hdr.type. Server to client:
+#define FRAME_FLITS 0 //Payload is flits from the RX FIFO
+#define FRAME_ACK 1 //Payload is a frame_ack
+#define FRAME_OPTS 4 //Payload is a uint32_t of FRAME_OPT_* bits
+#define FRAME_FLITS_Z 5 //Payload is compressed flits
+#define FRAME_FILTER 8 //Payload is an int32_t: rules in place, or -1
+//Client to server:
+#define FRAME_CMDS 2 //Payload is command words
+#define FRAME_CMD_PACKET 3 //Payload is command words for a single packet
+#define FRAME_SET_OPTS 6 //Payload is a uint32_t of FRAME_OPT_* bits
+#define FRAME_SET_FILTER 7 //Payload is 0 or more frame_filter_rules
+
+//Bits for FRAME_SET_OPTS and FRAME_OPTS
+#define FRAME_OPT_COMPRESS (1<<0)
+
+//Anything bigger is rejected, and so is anything bigger than the TX FIFO
+#define FRAME_MAX_PACKET_WORDS 256
+
+//Flags in frame_hdr.flags
+#define FRAME_PARTIAL (1<<0) //The packet continues in the next frame
+#define FRAME_ERR (1<<1) //The RX FIFO raised an error interrupt here
+#define FRAME_GAP (1<<2) //Some flits were lost right before this frame
+#define FRAME_FILTERED (1<<3) //Some of this frame's flits were filtered out
+
+typedef struct _frame_hdr {
+    uint32_t len; //Bytes of payload after the header; a multiple of 4 except for FRAME_FLITS_Z
+    uint16_t type;
+    uint16_t flags;
+} __attribute__((packed)) frame_hdr;
+
+//Values for frame_ack.status
+#define FRAME_ACK_OK 0
+#define FRAME_ACK_TX_ERR 1 //The TX FIFO raised an error interrupt; who knows what got sent
+#define FRAME_ACK_BAD_LEN 2 //Empty, too big (for us or the TX FIFO), or not a whole number of words. Nothing was sent
+
+typedef struct _frame_ack {
+    uint32_t seq;
+    uint32_t status;
+    uint32_t words; //How many words the packet had
+} __attribute__((packed)) frame_ack;
+
+//Most rules FRAME_SET_FILTER can install
+#define FRAME_MAX_FILTER_RULES 16
+
+//Values for frame_filter_rule.where
+#define FRAME_FILTER_HEAD 0 //First word of each packet
+#define FRAME_FILTER_WORD 1 //Every word
+
+//Values for frame_filter_rule.action
+#define FRAME_FILTER_INCLUDE 0
+#define FRAME_FILTER_EXCLUDE 1
+
+typedef struct _frame_filter_rule {
+    uint32_t mask;
+    uint32_t value;
+    uint16_t where;
+    uint16_t action;
+} __attribute__((packed)) frame_filter_rule;
+
+#endif
@@ -0,0 +1,115 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include "irq.h"
+
+//Opens a UIO device. Returns 0 on success, -1 on error
+int irq_open_uio(irq_src *irq, char const *path) {
+    int fd = open(path, O_RDWR);
+    if (fd < 0) return -1;
+    int wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (wake_fd < 0) {
+        close(fd);
+        return -1;
+    }
+
+    irq->kind = IRQ_UIO;
+    irq->fd = fd;
+    irq->wake_fd = wake_fd;
+    irq->count = 0;
+    return 0;
+}
+
+//Makes an eventfd-backed interrupt source. Returns 0 on success, -1 on error
+int irq_open_eventfd(irq_src *irq) {
+    int fd = eventfd(0, EFD_CLOEXEC);
+    if (fd < 0) return -1;
+    int wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (wake_fd < 0) {
+        close(fd);
+        return -1;
+    }
+
+    irq->kind = IRQ_EVENTFD;
+    irq->fd = fd;
+    irq->wake_fd = wake_fd;
+    irq->count = 0;
+    return 0;
+}
+
+//Closes the interrupt source
+void irq_close(irq_src *irq) {
+    if (irq->fd != -1) close(irq->fd);
+    if (irq->wake_fd != -1) close(irq->wake_fd);
+    irq->fd = -1;
+    irq->wake_fd = -1;
+    irq->kind = IRQ_NONE;
+}
+
+//Unmasks the interrupt
+int irq_arm(irq_src *irq) {
+    if (irq->kind != IRQ_UIO) return 0;
+
+    //This is how uio_pdrv_genirq wants it: a 32-bit 1 to unmask
+    uint32_t unmask = 1;
+    if (write(irq->fd, &unmask, sizeof(unmask)) != sizeof(unmask)) return -1;
+    return 0;
+}
+
+//Sleeps until the interrupt fires
+int irq_wait(irq_src *irq, int timeout_ms) {
+    if (irq->kind == IRQ_NONE) return -1;
+
+    struct pollfd pfd[2] = {
+        {.fd = irq->fd, .events = POLLIN},
+        {.fd = irq->wake_fd, .events = POLLIN}
+    };
+    int rc = poll(pfd, 2, timeout_ms);
+    if (rc < 0) return (errno == EINTR) ? 0 : -1;
+    if (rc == 0) return 0;
+
+    //Clear any wakes, so the next call can sleep again. Nonblocking, so it
+    //doesn't matter if another one raced in after poll returned
+    if (pfd[1].revents & POLLIN) {
+        uint64_t wakes;
+        if (read(irq->wake_fd, &wakes, sizeof(wakes)) < 0 && errno != EAGAIN) return -1;
+    }
+    if (!(pfd[0].revents & POLLIN)) return 0;
+
+    //Consume the interrupt. UIO gives us a 32-bit running count, and eventfd
+    //gives us a 64-bit count since the last read
+    if (irq->kind == IRQ_UIO) {
+        uint32_t count;
+        if (read(irq->fd, &count, sizeof(count)) != sizeof(count)) return -1;
+        irq->count = count;
+    } else {
+        uint64_t count;
+        if (read(irq->fd, &count, sizeof(count)) != sizeof(count)) return -1;
+        irq->count += count;
+    }
+    return 1;
+}
+
+//Fires an eventfd-backed interrupt
+void irq_raise(irq_src *irq) {
+    if (irq->kind != IRQ_EVENTFD) return;
+
+    uint64_t one = 1;
+    if (write(irq->fd, &one, sizeof(one)) != sizeof(one)) {
+        perror("Could not raise interrupt");
+    }
+}
+
+//Gets irq_wait up early
+void irq_wake(irq_src *irq) {
+    if (irq->wake_fd == -1) return;
+
+    uint64_t one = 1;
+    if (write(irq->wake_fd, &one, sizeof(one)) != sizeof(one)) {
+        perror("Could not wake interrupt waiter");
+    }
+}
@@ -0,0 +1,64 @@
+#ifndef IRQ_H
+#define IRQ_H 1
+
+//Something we can sleep on until a FIFO interrupt fires. Normally this is a
+//UIO device (/dev/uioN) hooked up to the AXI-Stream FIFO's interrupt line.
+//For testing without hardware, it can be an eventfd instead, which a
+//software FIFO model pokes with irq_raise whenever its interrupt would fire.
+//
+//The UIO way of doing things: reading the fd blocks until the interrupt
+//fires (and gives you a count of how many times it has), and the interrupt
+//stays masked until you write a 1 to the fd. An eventfd acts the same way,
+//except that there is nothing to unmask.
+//
+//Each irq_src also has a second eventfd that other threads can poke with
+//irq_wake, to get whoever is asleep in irq_wait up early (e.g. because it has
+//replies to send) without waiting for the interrupt or the timeout.
+
+typedef enum _irq_kind {
+    IRQ_NONE,
+    IRQ_UIO,
+    IRQ_EVENTFD
+} irq_kind;
+
+typedef struct _irq_src {
+    irq_kind kind;
+    int fd;
+    int wake_fd; //For irq_wake
+    unsigned count; //Number of interrupts seen so far
+} irq_src;
+
+#define IRQ_SRC_INITIALIZER { \
+    .kind = IRQ_NONE, \
+    .fd = -1, \
+    .wake_fd = -1, \
+    .count = 0 \
+}
+
+//Opens a UIO device. Returns 0 on success, -1 on error
+int irq_open_uio(irq_src *irq, char const *path);
+
+//Makes an eventfd-backed interrupt source. Returns 0 on success, -1 on error
+int irq_open_eventfd(irq_src *irq);
+
+//Closes the interrupt source. It's fine to call this on IRQ_SRC_INITIALIZER
+void irq_close(irq_src *irq);
+
+//Unmasks the interrupt so that the next one wakes up irq_wait. Returns 0 on
+//success, -1 on error
+int irq_arm(irq_src *irq);
+
+//Sleeps until the interrupt fires, irq_wake is called, or timeout_ms goes by
+//(-1 means wait forever). Returns 1 if it fired, 0 on a wake or a timeout, or
+//-1 on error
+int irq_wait(irq_src *irq, int timeout_ms);
+
+//Gets irq_wait up early. If nobody is in irq_wait right now, the next call
+//returns right away. Safe to call from any thread
+void irq_wake(irq_src *irq);
+
+//Fires an eventfd-backed interrupt (for software FIFO models). Does nothing
+//for a real UIO device
+void irq_raise(irq_src *irq);
+
+#endif
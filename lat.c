@@ -0,0 +1,121 @@
+#include <stdio.h>
+#include <time.h>
+#include "lat.h"
+
+#define LOAD(x) atomic_load_explicit(&(x), memory_order_relaxed)
+#define STORE(x, v) atomic_store_explicit(&(x), (v), memory_order_relaxed)
+
+static unsigned long long lat_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int bucket_of(unsigned long long ns) {
+    if (ns < LAT_SUB) return ns;
+    int e = 63 - __builtin_clzll(ns); //Index of the top bit; at least LAT_SUB_BITS
+    int sub = (ns >> (e - LAT_SUB_BITS)) & (LAT_SUB - 1);
+    return (e - LAT_SUB_BITS + 1) * LAT_SUB + sub;
+}
+
+//Smallest value that lands in bucket i
+static unsigned long long bucket_low(int i) {
+    if (i < LAT_SUB) return i;
+    int e = i / LAT_SUB + LAT_SUB_BITS - 1;
+    int sub = i % LAT_SUB;
+    return (unsigned long long) (LAT_SUB + sub) << (e - LAT_SUB_BITS);
+}
+
+void lat_hist_add(lat_hist *h, unsigned long long ns) {
+    int i = bucket_of(ns);
+    STORE(h->counts[i], LOAD(h->counts[i]) + 1);
+    STORE(h->total, LOAD(h->total) + 1);
+    STORE(h->sum_ns, LOAD(h->sum_ns) + ns);
+    if (ns > LOAD(h->max_ns)) STORE(h->max_ns, ns);
+}
+
+unsigned long long lat_hist_quantile(lat_hist *h, double p) {
+    unsigned long long total = LOAD(h->total);
+    if (total == 0) return 0;
+
+    unsigned long long want = (unsigned long long) (p * total);
+    if (want >= total) want = total - 1;
+    unsigned long long seen = 0;
+    int i;
+    for (i = 0; i < LAT_HIST_BUCKETS; i++) {
+        seen += LOAD(h->counts[i]);
+        if (seen > want) {
+            //Top of this bucket, but never more than the max we've seen
+            unsigned long long top = (i + 1 < LAT_HIST_BUCKETS) ? bucket_low(i + 1) - 1 : ~0ULL;
+            unsigned long long max = LOAD(h->max_ns);
+            return (top < max) ? top : max;
+        }
+    }
+    return LOAD(h->max_ns);
+}
+
+void lat_hist_print(FILE *fp, char const *name, lat_hist *h) {
+    unsigned long long total = LOAD(h->total);
+    if (total == 0) {
+        fprintf(fp, "  %-10s no samples\n", name);
+        return;
+    }
+    fprintf(fp, "  %-10s %10llu samples; us: mean %.1f, p50 %.1f, p90 %.1f, p99 %.1f, p99.9 %.1f, max %.1f\n",
+        name, total, LOAD(h->sum_ns) / 1e3 / total,
+        lat_hist_quantile(h, 0.5) / 1e3,
+        lat_hist_quantile(h, 0.9) / 1e3,
+        lat_hist_quantile(h, 0.99) / 1e3,
+        lat_hist_quantile(h, 0.999) / 1e3,
+        LOAD(h->max_ns) / 1e3);
+}
+
+void lat_mark_add(lat_marks *m, unsigned pos) {
+    unsigned wr = atomic_load_explicit(&m->wr, memory_order_relaxed);
+    if (wr - atomic_load_explicit(&m->rd, memory_order_acquire) >= LAT_MARKS) return;
+
+    lat_mark *k = &m->marks[wr & (LAT_MARKS - 1)];
+    k->pos = pos;
+    k->t_in = lat_now();
+    k->t_out = 0;
+    atomic_store_explicit(&m->wr, wr + 1, memory_order_release);
+}
+
+void lat_marks_dequeued(lat_marks *m, unsigned end, lat_hist *h) {
+    unsigned wr = atomic_load_explicit(&m->wr, memory_order_acquire);
+    if (m->seen == wr) return;
+
+    unsigned long long now = lat_now();
+    while (m->seen != wr) {
+        lat_mark *k = &m->marks[m->seen & (LAT_MARKS - 1)];
+        //Positions wrap, so compare the difference
+        if ((int) (k->pos - end) >= 0) break;
+        k->t_out = now;
+        lat_hist_add(h, now - k->t_in);
+        m->seen++;
+    }
+}
+
+void lat_marks_sent(lat_marks *m, unsigned end, lat_hist *stage, lat_hist *total) {
+    unsigned rd = atomic_load_explicit(&m->rd, memory_order_relaxed);
+    if (rd == m->seen) return;
+
+    unsigned long long now = lat_now();
+    while (rd != m->seen) {
+        lat_mark *k = &m->marks[rd & (LAT_MARKS - 1)];
+        if ((int) (k->pos - end) >= 0) break;
+        lat_hist_add(stage, now - k->t_out);
+        lat_hist_add(total, now - k->t_in);
+        rd++;
+    }
+    atomic_store_explicit(&m->rd, rd, memory_order_release);
+}
+
+void pipe_lat_print(FILE *fp, pipe_lat *l) {
+    lat_hist_print(fp, "flit_queue", &l->flit_queue);
+    lat_hist_print(fp, "flit_send", &l->flit_send);
+    lat_hist_print(fp, "flit_total", &l->flit_total);
+    lat_hist_print(fp, "cmd_queue", &l->cmd_queue);
+    lat_hist_print(fp, "cmd_send", &l->cmd_send);
+    lat_hist_print(fp, "cmd_total", &l->cmd_total);
+    fflush(fp);
+}
@@ -0,0 +1,89 @@
+#ifndef LAT_H
+#define LAT_H 1
+
+#include <stdio.h>
+#include <stdatomic.h>
+
+//Optional (-H) latency histograms for each stage of a FIFO pair.
+//
+//Flits:    fifo_mgr reads RDFD --flit_queue--> net_tx dequeues
+//          --flit_send--> write() returns   (flit_total covers both)
+//Commands: net_mgr reads socket --cmd_queue--> fifo_tx dequeues
+//          --cmd_send--> TDFD written        (cmd_total covers both)
+//
+//The queues only carry bytes, so timestamps travel beside them: every time
+//the producer puts a burst into the queue, it also drops a "mark" (the
+//burst's position in the queue, and the time) into a small lock-free ring.
+//The consumer looks at the marks as the positions go by. If the ring is
+//full, the producer just skips that mark, so this samples bursts rather than
+//timing every flit. It also costs nothing when turned off.
+
+//Log-bucketed, like HdrHistogram: values under 16 ns get a bucket each, and
+//after that every power of two is split into 16 buckets, so a bucket is never
+//more than 1/16th (about 6%) wider than its lower bound. Goes up to 2^64 ns
+#define LAT_SUB_BITS 4
+#define LAT_SUB (1 << LAT_SUB_BITS)
+#define LAT_HIST_BUCKETS ((64 - LAT_SUB_BITS + 1) * LAT_SUB)
+
+//Only one thread adds to each histogram, but anyone can read them
+typedef struct _lat_hist {
+    _Atomic unsigned long long counts[LAT_HIST_BUCKETS];
+    _Atomic unsigned long long total;
+    _Atomic unsigned long long sum_ns;
+    _Atomic unsigned long long max_ns;
+} lat_hist;
+
+void lat_hist_add(lat_hist *h, unsigned long long ns);
+
+//Returns (an upper bound on) the p-th quantile, in ns. p is from 0 to 1
+unsigned long long lat_hist_quantile(lat_hist *h, double p);
+
+void lat_hist_print(FILE *fp, char const *name, lat_hist *h);
+
+//Must be a power of two
+#define LAT_MARKS 1024
+#define LAT_CACHE_LINE 64
+
+typedef struct _lat_mark {
+    unsigned pos; //Queue position of the burst's first byte
+    unsigned long long t_in; //When it went in
+    unsigned long long t_out; //When the consumer dequeued it
+} lat_mark;
+
+typedef struct _lat_marks {
+    lat_mark marks[LAT_MARKS];
+    //Written only by the producer
+    _Atomic unsigned wr __attribute__((aligned(LAT_CACHE_LINE)));
+    //Written only by the consumer. Marks from rd to seen have been dequeued
+    //but not sent yet
+    _Atomic unsigned rd __attribute__((aligned(LAT_CACHE_LINE)));
+    unsigned seen;
+} lat_marks;
+
+//Producer: call right before putting a burst at queue position pos into the
+//queue (so the consumer can never see the data before the mark)
+void lat_mark_add(lat_marks *m, unsigned pos);
+
+//Consumer: everything before queue position end was just dequeued. Adds how
+//long each burst waited to h
+void lat_marks_dequeued(lat_marks *m, unsigned end, lat_hist *h);
+
+//Consumer: everything before queue position end was just sent. Adds how
+//long sending took to stage, and how long the whole trip took to total
+void lat_marks_sent(lat_marks *m, unsigned end, lat_hist *stage, lat_hist *total);
+
+//Everything for one FIFO pair
+typedef struct _pipe_lat {
+    lat_marks flit_marks;
+    lat_marks cmd_marks;
+    lat_hist flit_queue;
+    lat_hist flit_send;
+    lat_hist flit_total;
+    lat_hist cmd_queue;
+    lat_hist cmd_send;
+    lat_hist cmd_total;
+} pipe_lat;
+
+void pipe_lat_print(FILE *fp, pipe_lat *l);
+
+#endif
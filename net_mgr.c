@@ -0,0 +1,311 @@
+#define _GNU_SOURCE             /* See feature_test_macros(7) */
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <string.h>
+#include <sys/uio.h>
+#include "queue.h"
+#include "net_mgr.h"
+#include "rt.h"
+#include "trace.h"
+#include "frame.h"
+#include "drle.h"
+
+//Prints throughput info for net_tx. Mostly here so we can see how well the
+//batching is working
+static void print_net_tx_stats(unsigned long long bytes, unsigned long long writes, struct timespec *start) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double secs = (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec)*1e-9;
+    unsigned long long flits = bytes / 4;
+    
+    fprintf(stderr, "net_tx: sent %llu flits in %.3f s (%.0f flits/s), "
+        "%llu write() calls (%.4f syscalls/flit)\n",
+        flits, secs, (secs > 0) ? flits/secs : 0.0,
+        writes, (flits > 0) ? (double) writes / flits : 0.0
+    );
+}
+
+//Where the frame starting off bytes into iov ends
+static int next_frame(struct iovec const iov[2], int off) {
+    frame_hdr hdr;
+    queue_span_get(iov, off, &hdr, sizeof(hdr));
+    return off + sizeof(hdr) + hdr.len;
+}
+
+//Cuts the n bytes in iov back to whole frames: as many as fit in max bytes,
+//but always at least one. frame_left is how much of the frame at the front
+//was left over from a short write. Returns the new length
+static int trim_frames(struct iovec iov[2], int n, int max, int frame_left) {
+    int end = frame_left;
+    while (end < n) {
+        int next = next_frame(iov, end);
+        if (end > 0 && next > max) break;
+        end = next;
+    }
+    //fifo_mgr always commits whole frames, so this shouldn't happen
+    if (end > n) end = n;
+    
+    if (end < iov[0].iov_len) {
+        iov[0].iov_len = end;
+        iov[1].iov_len = 0;
+    } else {
+        iov[1].iov_len = end - iov[0].iov_len;
+    }
+    return end;
+}
+
+//Compresses the n bytes of whole frames in iov (see FRAME_FLITS_Z in 
+//frame.h) into one buffer, and sends all of it. Returns the number of bytes
+//written to the socket, or -1 on error
+static int send_compressed(net_mgr_info *info, struct iovec const iov[2], int n, unsigned long long *num_writes) {
+    //Every frame comes out no bigger than it went in
+    unsigned char out[BUF_SIZE];
+    unsigned words[BUF_SIZE/sizeof(unsigned)];
+    int o = 0;
+    
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t0);
+    
+    int off;
+    for (off = 0; off < n; off = next_frame(iov, off)) {
+        frame_hdr hdr;
+        queue_span_get(iov, off, &hdr, sizeof(hdr));
+        
+        if (hdr.type == FRAME_FLITS && hdr.len > 0) {
+            uint32_t nw = hdr.len / sizeof(unsigned);
+            queue_span_get(iov, off + sizeof(hdr), words, hdr.len);
+            //Only worth it if it comes out smaller
+            unsigned char *dst = out + o + sizeof(hdr) + sizeof(nw);
+            int z = drle_encode(words, nw, dst, (int) hdr.len - (int) sizeof(nw) - 1);
+            if (z >= 0) {
+                frame_hdr zhdr = {
+                    .len = sizeof(nw) + z,
+                    .type = FRAME_FLITS_Z,
+                    .flags = hdr.flags
+                };
+                memcpy(out + o, &zhdr, sizeof(zhdr));
+                memcpy(out + o + sizeof(zhdr), &nw, sizeof(nw));
+                o += sizeof(zhdr) + zhdr.len;
+                continue;
+            }
+        }
+        
+        queue_span_get(iov, off, out + o, sizeof(hdr) + hdr.len);
+        o += sizeof(hdr) + hdr.len;
+    }
+    
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t1);
+    STATS_ADD(info->stats, z_in_bytes, n);
+    STATS_ADD(info->stats, z_out_bytes, o);
+    STATS_ADD(info->stats, z_ns, (t1.tv_sec - t0.tv_sec) * 1000000000LL + (t1.tv_nsec - t0.tv_nsec));
+    
+    int sent = 0;
+    while (sent < o) {
+        int rc = write(info->client_sfd, out + sent, o - sent);
+        (*num_writes)++;
+        if (rc <= 0) return -1;
+        STATS_ADD(info->stats, sock_tx_bytes, rc);
+        STATS_ADD(info->stats, sock_writes, 1);
+        if (rc < o - sent) STATS_ADD(info->stats, sock_short_writes, 1);
+        sent += rc;
+    }
+    return sent;
+}
+
+void* net_tx(void *arg) {
+#ifdef DEBUG_ON
+    fprintf(stderr, "Entered network tx thread\n");
+    fflush(stderr);
+#endif
+    net_mgr_info *info = (net_mgr_info *) arg;
+    queue *q = info->egress;
+    
+    //Just to be safe, wait until the signal that we can write
+    pthread_mutex_lock(&info->mutex);
+    while (!info->client_is_connected) pthread_cond_wait(&info->can_write, &info->mutex);
+    pthread_mutex_unlock(&info->mutex);
+    
+#ifdef DEBUG_ON
+    fprintf(stderr, "Beginning tx thread loop\n");
+    fflush(stderr);
+#endif
+    int batch_size = info->batch_size;
+    if (batch_size <= 0 || batch_size > BUF_SIZE) batch_size = BUF_SIZE;
+    
+    unsigned long long bytes_sent = 0;
+    unsigned long long num_writes = 0;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    
+    //Grab everything that's in the queue and send it all at once, straight 
+    //out of the queue's storage. We never wait around for more data to show
+    //up; if the queue goes idle, whatever we have is flushed right away. If
+    //writev() only sends part of it, we just release that part and the rest
+    //gets picked up on the next go-around.
+    //
+    //In framed mode, we only ever send whole frames (unless writev() cuts
+    //one short), so batch_size is rounded down to a frame boundary. If the 
+    //client asked for compression, the frames go through send_compressed 
+    //instead, which copies them (so it's all or nothing)
+    struct iovec iov[2];
+    pipe_lat *lat = info->lat;
+    int frame_left = 0;
+    int n;
+    while((n = queue_peek_read(q, 1, info->framed ? BUF_SIZE : batch_size, iov)) > 0) {
+        if (info->framed) n = trim_frames(iov, n, batch_size, frame_left);
+        if (lat != NULL) lat_marks_dequeued(&lat->flit_marks, QUEUE_RD_POS(q) + n, &lat->flit_queue);
+        
+        if (info->framed && frame_left == 0 && (atomic_load_explicit(info->opts, memory_order_relaxed) & FRAME_OPT_COMPRESS)) {
+            int rc = send_compressed(info, iov, n, &num_writes);
+            if (rc < 0) break;
+            if (lat != NULL) lat_marks_sent(&lat->flit_marks, QUEUE_RD_POS(q) + n, &lat->flit_send, &lat->flit_total);
+            queue_release_read(q, n);
+            bytes_sent += n;
+            trace_emit(TR_NET_SENT, rc, bytes_sent);
+            continue;
+        }
+        
+        int rc = writev(info->client_sfd, iov, 2);
+        num_writes++;
+        if (rc <= 0) {
+            break;
+        }
+        STATS_ADD(info->stats, sock_tx_bytes, rc);
+        STATS_ADD(info->stats, sock_writes, 1);
+        if (rc < iov[0].iov_len + iov[1].iov_len) STATS_ADD(info->stats, sock_short_writes, 1);
+        if (lat != NULL) lat_marks_sent(&lat->flit_marks, QUEUE_RD_POS(q) + rc, &lat->flit_send, &lat->flit_total);
+        if (info->framed) {
+            int end = frame_left;
+            while (end < rc) end = next_frame(iov, end);
+            frame_left = end - rc;
+        }
+        queue_release_read(q, rc);
+        bytes_sent += rc;
+        trace_emit(TR_NET_SENT, rc, bytes_sent);
+    }
+    
+    print_net_tx_stats(bytes_sent, num_writes, &start);
+    pthread_exit(NULL);
+}
+
+static void net_mgr_cleanup(void *arg) {
+#ifdef DEBUG_ON
+    fprintf(stderr, "Entered network manager cleanup\n");
+    fflush(stderr);
+#endif
+    net_mgr_info *info = (net_mgr_info *) arg;
+    queue *q = info->ingress;
+    
+    //Make net_tx quit, even though fifo_mgr is still producing. This also 
+    //wakes it up if it's sleeping on the queue
+    queue_set_producers(info->egress, -1);
+    
+    //No real need to lock/unlock mutex, but we'll do it for consistency
+    pthread_mutex_lock(&info->mutex);
+    if (info->tx_thread_started) {
+        pthread_join(info->tx_thread, NULL);
+    }
+    
+#ifdef DEBUG_ON
+    fprintf(stderr, "TX thread joined\n");
+    fflush(stderr);
+#endif
+    //net_tx was the only one reading the egress queue. This lets fifo_mgr
+    //know that it can stop
+    queue_add_consumers(info->egress, -1);
+    
+    if(info->client_is_connected) {
+        close(info->client_sfd);
+        info->client_sfd = -1;
+        info->client_is_connected = 0;
+    }
+    pthread_mutex_unlock(&info->mutex);
+    
+#ifdef DEBUG_ON
+    fprintf(stderr, "Closed socket\n");
+    fflush(stderr);
+#endif
+    
+    queue_add_producers(q, -1);
+}
+
+void* net_mgr(void *arg) {
+#ifdef DEBUG_ON
+    fprintf(stderr, "Entered network manager\n");
+    fflush(stderr);
+#endif
+    net_mgr_info *info = (net_mgr_info *) arg;
+    queue *q = info->ingress;
+    
+    info->client_is_connected = 0;
+    info->tx_thread_started = 0;
+    
+    pthread_cleanup_push(net_mgr_cleanup, arg);
+    
+    //Listen for and accept incoming connections
+    int rc = listen(info->server_sfd, 1);
+    if (rc < 0) {
+        perror("Could not listen on socket");
+        goto done;
+    }
+    
+    struct sockaddr_in client_addr; //In case we ever want to use it
+    unsigned client_addr_len = sizeof(client_addr);
+    int client_sfd = accept(info->server_sfd, (struct sockaddr*)&client_addr, &client_addr_len);
+    if (client_sfd < 0) {
+        perror("Could not accept incoming connection");
+        goto done;
+    }
+    info->client_sfd = client_sfd;
+    info->client_is_connected = 1;
+    if (info->attached != NULL) atomic_store(info->attached, 1);
+    
+    //We can spin up the TX thread
+    //Although we can't really do this for the call to accept, we'll at least
+    //use the mutex here to make sure that starting the TX thread and setting
+    //the tx_thread_started flag are performed atomically
+    pthread_mutex_lock(&info->mutex);
+    pthread_create(&info->tx_thread, NULL, net_tx, info); //Should be non-blocking, right?
+    pthread_setname_np(info->tx_thread, info->tx_thread_name);
+    rt_apply(info->tx_thread, info->tx_thread_name);
+    info->tx_thread_started = 1;
+    pthread_mutex_unlock(&info->mutex);
+    
+    //Now we just read in a loop, constantly filling the queue. The data goes
+    //directly into the queue's storage; there is no intermediate buffer
+    int len;
+    struct iovec iov[2];
+    while(1) {
+        pthread_mutex_lock(&info->mutex);
+        if (info->stop) {
+            pthread_mutex_unlock(&info->mutex);
+            break;
+        }
+        pthread_mutex_unlock(&info->mutex);
+        if (queue_reserve_write(q, 1, BUF_SIZE, iov) < 0) {
+            break;
+        }
+        len = readv(client_sfd, iov, 2);
+        if (len == 0) {
+            break;
+        } else if (len < 0) {
+            perror("Error reading from network");
+            break;
+        }
+        STATS_ADD(info->stats, sock_rx_bytes, len);
+        STATS_ADD(info->stats, sock_reads, 1);
+        trace_emit(TR_NET_RECV, len, atomic_load_explicit(&info->stats->sock_rx_bytes, memory_order_relaxed));
+        if (info->lat != NULL) lat_mark_add(&info->lat->cmd_marks, QUEUE_WR_POS(q));
+        
+        queue_commit_write(q, len);
+    }
+    
+    done:
+    pthread_cleanup_pop(1);
+    pthread_exit(NULL);
+}
@@ -0,0 +1,44 @@
+#ifndef NET_MGR_H
+#define NET_MGR_H 1
+
+#include <pthread.h>
+#include "queue.h"
+#include "stats.h"
+#include "lat.h"
+
+typedef struct _net_mgr_info {
+    //Never modified by the thread
+    int server_sfd;
+    int stop;
+    int batch_size; //Max number of bytes net_tx sends in one write()
+    int framed; //If nonzero, the egress queue holds frames (see frame.h)
+    _Atomic unsigned *opts; //In framed mode, the FRAME_OPT_* bits the client turned on
+    char tx_thread_name[16]; //What to call net_tx (names are max 16 chars)
+    
+    //These values shuldn't be touched by the main thread
+    pthread_mutex_t mutex;
+    pthread_cond_t can_write;
+    int client_sfd;
+    int client_is_connected;
+    
+    //The RX thread takes care of spinning up and down the TX thread
+    pthread_t tx_thread;
+    int tx_thread_started;
+    
+    queue *ingress;
+    queue *egress;
+    pipe_stats *stats;
+    pipe_lat *lat; //Latency histograms (-H), or NULL
+    _Atomic int *attached; //If not NULL, set once a client connects (see fifo_mgr.h)
+} net_mgr_info;
+
+//Reads from the egress queue and writes to the client's socket. Started by 
+//net_mgr once a client connects
+void* net_tx(void *arg);
+
+//Waits for a client, spins up net_tx, and then reads from the client into the
+//ingress queue until the client disconnects. Remember to increment 
+//arg->q->num_producers before spinning up this thread
+void* net_mgr(void *arg);
+
+#endif
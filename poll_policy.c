@@ -0,0 +1,108 @@
+#include <stdio.h>
+#include <sched.h>
+#include <time.h>
+#include "poll_policy.h"
+
+static char const *phase_names[POLL_NUM_PHASES] = {
+    "working",
+    "spinning",
+    "yielding",
+    "sleeping"
+};
+
+//Parses SPIN,YIELD,MIN_US,MAX_US
+int poll_policy_parse(poll_policy_cfg *cfg, char const *str) {
+    poll_policy_cfg tmp;
+    char extra;
+    int rc = sscanf(str, "%d,%d,%d,%d%c", &tmp.spin_iters, &tmp.yield_iters, &tmp.min_sleep_us, &tmp.max_sleep_us, &extra);
+    if (rc != 4) return -1;
+    if (tmp.spin_iters < 0 || tmp.yield_iters < -1) return -1;
+    if (tmp.min_sleep_us <= 0 || tmp.max_sleep_us < tmp.min_sleep_us) return -1;
+
+    *cfg = tmp;
+    return 0;
+}
+
+void poll_policy_init(poll_policy *p, poll_policy_cfg const *cfg) {
+    p->cfg = cfg;
+    p->idle_iters = 0;
+    p->sleep_us = cfg->min_sleep_us;
+    p->phase = POLL_WORKING;
+    clock_gettime(CLOCK_MONOTONIC, &p->phase_start);
+
+    int i;
+    for (i = 0; i < POLL_NUM_PHASES; i++) p->phase_ns[i] = 0;
+}
+
+//Charges the time since the phase started to the current phase
+static void charge_phase(poll_policy *p) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    p->phase_ns[p->phase] += (now.tv_sec - p->phase_start.tv_sec) * 1000000000LL + (now.tv_nsec - p->phase_start.tv_nsec);
+    p->phase_start = now;
+}
+
+static void set_phase(poll_policy *p, poll_phase phase) {
+    if (p->phase == phase) return;
+    charge_phase(p);
+    p->phase = phase;
+}
+
+void poll_policy_busy(poll_policy *p) {
+    if (p->phase == POLL_WORKING) return;
+
+    set_phase(p, POLL_WORKING);
+    p->idle_iters = 0;
+    p->sleep_us = p->cfg->min_sleep_us;
+}
+
+void poll_policy_idle(poll_policy *p) {
+    poll_policy_cfg const *cfg = p->cfg;
+    p->idle_iters++;
+
+    if (p->idle_iters <= cfg->spin_iters) {
+        set_phase(p, POLL_SPINNING);
+        return;
+    }
+
+    if (cfg->yield_iters < 0 || p->idle_iters <= cfg->spin_iters + cfg->yield_iters) {
+        set_phase(p, POLL_YIELDING);
+        sched_yield();
+        //Don't let idle_iters overflow if we yield forever
+        if (cfg->yield_iters < 0) p->idle_iters = cfg->spin_iters + 1;
+        return;
+    }
+
+    set_phase(p, POLL_SLEEPING);
+    struct timespec ts = {
+        .tv_sec = p->sleep_us / 1000000,
+        .tv_nsec = (p->sleep_us % 1000000) * 1000L
+    };
+    nanosleep(&ts, NULL);
+
+    p->sleep_us *= 2;
+    if (p->sleep_us > cfg->max_sleep_us) p->sleep_us = cfg->max_sleep_us;
+
+    //Don't let idle_iters overflow if we sit here for days
+    p->idle_iters = cfg->spin_iters + cfg->yield_iters + 1;
+}
+
+void poll_policy_block(poll_policy *p) {
+    set_phase(p, POLL_SLEEPING);
+}
+
+void poll_policy_print(poll_policy *p, char const *name) {
+    //Close out whatever phase we're in
+    charge_phase(p);
+
+    unsigned long long total = 0;
+    int i;
+    for (i = 0; i < POLL_NUM_PHASES; i++) total += p->phase_ns[i];
+    if (total == 0) total = 1;
+
+    fprintf(stderr, "%s:", name);
+    for (i = 0; i < POLL_NUM_PHASES; i++) {
+        fprintf(stderr, " %s %.3f s (%.1f%%)%s", phase_names[i], p->phase_ns[i] / 1e9,
+            100.0 * p->phase_ns[i] / total, (i == POLL_NUM_PHASES - 1) ? "\n" : ",");
+    }
+}
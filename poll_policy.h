@@ -0,0 +1,68 @@
+#ifndef POLL_POLICY_H
+#define POLL_POLICY_H 1
+
+#include <time.h>
+
+//What a polling thread does when it comes up empty. It spins (just polls
+//again) spin_iters times, then calls sched_yield() yield_iters times, then
+//starts sleeping: min_sleep_us at first, doubling every time up to
+//max_sleep_us. As soon as it finds something to do, it goes right back to
+//spinning.
+//
+//The default is what we always did: yield forever.
+
+typedef struct _poll_policy_cfg {
+    int spin_iters;
+    int yield_iters; //-1 means yield forever and never sleep
+    int min_sleep_us;
+    int max_sleep_us;
+} poll_policy_cfg;
+
+#define POLL_POLICY_CFG_DEFAULT { \
+    .spin_iters = 0, \
+    .yield_iters = -1, \
+    .min_sleep_us = 10, \
+    .max_sleep_us = 1000 \
+}
+
+typedef enum _poll_phase {
+    POLL_WORKING,
+    POLL_SPINNING,
+    POLL_YIELDING,
+    POLL_SLEEPING,
+    POLL_NUM_PHASES
+} poll_phase;
+
+//One of these per polling thread
+typedef struct _poll_policy {
+    poll_policy_cfg const *cfg;
+    int idle_iters; //How many times in a row we came up empty
+    int sleep_us; //How long we'll sleep next time
+
+    //Time spent in each phase. We only look at the clock when the phase
+    //changes, so this costs nothing while we're busy
+    poll_phase phase;
+    struct timespec phase_start;
+    unsigned long long phase_ns[POLL_NUM_PHASES];
+} poll_policy;
+
+//Parses SPIN,YIELD,MIN_US,MAX_US. Returns 0 on success, -1 on error
+int poll_policy_parse(poll_policy_cfg *cfg, char const *str);
+
+void poll_policy_init(poll_policy *p, poll_policy_cfg const *cfg);
+
+//Call this whenever a poll found something to do
+void poll_policy_busy(poll_policy *p);
+
+//Call this whenever a poll came up empty. Spins, yields, or sleeps depending
+//on how long we've been idle
+void poll_policy_idle(poll_policy *p);
+
+//Call this instead of poll_policy_idle when you're about to sleep some other
+//way (e.g. on an interrupt), so that the time gets counted as sleeping
+void poll_policy_block(poll_policy *p);
+
+//Prints how much time was spent in each phase
+void poll_policy_print(poll_policy *p, char const *name);
+
+#endif
@@ -4,209 +4,369 @@
 #endif
 
 #include <pthread.h>
+#include <string.h>
+#include <time.h>
 #include "queue.h"
 
+//A quick note on the memory ordering: the producer publishes data by storing
+//wr_pos and then checking cons_waiting, and a sleeping consumer sets
+//cons_waiting and then re-checks wr_pos (and likewise for the other
+//direction). Both sides use seq_cst for these, which guarantees that at least
+//one of them sees the other's store. In other words, either the consumer sees
+//the new data and doesn't sleep, or the producer sees the flag and signals.
 
+#define IDX(pos) ((pos) & (BUF_SIZE - 1))
 
-//Adds a char to queue q in a thread-safe way. Returns 0 on successful write,
-//negative on error. This function can sleep; do not call while holding _any_
-//mutexes, not even the one in the struct! 
-int enqueue_single(queue *q, char c) {
-    //Lock mutex before we try adding c to the queue
+//Only the consumer writes occ_hwm, so this doesn't need to be a CAS loop. We
+//only call it when the consumer has just looked at wr_pos anyway
+static void note_occupancy(queue *q, unsigned occ) {
+    if (occ > atomic_load_explicit(&q->occ_hwm, memory_order_relaxed)) {
+        atomic_store_explicit(&q->occ_hwm, occ, memory_order_relaxed);
+    }
+}
+
+static unsigned long long mono_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+//Adds delta (which can be negative) to the number of producers/consumers, and
+//wakes up anyone sleeping on the queue so they notice the change
+void queue_add_producers(queue *q, int delta) {
+    pthread_mutex_lock(&q->mutex);
+    atomic_fetch_add(&q->num_producers, delta);
+    pthread_cond_broadcast(&q->can_cons);
+    pthread_cond_broadcast(&q->can_prod);
+    pthread_mutex_unlock(&q->mutex);
+}
+
+void queue_add_consumers(queue *q, int delta) {
+    pthread_mutex_lock(&q->mutex);
+    atomic_fetch_add(&q->num_consumers, delta);
+    pthread_cond_broadcast(&q->can_cons);
+    pthread_cond_broadcast(&q->can_prod);
+    pthread_mutex_unlock(&q->mutex);
+}
+
+void queue_set_producers(queue *q, int n) {
     pthread_mutex_lock(&q->mutex);
-    //Wait until there is space
-    while (q->full && q->num_consumers > 0) pthread_cond_wait(&q->can_prod, &q->mutex);
-    if (q->num_consumers <= 0) {
+    atomic_store(&q->num_producers, n);
+    pthread_cond_broadcast(&q->can_cons);
+    pthread_cond_broadcast(&q->can_prod);
+    pthread_mutex_unlock(&q->mutex);
+}
+
+//Producer side. Sleeps until there are at least n free spaces in the queue.
+//Returns 0 once there are, or -1 if there are no consumers
+static int wait_writable(queue *q, unsigned n) {
+    unsigned wr = atomic_load_explicit(&q->wr_pos, memory_order_relaxed);
+
+    if (atomic_load_explicit(&q->num_consumers, memory_order_relaxed) <= 0) return -1;
+
+    //Fast path: the cached read position says there's room
+    if (BUF_SIZE - (wr - q->rd_cache) >= n) return 0;
+    q->rd_cache = atomic_load_explicit(&q->rd_pos, memory_order_acquire);
+    QUEUE_STAT(q, rd_refreshes);
+    if (BUF_SIZE - (wr - q->rd_cache) >= n) return 0;
+
+    //Queue really is full; go to sleep
+    QUEUE_STAT(q, prod_sleeps);
+    unsigned long long start = mono_ns();
+    pthread_mutex_lock(&q->mutex);
+    atomic_store(&q->prod_waiting, 1);
+    while (BUF_SIZE - (wr - atomic_load(&q->rd_pos)) < n && atomic_load(&q->num_consumers) > 0) {
+        pthread_cond_wait(&q->can_prod, &q->mutex);
+    }
+    atomic_store(&q->prod_waiting, 0);
+    pthread_mutex_unlock(&q->mutex);
+    atomic_store_explicit(&q->prod_blocks, q->prod_blocks + 1, memory_order_relaxed);
+    atomic_store_explicit(&q->prod_blocked_ns, q->prod_blocked_ns + (mono_ns() - start), memory_order_relaxed);
+
+    q->rd_cache = atomic_load_explicit(&q->rd_pos, memory_order_acquire);
+    return (atomic_load(&q->num_consumers) > 0) ? 0 : -1;
+}
+
+//Consumer side. Sleeps until there are at least n bytes in the queue. Returns
+//0 once there are, or -1 if there are no producers
+static int wait_readable(queue *q, unsigned n) {
+    unsigned rd = atomic_load_explicit(&q->rd_pos, memory_order_relaxed);
+
+    if (atomic_load_explicit(&q->num_producers, memory_order_relaxed) <= 0) return -1;
+
+    //Fast path: the cached write position says there's enough data
+    if (q->wr_cache - rd >= n) return 0;
+    q->wr_cache = atomic_load_explicit(&q->wr_pos, memory_order_acquire);
+    QUEUE_STAT(q, wr_refreshes);
+    note_occupancy(q, q->wr_cache - rd);
+    if (q->wr_cache - rd >= n) return 0;
+
+    //Queue really is empty; go to sleep
+    QUEUE_STAT(q, cons_sleeps);
+    pthread_mutex_lock(&q->mutex);
+    atomic_store(&q->cons_waiting, 1);
+    while (atomic_load(&q->wr_pos) - rd < n && atomic_load(&q->num_producers) > 0) {
+        pthread_cond_wait(&q->can_cons, &q->mutex);
+    }
+    atomic_store(&q->cons_waiting, 0);
+    pthread_mutex_unlock(&q->mutex);
+
+    q->wr_cache = atomic_load_explicit(&q->wr_pos, memory_order_acquire);
+    note_occupancy(q, q->wr_cache - rd);
+    return (atomic_load(&q->num_producers) > 0) ? 0 : -1;
+}
+
+//Consumer side, for reads that take everything there is (up to max bytes).
+//wait_readable's fast path trusts wr_cache, which can be well behind the
+//producer, so look at the real write position unless the cache already has
+//max bytes for us. Returns how many bytes to read
+static int readable(queue *q, unsigned rd, int max) {
+    if (q->wr_cache - rd < (unsigned) max) {
+        q->wr_cache = atomic_load_explicit(&q->wr_pos, memory_order_acquire);
+        QUEUE_STAT(q, wr_refreshes);
+        note_occupancy(q, q->wr_cache - rd);
+    }
+    int n = q->wr_cache - rd;
+    return (n > max) ? max : n;
+}
+
+//Copies len bytes into the queue storage starting at position pos. At most
+//two memcpys: one up to the end of the buffer, and one for the part that
+//wrapped around
+static void copy_in(queue *q, unsigned pos, char const *src, int len) {
+    int first = BUF_SIZE - IDX(pos);
+    if (first > len) first = len;
+    memcpy(q->buf + IDX(pos), src, first);
+    memcpy(q->buf, src + first, len - first);
+}
+
+//Same as copy_in, but in the other direction
+static void copy_out(queue *q, unsigned pos, char *dst, int len) {
+    int first = BUF_SIZE - IDX(pos);
+    if (first > len) first = len;
+    memcpy(dst, q->buf + IDX(pos), first);
+    memcpy(dst + first, q->buf, len - first);
+}
+
+//Makes everything up to wr visible to the consumer, and wakes it up if it's
+//sleeping
+static void publish_write(queue *q, unsigned wr) {
+    atomic_store(&q->wr_pos, wr);
+    if (atomic_load(&q->cons_waiting)) {
+        QUEUE_STAT(q, cons_wakeups);
+        pthread_mutex_lock(&q->mutex);
+        pthread_cond_signal(&q->can_cons);
         pthread_mutex_unlock(&q->mutex);
-        return -1;
     }
-    
-    //Add c to the buffer, making sure to signal to everyone else that they
-    //can read
-    q->buf[q->wr_pos++] = c;
-    if (q->wr_pos >= BUF_SIZE) q->wr_pos = 0;
-    if (q->wr_pos == q->rd_pos) q->full = 1;
-    q->empty = 0;
+}
+
+//Frees up everything before rd for the producer, and wakes it up if it's
+//sleeping
+static void publish_read(queue *q, unsigned rd) {
+    atomic_store(&q->rd_pos, rd);
+    if (atomic_load(&q->prod_waiting)) {
+        QUEUE_STAT(q, prod_wakeups);
+        pthread_mutex_lock(&q->mutex);
+        pthread_cond_signal(&q->can_prod);
+        pthread_mutex_unlock(&q->mutex);
+    }
+}
+
+//Adds a char to queue q in a thread-safe way. Returns 0 on successful write,
+//negative on error. This function can sleep; do not call while holding _any_
+//mutexes, not even the one in the struct!
+int enqueue_single(queue *q, char c) {
+    if (wait_writable(q, 1) < 0) return -1;
+
+    unsigned wr = atomic_load_explicit(&q->wr_pos, memory_order_relaxed);
+    q->buf[IDX(wr)] = c;
 #ifdef QUEUE_DEBUG_ON
     fprintf(stderr, "Enqueued 0x%02x", c);
     if (isprint(c)) fprintf(stderr, " = '%c'", c);
     fprintf(stderr, "\n");
 #endif
-    pthread_mutex_unlock(&q->mutex);
-    
-    pthread_cond_signal(&q->can_cons);
+    publish_write(q, wr + 1);
     return 0;
 }
 
 //Reads a char from queue q in a thread-safe way. Returns 0 on successful read,
 //-1 if no producers. This function can sleep; do not call while holding _any_
-//mutexes, not even the one in the struct! 
+//mutexes, not even the one in the struct!
 int dequeue_single(queue *q, char *c) {
-    pthread_mutex_lock(&q->mutex);
-    while (q->empty && q->num_producers > 0) pthread_cond_wait(&q->can_cons, &q->mutex);
-    if (q->num_producers <= 0) {
-        pthread_mutex_unlock(&q->mutex);
-        return -1;
-    }
-    
-    *c = q->buf[q->rd_pos++];
-    if (q->rd_pos >= BUF_SIZE) q->rd_pos = 0;
-    if (q->rd_pos == q->wr_pos) q->empty = 1;
-    q->full = 0;
+    if (wait_readable(q, 1) < 0) return -1;
+
+    unsigned rd = atomic_load_explicit(&q->rd_pos, memory_order_relaxed);
+    *c = q->buf[IDX(rd)];
 #ifdef QUEUE_DEBUG_ON
     fprintf(stderr, "Dequeued 0x%02x", *c);
     if (isprint(*c)) fprintf(stderr, " = '%c'", *c);
     fprintf(stderr, "\n");
 #endif
-    pthread_mutex_unlock(&q->mutex);
-    
-    pthread_cond_signal(&q->can_prod);
+    publish_read(q, rd + 1);
     return 0;
 }
 
 //Reads n bytes from queue q in a thread-safe way. Returns 0 on successful read,
-//and -1 on error (no producers). This function  locks (and unlocks) mutexes, so 
+//and -1 on error (no producers). This function  locks (and unlocks) mutexes, so
 //don't call while holding any mutexes
 int dequeue_n(queue *q, char *buf, int n) {
-    pthread_mutex_lock(&q->mutex);
-    while(PTR_QUEUE_OCCUPANCY(q) < n && q->num_producers > 0) {
-        pthread_cond_wait(&q->can_cons, &q->mutex);
-    }
-    if (q->num_producers <= 0) {
-        pthread_mutex_unlock(&q->mutex);
-        return -1;
-    }
-    
-    //Dequeue queue into buf
-#ifdef QUEUE_DEBUG_ON
-    fprintf(stderr, "Dequeued [");
-#endif
-    int i;
-    for (i = 0; i < n; i++) {
-#ifdef QUEUE_DEBUG_ON
-        fprintf(stderr, "0x%02x ", q->buf[q->rd_pos]);
-#endif
-        *buf++ = q->buf[q->rd_pos++];
-        if (q->rd_pos >= BUF_SIZE) q->rd_pos = 0;
-    }
+    if (n > BUF_SIZE) return -1;
+    if (wait_readable(q, n) < 0) return -1;
+
+    unsigned rd = atomic_load_explicit(&q->rd_pos, memory_order_relaxed);
+    copy_out(q, rd, buf, n);
 #ifdef QUEUE_DEBUG_ON
-    fprintf(stderr, "]\n");
+    fprintf(stderr, "Dequeued %d bytes\n", n);
 #endif
-
-    if (q->rd_pos == q->wr_pos) q->empty = 1;
-    q->full = 0;
-
-    pthread_mutex_unlock(&q->mutex);
-    
-    pthread_cond_signal(&q->can_prod);
+    publish_read(q, rd + n);
     return 0;
 }
 
-//Waits until len spaces are free in the queue, then writes all at once. I have 
-//not written any scheduling code, so there are cases where one producer could
-//starve another. Returns 0 on success, negative otherwise
+//Waits until len spaces are free in the queue, then writes all at once. Only
+//one thread may write to a queue. Returns 0 on success, negative otherwise
 int queue_write(queue *q, char *buf, int len) {
     //Check if len is too big to begin with
     if (len > BUF_SIZE) return -1;
-    
-    //Lock mutex before we try adding data to the queue
-    pthread_mutex_lock(&q->mutex);
-    //Wait until there is enough space for entire buffer
-    while (PTR_QUEUE_VACANCY(q) < len && q->num_consumers > 0)
-        pthread_cond_wait(&q->can_prod, &q->mutex);
-        
-    if (q->num_consumers <= 0) {
-        pthread_mutex_unlock(&q->mutex);
-        return -1;
-    }
-    
-    //Copy buf into the queue
-#ifdef QUEUE_DEBUG_ON
-    fprintf(stderr, "Enqueued [");
-#endif
-    int i;
-    for (i = 0; i < len; i++) {
-#ifdef QUEUE_DEBUG_ON
-        fprintf(stderr, "0x%02x ", *buf & 0xFF);
-#endif
-        q->buf[q->wr_pos++] = *buf++;
-        if (q->wr_pos >= BUF_SIZE) q->wr_pos = 0;
-    }
-    if (q->wr_pos == q->rd_pos) q->full = 1;
-    q->empty = 0;
+    if (wait_writable(q, len) < 0) return -1;
+
+    unsigned wr = atomic_load_explicit(&q->wr_pos, memory_order_relaxed);
+    copy_in(q, wr, buf, len);
 #ifdef QUEUE_DEBUG_ON
-    fprintf(stderr, "]\n");
+    fprintf(stderr, "Enqueued %d bytes\n", len);
 #endif
-    pthread_mutex_unlock(&q->mutex);
-    
-    pthread_cond_signal(&q->can_cons);
+    publish_write(q, wr + len);
     return 0;
 }
 
-//Tries to read a single byte from the queue. Returns negative if it can't
+//Tries to read a single byte from the queue. Returns 0 on success, 1 if there
+//was nothing to read, and -1 if there are no producers
 int nb_dequeue_single(queue *q, char *c) {
-    pthread_mutex_lock(&q->mutex);
-    if (q->empty) {
-        if (q->num_producers > 0) {
-            pthread_mutex_unlock(&q->mutex);
-            return 1;
-        } else {
-            pthread_mutex_unlock(&q->mutex);
-            return -1;
+    return nb_dequeue_n(q, c, 1);
+}
+
+//Reads n bytes from queue q in a thread-safe way. Returns 0 on successful read,
+//1 if there was nothing to read, -1 on error (no producers). Never sleeps
+int nb_dequeue_n(queue *q, char *buf, int n) {
+    unsigned rd = atomic_load_explicit(&q->rd_pos, memory_order_relaxed);
+
+    if (q->wr_cache - rd < (unsigned) n) {
+        q->wr_cache = atomic_load_explicit(&q->wr_pos, memory_order_acquire);
+        QUEUE_STAT(q, wr_refreshes);
+        note_occupancy(q, q->wr_cache - rd);
+        if (q->wr_cache - rd < (unsigned) n) {
+            return (atomic_load(&q->num_producers) > 0) ? 1 : -1;
         }
     }
-    
-    *c = q->buf[q->rd_pos++];
-    if (q->rd_pos >= BUF_SIZE) q->rd_pos = 0;
-    if (q->rd_pos == q->wr_pos) q->empty = 1;
-    q->full = 0;
+
+    copy_out(q, rd, buf, n);
 #ifdef QUEUE_DEBUG_ON
-    fprintf(stderr, "Dequeued 0x%02x", *c);
-    if (isprint(*c)) fprintf(stderr, " = '%c'", *c);
-    fprintf(stderr, "\n");
+    fprintf(stderr, "Dequeued %d bytes\n", n);
 #endif
-    pthread_mutex_unlock(&q->mutex);
-    
-    pthread_cond_signal(&q->can_prod);
+    publish_read(q, rd + n);
     return 0;
 }
 
-//Reads n bytes from queue q in a thread-safe way. Returns 0 on successful read,
-//1 if there was nothing to read, -1 on error (no producers). This function 
-//locks (and unlocks) mutexes, so don't call while holding any mutexes
-int nb_dequeue_n(queue *q, char *buf, int n) {
-    pthread_mutex_lock(&q->mutex);
-    if (PTR_QUEUE_OCCUPANCY(q) < n) {
-        if (q->num_producers > 0) {
-            pthread_mutex_unlock(&q->mutex);
-            return 1;
-        } else {
-            pthread_mutex_unlock(&q->mutex);
-            return -1;
-        }
-    }
-    
-    //Dequeue queue into buf
+//Waits until there is at least one byte in the queue, then reads everything
+//that is available (but no more than max bytes) in one go. Returns the number
+//of bytes read, or -1 on error (no producers). This function locks (and
+//unlocks) mutexes, so don't call while holding any mutexes
+int dequeue_avail(queue *q, char *buf, int max) {
+    if (wait_readable(q, 1) < 0) return -1;
+
+    unsigned rd = atomic_load_explicit(&q->rd_pos, memory_order_relaxed);
+    int n = readable(q, rd, max);
+
+    copy_out(q, rd, buf, n);
 #ifdef QUEUE_DEBUG_ON
-    fprintf(stderr, "Dequeued [");
+    fprintf(stderr, "Dequeued %d bytes\n", n);
 #endif
-    int i;
-    for (i = 0; i < n; i++) {
+    publish_read(q, rd + n);
+    return n;
+}
+
+//Fills iov with the (at most) two spans of storage starting at position pos
+static void make_spans(queue *q, unsigned pos, int len, struct iovec iov[2]) {
+    int first = BUF_SIZE - IDX(pos);
+    if (first > len) first = len;
+    iov[0].iov_base = q->buf + IDX(pos);
+    iov[0].iov_len = first;
+    iov[1].iov_base = q->buf;
+    iov[1].iov_len = len - first;
+}
+
+//Waits until at least min bytes are free, then gives you all the free space
+//(but no more than max bytes) as two spans. Returns number of bytes reserved,
+//or -1 if there are no consumers
+int queue_reserve_write(queue *q, int min, int max, struct iovec iov[2]) {
+    if (min > BUF_SIZE) return -1;
+    if (wait_writable(q, min) < 0) return -1;
+
+    unsigned wr = atomic_load_explicit(&q->wr_pos, memory_order_relaxed);
+    int n = BUF_SIZE - (wr - q->rd_cache);
+    if (n > max) n = max;
+
+    make_spans(q, wr, n, iov);
+    return n;
+}
+
+//Makes len bytes of the last reservation visible to the consumer
+void queue_commit_write(queue *q, int len) {
+    unsigned wr = atomic_load_explicit(&q->wr_pos, memory_order_relaxed);
 #ifdef QUEUE_DEBUG_ON
-        fprintf(stderr, "0x%02x ", q->buf[q->rd_pos]);
+    fprintf(stderr, "Committed %d bytes\n", len);
 #endif
-        *buf++ = q->buf[q->rd_pos++];
-        if (q->rd_pos >= BUF_SIZE) q->rd_pos = 0;
-    }
+    publish_write(q, wr + len);
+}
+
+//Waits until at least min bytes are in the queue, then gives you all of them
+//(but no more than max bytes) as two spans. Returns number of bytes peeked, 
+//or -1 if there are no producers
+int queue_peek_read(queue *q, int min, int max, struct iovec iov[2]) {
+    if (min > BUF_SIZE) return -1;
+    if (wait_readable(q, min) < 0) return -1;
+
+    unsigned rd = atomic_load_explicit(&q->rd_pos, memory_order_relaxed);
+    int n = readable(q, rd, max);
+
+    make_spans(q, rd, n, iov);
+    return n;
+}
+
+//Removes len bytes (which you have already peeked) from the queue
+void queue_release_read(queue *q, int len) {
+    unsigned rd = atomic_load_explicit(&q->rd_pos, memory_order_relaxed);
 #ifdef QUEUE_DEBUG_ON
-    fprintf(stderr, "]\n");
+    fprintf(stderr, "Released %d bytes\n", len);
 #endif
+    publish_read(q, rd + len);
+}
 
-    if (q->rd_pos == q->wr_pos) q->empty = 1;
-    q->full = 0;
+void queue_span_put(struct iovec iov[2], int off, void const *src, int len) {
+    char const *p = (char const *) src;
+    int first = iov[0].iov_len - off;
+    if (first > 0) {
+        if (first > len) first = len;
+        memcpy((char *) iov[0].iov_base + off, p, first);
+        p += first;
+        len -= first;
+        off = 0;
+    } else {
+        off -= iov[0].iov_len;
+    }
+    if (len > 0) memcpy((char *) iov[1].iov_base + off, p, len);
+}
 
-    pthread_mutex_unlock(&q->mutex);
-    
-    pthread_cond_signal(&q->can_prod);
-    return 0;
+void queue_span_get(struct iovec const iov[2], int off, void *dst, int len) {
+    char *p = (char *) dst;
+    int first = iov[0].iov_len - off;
+    if (first > 0) {
+        if (first > len) first = len;
+        memcpy(p, (char const *) iov[0].iov_base + off, first);
+        p += first;
+        len -= first;
+        off = 0;
+    } else {
+        off -= iov[0].iov_len;
+    }
+    if (len > 0) memcpy(p, (char const *) iov[1].iov_base + off, len);
 }
@@ -2,29 +2,89 @@
 #define QUEUE_H 1
 
 #include <pthread.h>
+#include <stdatomic.h>
+#include <sys/uio.h>
+
+//Every queue in this program has exactly one producer thread and one consumer
+//thread, so the data path is lock-free: the producer only ever writes wr_pos,
+//the consumer only ever writes rd_pos, and they live on separate cache lines
+//so the two threads don't fight over them. The mutex and condvars are only
+//touched when a thread actually has to go to sleep (queue empty or full) or
+//when someone changes the number of producers/consumers.
+
+//Quick and dirty; don't bother with dynamic allocation. This MUST be a power
+//of two, since the positions are free-running counters
+#define BUF_SIZE 2048
+#define QUEUE_CACHE_LINE 64
+
+//Build with -DQUEUE_STATS_ON to count how often each side had to go looking
+//at the other side's position, went to sleep, or woke the other side up.
+//Each counter is only written by one thread, and lives on that thread's
+//cache line. Without it, these cost nothing
+#ifdef QUEUE_STATS_ON
+#define QUEUE_STAT(q, name) ((q)->name++)
+#else
+#define QUEUE_STAT(q, name) ((void) 0)
+#endif
 
-//Quick and dirty; don't bother with dynamic allocation
-#define BUF_SIZE 2048 
 typedef struct {
-    char buf[BUF_SIZE];
-    int wr_pos, rd_pos;
-    int empty;
-    int full;
-    pthread_mutex_t mutex;
+    //Written only by the producer. wr_pos counts total bytes ever written (so
+    //the index into buf is wr_pos % BUF_SIZE). rd_cache is the producer's
+    //last look at rd_pos, so it doesn't have to touch the consumer's cache
+    //line on every write
+    _Atomic unsigned wr_pos __attribute__((aligned(QUEUE_CACHE_LINE)));
+    unsigned rd_cache;
+    _Atomic int prod_waiting;
+    //Always kept, so anyone can look at them while we run: how many times
+    //the producer found the queue full and had to sleep, and for how long
+    _Atomic unsigned long long prod_blocks;
+    _Atomic unsigned long long prod_blocked_ns;
+#ifdef QUEUE_STATS_ON
+    unsigned long long rd_refreshes; //Had to load rd_pos
+    unsigned long long prod_sleeps; //Queue was full; went to sleep
+    unsigned long long cons_wakeups; //Signalled a sleeping consumer
+#endif
+
+    //Written only by the consumer. Same idea as above
+    _Atomic unsigned rd_pos __attribute__((aligned(QUEUE_CACHE_LINE)));
+    unsigned wr_cache;
+    _Atomic int cons_waiting;
+    //Also always kept: the most bytes the consumer has ever seen in the queue
+    _Atomic unsigned occ_hwm;
+#ifdef QUEUE_STATS_ON
+    unsigned long long wr_refreshes; //Had to load wr_pos
+    unsigned long long cons_sleeps; //Queue was empty; went to sleep
+    unsigned long long prod_wakeups; //Signalled a sleeping producer
+#endif
+
+    //Slow path stuff
+    pthread_mutex_t mutex __attribute__((aligned(QUEUE_CACHE_LINE)));
     pthread_cond_t can_prod;
     pthread_cond_t can_cons;
-    int num_producers;
-    int num_consumers;
+    _Atomic int num_producers;
+    _Atomic int num_consumers;
+
+    char buf[BUF_SIZE] __attribute__((aligned(QUEUE_CACHE_LINE)));
 } queue;
 
-#define PTR_QUEUE_OCCUPANCY(q) ((q)->full ? BUF_SIZE : ((BUF_SIZE + (q)->wr_pos - (q)->rd_pos) % BUF_SIZE))
+#define PTR_QUEUE_OCCUPANCY(q) ((int) (atomic_load(&(q)->wr_pos) - atomic_load(&(q)->rd_pos)))
 #define PTR_QUEUE_VACANCY(q) (BUF_SIZE - PTR_QUEUE_OCCUPANCY(q))
 
+//Free-running byte positions: how much has ever been written/read. The
+//producer (consumer) can always get the exact write (read) position this way
+#define QUEUE_WR_POS(q) atomic_load_explicit(&(q)->wr_pos, memory_order_relaxed)
+#define QUEUE_RD_POS(q) atomic_load_explicit(&(q)->rd_pos, memory_order_relaxed)
+
 #define QUEUE_INITIALIZER {\
     .wr_pos = 0,\
+    .rd_cache = 0,\
+    .prod_waiting = 0,\
+    .prod_blocks = 0,\
+    .prod_blocked_ns = 0,\
     .rd_pos = 0,\
-    .empty = 1,\
-    .full = 0,\
+    .wr_cache = 0,\
+    .cons_waiting = 0,\
+    .occ_hwm = 0,\
     .mutex = PTHREAD_MUTEX_INITIALIZER,\
     .can_prod = PTHREAD_COND_INITIALIZER,\
     .can_cons = PTHREAD_COND_INITIALIZER,\
@@ -32,34 +92,79 @@ typedef struct {
     .num_consumers = 0\
 }
 
+//Adds delta (which can be negative) to the number of producers/consumers, and
+//wakes up anyone sleeping on the queue so they notice the change. Readers fail
+//once there are no producers, and writers fail once there are no consumers.
+//These lock (and unlock) mutexes, so don't call while holding any mutexes
+void queue_add_producers(queue *q, int delta);
+void queue_add_consumers(queue *q, int delta);
+
+//Same as above, but sets the count outright. Setting the number of producers
+//to -1 is the way to tell a consumer to quit even though a producer is still
+//running
+void queue_set_producers(queue *q, int n);
+
 //Adds a char to queue q in a thread-safe way. Returns 0 on successful write,
 //negative on error. This function can sleep; do not call while holding _any_
-//mutexes, not even the one in the struct! 
+//mutexes, not even the one in the struct!
 int enqueue_single(queue *q, char c);
 
-//Waits until len spaces are free in the queue, then writes all at once. I have 
-//not written any scheduling code, so there are cases where one producer could
-//starve another. Returns 0 on success, negative otherwise
+//Waits until len spaces are free in the queue, then writes all at once. Only
+//one thread may write to a queue. Returns 0 on success, negative otherwise
 int queue_write(queue *q, char *buf, int len);
 
 //Reads a char from queue q in a thread-safe way. Returns 0 on successful read,
 //-1 if no producers. This function can sleep; do not call while holding _any_
-//mutexes, not even the one in the struct! 
+//mutexes, not even the one in the struct!
 int dequeue_single(queue *q, char *c);
 
 //Reads n bytes from queue q in a thread-safe way. Returns 0 on successful read,
-//and -1 on error (no producers). This function  locks (and unlocks) mutexes, so 
+//and -1 on error (no producers). This function  locks (and unlocks) mutexes, so
 //don't call while holding any mutexes
 int dequeue_n(queue *q, char *buf, int n);
 
 //Reads a char from queue q in a thread-safe way. Returns 0 on successful read,
-//1 if there was nothing to read, -1 on error (no producers). This function 
-//locks (and unlocks) mutexes, so don't call while holding any mutexes
+//1 if there was nothing to read, -1 on error (no producers). Never sleeps
 int nb_dequeue_single(queue *q, char *c);
 
 //Reads n bytes from queue q in a thread-safe way. Returns 0 on successful read,
-//1 if there was nothing to read, -1 on error (no producers). This function 
-//locks (and unlocks) mutexes, so don't call while holding any mutexes
+//1 if there was nothing to read, -1 on error (no producers). Never sleeps
 int nb_dequeue_n(queue *q, char *buf, int n);
 
+//Waits until there is at least one byte in the queue, then reads everything
+//that is available (but no more than max bytes) in one go. Returns the number
+//of bytes read, or -1 on error (no producers). This function locks (and
+//unlocks) mutexes, so don't call while holding any mutexes
+int dequeue_avail(queue *q, char *buf, int max);
+
+//Zero-copy API. Instead of copying into or out of the queue, these hand you
+//the queue's own storage as (at most) two spans: iov[0] goes up to the end of
+//the buffer and iov[1] is the part that wrapped around to the beginning (its
+//length is 0 if nothing wrapped). This means you can pass iov straight to 
+//readv() or writev().
+//
+//queue_reserve_write waits until at least min bytes are free, then gives you
+//all the free space (but no more than max bytes). Nothing is visible to the
+//consumer until you call queue_commit_write with the number of bytes you 
+//actually filled, which can be less than what was reserved. Returns the 
+//number of bytes reserved, or -1 if there are no consumers.
+int queue_reserve_write(queue *q, int min, int max, struct iovec iov[2]);
+void queue_commit_write(queue *q, int len);
+
+//queue_peek_read waits until at least min bytes are in the queue, then gives
+//you all of them (but no more than max bytes) without removing them. Call 
+//queue_release_read with the number of bytes you actually used up, which can 
+//be less than what was peeked. Returns the number of bytes peeked, or -1 if 
+//there are no producers.
+//
+//Both of these can sleep; do not call while holding any mutexes
+int queue_peek_read(queue *q, int min, int max, struct iovec iov[2]);
+void queue_release_read(queue *q, int len);
+
+//For treating the two spans as one buffer: copies len bytes into (or out of)
+//them, starting off bytes in. Useful for things like headers, which can
+//straddle the wraparound
+void queue_span_put(struct iovec iov[2], int off, void const *src, int len);
+void queue_span_get(struct iovec const iov[2], int off, void *dst, int len);
+
 #endif
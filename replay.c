@@ -0,0 +1,215 @@
+#define _GNU_SOURCE             /* See feature_test_macros(7) */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <ctype.h>
+#include <time.h>
+#include "replay.h"
+
+int replay_record_open(replay_recorder *r, char const *path) {
+    r->fp = fopen(path, "wb");
+    if (r->fp == NULL) {
+        fprintf(stderr, "Could not open recording %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    replay_file_hdr hdr = {
+        .magic = REPLAY_MAGIC,
+        .version = REPLAY_VERSION
+    };
+    if (fwrite(&hdr, sizeof(hdr), 1, r->fp) != 1) {
+        fprintf(stderr, "Could not write recording %s: %s\n", path, strerror(errno));
+        fclose(r->fp);
+        return -1;
+    }
+    return 0;
+}
+
+void replay_record(replay_recorder *r, unsigned const *words, int n) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    replay_rec rec = {
+        .t_ns = (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec,
+        .words = n,
+        .reserved = 0
+    };
+    fwrite(&rec, sizeof(rec), 1, r->fp);
+    fwrite(words, sizeof(unsigned), n, r->fp);
+}
+
+void replay_record_close(replay_recorder *r) {
+    fclose(r->fp);
+}
+
+//Reads all of path into a malloced buffer. Returns its length, or -1 on error
+static long read_file(char const *path, unsigned char **buf) {
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL) {
+        fprintf(stderr, "Could not open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    long len = -1;
+    if (fseek(fp, 0, SEEK_END) == 0) len = ftell(fp);
+    rewind(fp);
+    *buf = (len >= 0) ? malloc(len + 1) : NULL;
+    if (*buf == NULL || fread(*buf, 1, len, fp) != len) {
+        fprintf(stderr, "Could not read %s\n", path);
+        free(*buf);
+        len = -1;
+    } else {
+        (*buf)[len] = '\0'; //So the text parser can use strtoul
+    }
+    fclose(fp);
+    return len;
+}
+
+//Makes room for one more packet, and max_words more words
+static int grow(replay_script *s, int *pkt_cap, unsigned long long *word_cap, unsigned long long max_words) {
+    if (s->num_pkts == *pkt_cap) {
+        int cap = *pkt_cap ? *pkt_cap * 2 : 256;
+        replay_pkt *p = realloc(s->pkts, cap * sizeof(replay_pkt));
+        if (p == NULL) return -1;
+        s->pkts = p;
+        *pkt_cap = cap;
+    }
+    if (s->num_words + max_words > *word_cap) {
+        unsigned long long cap = *word_cap ? *word_cap * 2 : 4096;
+        while (cap < s->num_words + max_words) cap *= 2;
+        unsigned *w = realloc(s->words, cap * sizeof(unsigned));
+        if (w == NULL) return -1;
+        s->words = w;
+        *word_cap = cap;
+    }
+    return 0;
+}
+
+static int load_recording(replay_script *s, unsigned char const *buf, long len) {
+    int pkt_cap = 0;
+    unsigned long long word_cap = 0;
+    uint64_t t0 = 0;
+    long pos = sizeof(replay_file_hdr);
+
+    while (pos < len) {
+        replay_rec rec;
+        if (len - pos < sizeof(rec)) break;
+        memcpy(&rec, buf + pos, sizeof(rec));
+        pos += sizeof(rec);
+        long bytes = (long) rec.words * sizeof(unsigned);
+        if (len - pos < bytes) break;
+        if (rec.words == 0 || rec.words > REPLAY_MAX_WORDS) {
+            fprintf(stderr, "Packet %d in %s has %u words; we can only replay 1 to %d\n",
+                s->num_pkts, s->path, rec.words, REPLAY_MAX_WORDS);
+            return -1;
+        }
+        if (grow(s, &pkt_cap, &word_cap, rec.words) < 0) return -2;
+
+        if (s->num_pkts == 0) t0 = rec.t_ns;
+        s->pkts[s->num_pkts] = (replay_pkt) {
+            .t_ns = rec.t_ns - t0,
+            .off = s->num_words,
+            .words = rec.words
+        };
+        memcpy(s->words + s->num_words, buf + pos, bytes);
+        pos += bytes;
+        s->num_words += rec.words;
+        s->num_pkts++;
+    }
+
+    //We might have been killed halfway through writing the last record
+    if (pos < len) {
+        fprintf(stderr, "Warning: ignoring %ld bytes of partial packet at the end of %s\n", len - pos, s->path);
+    }
+    s->timed = 1;
+    return 0;
+}
+
+static int load_text(replay_script *s, char *buf) {
+    int pkt_cap = 0;
+    unsigned long long word_cap = 0;
+    int line_num = 0;
+    char *line = buf;
+
+    while (line != NULL && *line != '\0') {
+        line_num++;
+        char *next = strchr(line, '\n');
+        if (next != NULL) *next++ = '\0';
+        char *hash = strchr(line, '#');
+        if (hash != NULL) *hash = '\0';
+
+        if (grow(s, &pkt_cap, &word_cap, REPLAY_MAX_WORDS) < 0) return -2;
+        unsigned *dst = s->words + s->num_words;
+        int n = 0;
+        char *p = line;
+        while (1) {
+            while (isspace((unsigned char) *p) || *p == ',') p++;
+            if (*p == '\0') break;
+            if (n == REPLAY_MAX_WORDS) {
+                fprintf(stderr, "Line %d of %s has more than %d words\n", line_num, s->path, REPLAY_MAX_WORDS);
+                return -1;
+            }
+            char *end;
+            errno = 0;
+            unsigned long v = strtoul(p, &end, 0);
+            if (end == p || errno != 0 || v > 0xFFFFFFFFUL || !(*end == '\0' || *end == ',' || isspace((unsigned char) *end))) {
+                fprintf(stderr, "Line %d of %s: [%.*s] is not a 32-bit word\n", line_num, s->path, (int) strcspn(p, " \t\r,"), p);
+                return -1;
+            }
+            dst[n++] = v;
+            p = end;
+        }
+
+        if (n > 0) {
+            s->pkts[s->num_pkts++] = (replay_pkt) {
+                .t_ns = 0,
+                .off = s->num_words,
+                .words = n
+            };
+            s->num_words += n;
+        }
+        line = next;
+    }
+
+    s->timed = 0;
+    return 0;
+}
+
+int replay_load(replay_script *s, char const *path) {
+    *s = (replay_script) {0};
+    snprintf(s->path, sizeof(s->path), "%s", path);
+
+    unsigned char *buf;
+    long len = read_file(path, &buf);
+    if (len < 0) return -1;
+
+    replay_file_hdr hdr;
+    int rc;
+    if (len >= sizeof(hdr) && (memcpy(&hdr, buf, sizeof(hdr)), hdr.magic == REPLAY_MAGIC)) {
+        if (hdr.version != REPLAY_VERSION) {
+            fprintf(stderr, "%s is a version %u recording; we only know version %d\n", path, hdr.version, REPLAY_VERSION);
+            rc = -1;
+        } else {
+            rc = load_recording(s, buf, len);
+        }
+    } else {
+        rc = load_text(s, (char*) buf);
+    }
+    free(buf);
+
+    if (rc == 0 && s->num_pkts == 0) {
+        fprintf(stderr, "Nothing to replay in %s\n", path);
+        rc = -1;
+    }
+    if (rc == -2) fprintf(stderr, "Out of memory loading %s\n", path);
+    if (rc < 0) {
+        replay_free(s);
+        return -1;
+    }
+    return 0;
+}
+
+void replay_free(replay_script *s) {
+    free(s->words);
+    free(s->pkts);
+    s->words = NULL;
+    s->pkts = NULL;
+}
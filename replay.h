@@ -0,0 +1,76 @@
+#ifndef REPLAY_H
+#define REPLAY_H 1
+
+#include <stdio.h>
+#include <stdint.h>
+
+//Recording (-k) and replaying (-X) commands, so that a regression run can
+//send the same commands over and over without a client in the loop.
+//
+//A recording holds every packet fifo_tx sent to the TX FIFO, with the time
+//it went out. It starts with a replay_file_hdr, then for each packet a
+//replay_rec followed by that many 32-bit words. Everything is in the
+//server's byte order.
+//
+//We can also replay a text file: each line is one packet, made of words
+//separated by spaces or commas (C syntax, so 0x for hex). '#' starts a
+//comment, and blank lines are ignored. These have no timing, so they always
+//go out as fast as the TX FIFO takes them.
+
+#define REPLAY_MAGIC 0x43524744 //"DGRC" when read little-endian
+#define REPLAY_VERSION 1
+
+//Biggest packet we'll replay. The TX FIFO has to be at least this deep to
+//replay one this big
+#define REPLAY_MAX_WORDS 512
+
+typedef struct _replay_file_hdr {
+    uint32_t magic;
+    uint32_t version;
+} replay_file_hdr;
+
+typedef struct _replay_rec {
+    uint64_t t_ns; //CLOCK_MONOTONIC when it was sent
+    uint32_t words;
+    uint32_t reserved; //Set to 0
+} replay_rec;
+
+//Only one thread may write to a recording
+typedef struct _replay_recorder {
+    FILE *fp;
+} replay_recorder;
+
+//Creates (or overwrites) path. Returns 0 on success, or -1 on error (and
+//prints why)
+int replay_record_open(replay_recorder *r, char const *path);
+
+//Adds a packet of n words that was just sent. This goes through stdio, so it
+//only touches the disk every few kB
+void replay_record(replay_recorder *r, unsigned const *words, int n);
+
+void replay_record_close(replay_recorder *r);
+
+//One packet of a loaded file
+typedef struct _replay_pkt {
+    uint64_t t_ns; //Since the first packet (always 0 for text files)
+    unsigned off; //Index of its first word in replay_script.words
+    unsigned words;
+} replay_pkt;
+
+//A whole file, loaded up front so that reading it never holds up the TX FIFO
+typedef struct _replay_script {
+    char path[256];
+    unsigned *words;
+    replay_pkt *pkts;
+    int num_pkts;
+    unsigned long long num_words;
+    int timed; //Nonzero if the file had timestamps
+} replay_script;
+
+//Reads path, which can be a recording or a text file. Returns 0 on success,
+//or -1 if it can't be read or has a packet we can't send (and prints why)
+int replay_load(replay_script *s, char const *path);
+
+void replay_free(replay_script *s);
+
+#endif
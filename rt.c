@@ -0,0 +1,139 @@
+#define _GNU_SOURCE             /* See feature_test_macros(7) */
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "rt.h"
+
+//Stack size for every thread once memory is locked. Our threads don't
+//recurse or keep much on the stack (the biggest thing is a 2 KB buffer)
+#define RT_STACK_SIZE (256*1024)
+
+typedef struct _rt_rule {
+    char name[16];
+    int cpu; //-1 to leave affinity alone
+    int prio; //0 to stay SCHED_OTHER
+} rt_rule;
+
+static rt_rule rules[RT_MAX_RULES];
+static int num_rules = 0;
+
+//Parses NAME=CPU[:PRIO]
+int rt_add_rule(char const *spec) {
+    if (num_rules >= RT_MAX_RULES) {
+        fprintf(stderr, "Error: can't have more than %d thread rules\n", RT_MAX_RULES);
+        return -1;
+    }
+    rt_rule *r = &rules[num_rules];
+
+    char const *eq = strchr(spec, '=');
+    if (eq == NULL || eq == spec || eq - spec >= sizeof(r->name)) {
+        fprintf(stderr, "Error: thread rule [%s] should look like NAME=CPU[:PRIO]\n", spec);
+        return -1;
+    }
+    memcpy(r->name, spec, eq - spec);
+    r->name[eq - spec] = '\0';
+
+    char const *cpu_str = eq + 1;
+    char const *colon = strchr(cpu_str, ':');
+    r->cpu = -1;
+    r->prio = 0;
+
+    if (cpu_str[0] == '-' && (cpu_str[1] == '\0' || cpu_str[1] == ':')) {
+        //Leave affinity alone
+    } else if (sscanf(cpu_str, "%d", &r->cpu) != 1 || r->cpu < 0 || r->cpu >= CPU_SETSIZE) {
+        fprintf(stderr, "Error: could not parse CPU in thread rule [%s]\n", spec);
+        return -1;
+    }
+
+    if (colon != NULL) {
+        int min = sched_get_priority_min(SCHED_FIFO);
+        int max = sched_get_priority_max(SCHED_FIFO);
+        if (sscanf(colon + 1, "%d", &r->prio) != 1 || r->prio < min || r->prio > max) {
+            fprintf(stderr, "Error: priority in thread rule [%s] must be between %d and %d\n", spec, min, max);
+            return -1;
+        }
+    }
+
+    num_rules++;
+    return 0;
+}
+
+//Locks all our memory and shrinks thread stacks
+int rt_lock_memory(void) {
+    int ret = 0;
+
+    //New threads get a small stack. Since we're about to lock all future
+    //mappings, each stack gets faulted in (and locked) as soon as it's
+    //created, so none of our threads ever take a page fault on one
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    int rc = pthread_attr_setstacksize(&attr, RT_STACK_SIZE);
+    if (rc == 0) rc = pthread_setattr_default_np(&attr);
+    if (rc != 0) {
+        fprintf(stderr, "Warning: could not set default thread stack size: %s\n", strerror(rc));
+        ret = -1;
+    }
+    pthread_attr_destroy(&attr);
+
+    //MCL_CURRENT faults in (and locks) everything we have now, including the
+    //static channel array and its queues. MCL_FUTURE does the same for
+    //anything we map later, like the flit rings and thread stacks
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+        fprintf(stderr, "Warning: could not lock memory: %s (check ulimit -l)\n", strerror(errno));
+        ret = -1;
+    }
+
+    return ret;
+}
+
+//Finds the rule for a thread name, or NULL if there isn't one
+static rt_rule *find_rule(char const *name) {
+    int i;
+    for (i = 0; i < num_rules; i++) {
+        if (!strcmp(rules[i].name, name)) return &rules[i];
+    }
+
+    //Try again without the channel number
+    int len = strlen(name);
+    while (len > 0 && isdigit((unsigned char) name[len - 1])) len--;
+    for (i = 0; i < num_rules; i++) {
+        if (strlen(rules[i].name) == len && !strncmp(rules[i].name, name, len)) return &rules[i];
+    }
+
+    return NULL;
+}
+
+//Applies whatever rule matches name to the thread
+void rt_apply(pthread_t thread, char const *name) {
+    rt_rule *r = find_rule(name);
+    if (r == NULL) return;
+
+    if (r->cpu >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(r->cpu, &cpus);
+        int rc = pthread_setaffinity_np(thread, sizeof(cpus), &cpus);
+        if (rc != 0) {
+            fprintf(stderr, "Warning: could not pin %s to CPU %d: %s\n", name, r->cpu, strerror(rc));
+        }
+    }
+
+    if (r->prio > 0) {
+        struct sched_param param = {
+            .sched_priority = r->prio
+        };
+        int rc = pthread_setschedparam(thread, SCHED_FIFO, &param);
+        if (rc != 0) {
+            fprintf(stderr, "Warning: could not give %s SCHED_FIFO priority %d: %s\n", name, r->prio, strerror(rc));
+        }
+    }
+
+#ifdef DEBUG_ON
+    fprintf(stderr, "Applied thread rule %s=%d:%d to %s\n", r->name, r->cpu, r->prio, name);
+    fflush(stderr);
+#endif
+}
@@ -0,0 +1,37 @@
+#ifndef RT_H
+#define RT_H 1
+
+#include <pthread.h>
+
+//Real-time knobs for deployments where a stall in fifo_mgr means the
+//hardware FIFO overflows. You give rules like "fifo_mgr=2:80" (pin threads
+//called fifo_mgr to CPU 2 and run them SCHED_FIFO at priority 80), and
+//whoever starts a thread calls rt_apply right after naming it.
+//
+//A rule matches a thread by its exact name, or by its name minus the channel
+//number on the end (so "fifo_mgr" covers fifo_mgr0, fifo_mgr1, ...). If
+//several channels' threads match one rule, they all land on the same CPU.
+//
+//Careful with SCHED_FIFO on threads that spin: a thread that never sleeps
+//will starve everything else on its CPU. Use a poll policy that sleeps (-P)
+//or interrupts, or give it a CPU of its own.
+
+#define RT_MAX_RULES 32
+
+//Parses NAME=CPU[:PRIO] and adds it to the list. CPU can be "-" to leave
+//the affinity alone, and PRIO is a SCHED_FIFO priority (leave it off to stay
+//SCHED_OTHER). Returns 0 on success, -1 on error
+int rt_add_rule(char const *spec);
+
+//Locks all our memory (now and in the future) so we never take a page fault
+//on the data path, and shrinks the default thread stack size so that every
+//thread's stack can be locked without eating the whole board's RAM. Call
+//this before allocating anything big or starting any threads. Returns 0 on
+//success, -1 on error (after logging what went wrong)
+int rt_lock_memory(void);
+
+//Applies whatever rule matches name to the thread. Logs anything that
+//couldn't be applied, but otherwise leaves the thread running as it was
+void rt_apply(pthread_t thread, char const *name);
+
+#endif
@@ -0,0 +1,231 @@
+#define _GNU_SOURCE             /* See feature_test_macros(7) */
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include "axistreamfifo.h"
+#include "rtc.h"
+#include "poll_policy.h"
+
+//Quick and dirty; one pollfd per FIFO pair
+#define RTC_MAX_CHANS 64
+
+//Finishes off a FIFO pair
+static void rtc_finish(rtc_info *ch) {
+#ifdef DEBUG_ON
+    fprintf(stderr, "Run-to-completion channel finished\n");
+    fflush(stderr);
+#endif
+    if (ch->client_sfd != -1) close(ch->client_sfd);
+    ch->client_sfd = -1;
+    ch->done = 1;
+}
+
+//Sends as many whole command words as the TX FIFO will take. Returns the
+//number of words sent, or -1 on error
+static int rtc_send_cmds(rtc_info *ch) {
+    int words = ch->cmds_len / sizeof(unsigned);
+    int sent = 0;
+
+    if (ch->tx_burst) {
+        while (sent < words) {
+            int rc = send_words_burst(ch->tx_fifo, ch->cmds + sent, words - sent, &ch->tx_vcy);
+            if (rc < 0) {
+                if (rc == -E_ERR_IRQ) STATS_ADD(ch->stats, tx_errs, 1);
+                fprintf(stderr, "Could not write to TX FIFO: %s\n", asfifo_strerror(rc));
+                return -1;
+            }
+            if (rc == 0) {
+                //FIFO is full; try again next time around
+                STATS_ADD(ch->stats, tx_full, 1);
+                break;
+            }
+            STATS_ADD(ch->stats, tx_pkts, 1);
+            sent += rc;
+        }
+    } else {
+        //One packet per word, same as fifo_tx
+        while (sent < words) {
+            int rc = send_words(ch->tx_fifo, ch->cmds + sent, 1);
+            if (rc == -E_TX_FIFO_NO_ROOM) {
+                STATS_ADD(ch->stats, tx_full, 1);
+                break;
+            }
+            if (rc < 0) {
+                if (rc == -E_ERR_IRQ) STATS_ADD(ch->stats, tx_errs, 1);
+                fprintf(stderr, "Could not write to TX FIFO: %s\n", asfifo_strerror(rc));
+                return -1;
+            }
+            STATS_ADD(ch->stats, tx_pkts, 1);
+            sent++;
+        }
+    }
+
+    if (sent > 0) {
+        STATS_ADD(ch->stats, tx_words, sent);
+        int left = ch->cmds_len - sent*sizeof(unsigned);
+        memmove(ch->cmds, ch->cmds + sent, left);
+        ch->cmds_len = left;
+    }
+    return sent;
+}
+
+//Does one round of work on one FIFO pair, using the poll() results for its
+//client socket. Returns how much work got done (0 means nothing happened),
+//or -1 if this pair is finished
+static int rtc_step(rtc_info *ch, short revents) {
+    int work = 0;
+
+    //Drain the RX FIFO, but only once everything we read last time is sent
+    if (ch->flits_len == 0) {
+        int len = read_packet(ch->rx_fifo, ch->rx_mode, ch->flits, RTC_BUF_WORDS, &ch->rx_state);
+        if (len < 0) {
+            if (len == -E_ERR_IRQ) STATS_ADD(ch->stats, rx_errs, 1);
+            fprintf(stderr, "Could not read from RX FIFO: %s\n", asfifo_strerror(len));
+            return -1;
+        } else if (len > 0) {
+            STATS_ADD(ch->stats, rx_flits, len);
+            STATS_ADD(ch->stats, rx_reads, 1);
+            if (ch->capture != NULL) {
+                capture_put(ch->capture, ch->flits, len * sizeof(unsigned));
+                capture_commit(ch->capture);
+            }
+        } else {
+            STATS_ADD(ch->stats, rx_polls_empty, 1);
+        }
+        ch->flits_off = 0;
+        ch->flits_len = len * sizeof(unsigned);
+        work += len;
+    }
+
+    //Send flits. Don't wait for poll() to tell us there's room: the socket
+    //is almost always writable, and this saves a trip around the loop
+    if (ch->flits_len > 0) {
+        int len = ch->flits_len;
+        if (len > ch->batch_size) len = ch->batch_size;
+        int rc = send(ch->client_sfd, (char*) ch->flits + ch->flits_off, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (rc < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            return -1;
+        } else if (rc > 0) {
+            STATS_ADD(ch->stats, sock_tx_bytes, rc);
+            STATS_ADD(ch->stats, sock_writes, 1);
+            if (rc < len) STATS_ADD(ch->stats, sock_short_writes, 1);
+            ch->flits_off += rc;
+            ch->flits_len -= rc;
+            work++;
+        }
+    }
+
+    //Read commands, if there are any and we have room for them
+    if ((revents & (POLLIN | POLLHUP | POLLERR)) && ch->cmds_len < sizeof(ch->cmds)) {
+        int rc = recv(ch->client_sfd, (char*) ch->cmds + ch->cmds_len, sizeof(ch->cmds) - ch->cmds_len, MSG_DONTWAIT);
+        if (rc == 0) {
+            //Client disconnected
+            return -1;
+        } else if (rc < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            return -1;
+        } else if (rc > 0) {
+            STATS_ADD(ch->stats, sock_rx_bytes, rc);
+            STATS_ADD(ch->stats, sock_reads, 1);
+            ch->cmds_len += rc;
+            work++;
+        }
+    }
+
+    //Send whatever whole commands we have
+    if (ch->cmds_len >= sizeof(unsigned)) {
+        int rc = rtc_send_cmds(ch);
+        if (rc < 0) return -1;
+        work += rc;
+    }
+
+    return work;
+}
+
+void *rtc_loop(void *arg) {
+#ifdef DEBUG_ON
+    fprintf(stderr, "Entered run-to-completion loop\n");
+    fflush(stderr);
+#endif
+    rtc_loop_info *info = (rtc_loop_info*) arg;
+    struct pollfd pfds[RTC_MAX_CHANS];
+
+    if (info->num_chans > RTC_MAX_CHANS) {
+        fprintf(stderr, "Run-to-completion mode can't handle more than %d FIFO pairs\n", RTC_MAX_CHANS);
+        pthread_exit(NULL);
+    }
+
+    //We poll the listening sockets too, so they have to be non-blocking
+    int i;
+    for (i = 0; i < info->num_chans; i++) {
+        rtc_info *ch = info->chans[i];
+        if (listen(ch->server_sfd, 1) < 0) {
+            perror("Could not listen on socket");
+            ch->done = 1;
+            continue;
+        }
+        fcntl(ch->server_sfd, F_SETFL, fcntl(ch->server_sfd, F_GETFL) | O_NONBLOCK);
+    }
+
+    poll_policy pp;
+    poll_policy_init(&pp, info->poll_cfg);
+
+    int num_alive;
+    do {
+        //One syscall to find out about every socket. A pair that's finished
+        //gets fd -1, which poll() ignores
+        for (i = 0; i < info->num_chans; i++) {
+            rtc_info *ch = info->chans[i];
+            pfds[i].events = POLLIN;
+            pfds[i].revents = 0;
+            if (ch->done) pfds[i].fd = -1;
+            else if (ch->client_sfd == -1) pfds[i].fd = ch->server_sfd;
+            else pfds[i].fd = ch->client_sfd;
+        }
+        if (poll(pfds, info->num_chans, 0) < 0 && errno != EINTR) {
+            perror("poll failed");
+            break;
+        }
+
+        int total = 0;
+        num_alive = 0;
+        for (i = 0; i < info->num_chans; i++) {
+            rtc_info *ch = info->chans[i];
+            if (ch->done) continue;
+            num_alive++;
+
+            if (ch->client_sfd == -1) {
+                //Still waiting for a client. Until one shows up, leave the
+                //RX FIFO alone and let the flits back up in hardware
+                if (!(pfds[i].revents & POLLIN)) continue;
+                ch->client_sfd = accept4(ch->server_sfd, NULL, NULL, SOCK_NONBLOCK);
+                if (ch->client_sfd < 0) {
+                    ch->client_sfd = -1;
+                    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR || errno == ECONNABORTED) continue;
+                    perror("Could not accept incoming connection");
+                    rtc_finish(ch);
+                    continue;
+                }
+                total++;
+                continue;
+            }
+
+            int rc = rtc_step(ch, pfds[i].revents);
+            if (rc < 0) rtc_finish(ch);
+            else total += rc;
+        }
+
+        if (total > 0) poll_policy_busy(&pp);
+        else poll_policy_idle(&pp);
+    } while (num_alive > 0);
+
+    poll_policy_print(&pp, "rtc");
+
+    pthread_exit(NULL);
+}
@@ -0,0 +1,72 @@
+#ifndef RTC_H
+#define RTC_H 1
+
+#include "axistreamfifo.h"
+#include "poll_policy.h"
+#include "stats.h"
+#include "capture.h"
+
+//Run-to-completion mode. Instead of four threads and two queues per FIFO
+//pair, a single thread loops over every pair: it drains the RX FIFO straight
+//into the client's socket, and reads the client's socket straight into the
+//TX FIFO. Sockets are non-blocking and checked with a zero-timeout poll()
+//between hardware polls, so the thread never sleeps while there is work
+//(what it does when there isn't any is up to the poll policy).
+//
+//Just like the normal mode, each pair takes one client, and is finished
+//once that client disconnects.
+
+//How much we read out of the RX FIFO (or the socket) in one go
+#define RTC_BUF_WORDS 512
+
+typedef struct _rtc_info {
+    //Never modified by the thread
+    int server_sfd;
+    volatile AXIStream_FIFO *rx_fifo;
+    asfifo_mode_t rx_mode;
+    volatile AXIStream_FIFO *tx_fifo;
+    int tx_burst; //If nonzero, send commands in multi-word packets
+    int batch_size; //Max number of bytes of flits per send()
+    capture_file *capture; //If not NULL, flits also get saved here (-C)
+    pipe_stats *stats;
+
+    //Only touched by the thread
+    int client_sfd;
+    int done;
+    rw_state_t rx_state;
+    unsigned tx_vcy; //Cached TX FIFO vacancy, for burst mode
+
+    //Flits we read out of the FIFO but couldn't send yet. We don't read any
+    //more out of the FIFO until these are gone
+    unsigned flits[RTC_BUF_WORDS];
+    int flits_off; //In bytes
+    int flits_len; //In bytes
+
+    //Commands from the client that haven't gone to the TX FIFO yet. Might end
+    //with a partial word
+    unsigned cmds[RTC_BUF_WORDS];
+    int cmds_len; //In bytes
+} rtc_info;
+
+#define RTC_INFO_INITIALIZER { \
+    .server_sfd = -1, \
+    .client_sfd = -1, \
+    .done = 0, \
+    .rx_state = RW_STATE_INITIALIZER, \
+    .tx_vcy = 0, \
+    .flits_off = 0, \
+    .flits_len = 0, \
+    .cmds_len = 0 \
+}
+
+typedef struct _rtc_loop_info {
+    rtc_info **chans;
+    int num_chans;
+    poll_policy_cfg const *poll_cfg;
+} rtc_loop_info;
+
+//Serves every FIFO pair in arg (an rtc_loop_info) from this one thread.
+//Quits once all of them are finished
+void *rtc_loop(void *arg);
+
+#endif
@@ -0,0 +1,51 @@
+#ifndef SESSION_H
+#define SESSION_H 1
+
+//Wire format for the session handshake (see -S in dbg_guv_server.c). This
+//header doesn't depend on anything else, so clients can just include it.
+//
+//When sessions are on, the first thing a client sends is a session_hello.
+//The server answers with a session_ack, and after that the connection looks
+//exactly like it always did: flits one way, commands the other.
+//
+//Every flit has a sequence number, which is just how many flits came before
+//it since the server started. The first flit after the ack has sequence
+//number ack.start_seq, and they go up by one from there. If the connection
+//drops, reconnect with SESSION_RESUME and resume_seq set to one past the last
+//flit you got, and you'll get everything you missed (as long as the server
+//still has it; see -R).
+//
+//Everything is in the server's byte order (little-endian on all our boards),
+//just like the flits themselves.
+
+#include <stdint.h>
+
+#define SESSION_MAGIC 0x56534744 //"DGSV" when sent little-endian
+#define SESSION_VERSION 1
+
+//Flags in session_hello.flags. The server echoes back the ones it honoured
+#define SESSION_RESUME (1<<0) //Start at resume_seq instead of the newest flits
+
+typedef struct _session_hello {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t flags;
+    uint32_t reserved; //Set to 0
+    uint64_t resume_seq;
+} __attribute__((packed)) session_hello;
+
+//Values for session_ack.status
+#define SESSION_OK 0
+#define SESSION_GAP 1 //Some of what you asked for is gone; start_seq is the oldest we have
+#define SESSION_BAD_SEQ 2 //resume_seq is in the future; start_seq is the newest flit
+#define SESSION_BAD_HELLO 3 //Wrong magic or version. Connection will be closed
+
+typedef struct _session_ack {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t flags;
+    uint32_t status;
+    uint64_t start_seq;
+} __attribute__((packed)) session_ack;
+
+#endif
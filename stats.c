@@ -0,0 +1,95 @@
+#include <stdio.h>
+#include <signal.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <pthread.h>
+#include "queue.h"
+#include "stats.h"
+#include "trace.h"
+
+#define LOAD(x) atomic_load_explicit(&(x), memory_order_relaxed)
+
+static void print_queue(FILE *fp, char const *what, queue *q) {
+    if (q == NULL) return;
+    fprintf(fp, "  %s queue: high water %u/%d bytes; producer blocked %llu times for %.6f s\n",
+        what, LOAD(q->occ_hwm), BUF_SIZE, LOAD(q->prod_blocks), LOAD(q->prod_blocked_ns) * 1e-9);
+}
+
+void pipe_stats_print(FILE *fp, char const *name, pipe_stats *s, queue *flit_q, queue *cmd_q) {
+    unsigned long long flits = LOAD(s->rx_flits);
+    unsigned long long reads = LOAD(s->rx_reads);
+    unsigned long long empty = LOAD(s->rx_polls_empty);
+
+    fprintf(fp, "%s:\n", name);
+    fprintf(fp, "  RX FIFO: %llu flits (%llu bytes) in %llu reads; %llu empty reads (%.1f%% idle); %llu errors\n",
+        flits, flits * 4, reads, empty, (reads + empty) ? 100.0 * empty / (reads + empty) : 0.0, LOAD(s->rx_errs));
+    unsigned long long filtered = LOAD(s->rx_filtered);
+    if (filtered > 0) {
+        fprintf(fp, "  filter: dropped %llu flits (%.1f%%)\n", filtered, flits ? 100.0 * filtered / flits : 0.0);
+    }
+    print_queue(fp, "flit", flit_q);
+    fprintf(fp, "  socket out: %llu bytes in %llu writes; %llu short writes\n",
+        LOAD(s->sock_tx_bytes), LOAD(s->sock_writes), LOAD(s->sock_short_writes));
+    unsigned long long z_in = LOAD(s->z_in_bytes);
+    if (z_in > 0) {
+        unsigned long long z_out = LOAD(s->z_out_bytes);
+        fprintf(fp, "  compression: %llu bytes down to %llu (ratio %.2f); %.3f s CPU (%.2f ns/byte)\n",
+            z_in, z_out, z_out ? (double) z_in / z_out : 0.0, LOAD(s->z_ns) * 1e-9, (double) LOAD(s->z_ns) / z_in);
+    }
+    fprintf(fp, "  socket in: %llu bytes in %llu reads\n", LOAD(s->sock_rx_bytes), LOAD(s->sock_reads));
+    print_queue(fp, "command", cmd_q);
+    fprintf(fp, "  TX FIFO: %llu words in %llu packets; full %llu times; %llu errors\n",
+        LOAD(s->tx_words), LOAD(s->tx_pkts), LOAD(s->tx_full), LOAD(s->tx_errs));
+    fflush(fp);
+}
+
+void *stats_server(void *arg) {
+    stats_server_info *info = (stats_server_info *) arg;
+
+    sigset_t sigs;
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGUSR1);
+    sigaddset(&sigs, SIGUSR2);
+    int sig_fd = signalfd(-1, &sigs, 0);
+    if (sig_fd < 0) perror("Could not make signalfd for SIGUSR1/SIGUSR2; stats only available on the stats port");
+
+    if (info->sfd != -1 && listen(info->sfd, 4) < 0) {
+        perror("Could not listen on stats port");
+        info->sfd = -1;
+    }
+
+    struct pollfd pfds[2] = {
+        {.fd = sig_fd, .events = POLLIN},
+        {.fd = info->sfd, .events = POLLIN}
+    };
+    //Negative fds are ignored by poll()
+    if (sig_fd < 0 && info->sfd < 0) pthread_exit(NULL);
+
+    while (1) {
+        if (poll(pfds, 2, -1) < 0) continue;
+
+        if (pfds[0].revents & POLLIN) {
+            struct signalfd_siginfo si;
+            if (read(sig_fd, &si, sizeof(si)) == sizeof(si)) {
+                if (si.ssi_signo == SIGUSR2) trace_dump(stderr);
+                else info->dump(stderr, info->arg);
+            }
+        }
+
+        if (pfds[1].revents & POLLIN) {
+            int fd = accept(info->sfd, NULL, NULL);
+            if (fd < 0) continue;
+            FILE *fp = fdopen(fd, "w");
+            if (fp == NULL) {
+                close(fd);
+                continue;
+            }
+            info->dump(fp, info->arg);
+            fclose(fp);
+        }
+    }
+
+    return NULL;
+}
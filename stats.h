@@ -0,0 +1,67 @@
+#ifndef STATS_H
+#define STATS_H 1
+
+#include <stdio.h>
+#include <stdatomic.h>
+#include "queue.h"
+
+//Counters for one FIFO pair, always on. Each group is written by one thread
+//(except in fan-out mode, where every client's threads add to the socket
+//counters) and sits on its own cache line, so keeping them costs a load and
+//a store per burst, not per flit. Anyone can read them at any time; see
+//stats_server for how they get out.
+
+#define STATS_CACHE_LINE 64
+
+typedef struct _pipe_stats {
+    //Flits, RX FIFO side. Written by whoever polls the RX FIFO
+    _Atomic unsigned long long rx_flits __attribute__((aligned(STATS_CACHE_LINE)));
+    _Atomic unsigned long long rx_reads; //Reads that got something (a packet can take several)
+    _Atomic unsigned long long rx_polls_empty; //Reads that got nothing
+    _Atomic unsigned long long rx_errs; //Error interrupts
+    _Atomic unsigned long long rx_filtered; //Flits the client's filter rules dropped (-w)
+
+    //Flits, socket side. Written by whoever sends flits to the client(s)
+    _Atomic unsigned long long sock_tx_bytes __attribute__((aligned(STATS_CACHE_LINE)));
+    _Atomic unsigned long long sock_writes;
+    _Atomic unsigned long long sock_short_writes; //Sent less than we asked to
+    _Atomic unsigned long long z_in_bytes; //Frames we compressed, before...
+    _Atomic unsigned long long z_out_bytes; //...and after
+    _Atomic unsigned long long z_ns; //CPU time spent compressing
+
+    //Commands, socket side. Written by whoever reads the client(s)
+    _Atomic unsigned long long sock_rx_bytes __attribute__((aligned(STATS_CACHE_LINE)));
+    _Atomic unsigned long long sock_reads;
+
+    //Commands, TX FIFO side. Written by whoever writes the TX FIFO
+    _Atomic unsigned long long tx_words __attribute__((aligned(STATS_CACHE_LINE)));
+    _Atomic unsigned long long tx_pkts;
+    _Atomic unsigned long long tx_full; //Times we had to wait for TX FIFO room
+    _Atomic unsigned long long tx_errs; //Error interrupts
+} pipe_stats;
+
+//For counters with one writer: no need for a locked add
+#define STATS_ADD(s, field, n) atomic_store_explicit(&(s)->field, \
+    atomic_load_explicit(&(s)->field, memory_order_relaxed) + (n), memory_order_relaxed)
+
+//For counters with several writers
+#define STATS_ADD_SHARED(s, field, n) atomic_fetch_add_explicit(&(s)->field, (n), memory_order_relaxed)
+
+//Prints s (and the high-water marks and blocked time of the queues, if not
+//NULL) to fp. name says which FIFO pair it is
+void pipe_stats_print(FILE *fp, char const *name, pipe_stats *s, queue *flit_q, queue *cmd_q);
+
+//The stats thread. Whenever we get SIGUSR1, or someone connects to the stats
+//port, it calls dump with a FILE to write to: stderr for SIGUSR1, and the
+//connection for the port. The connection is closed once dump returns. It also
+//prints the trace (see trace.h) to stderr on SIGUSR2. SIGUSR1 and SIGUSR2
+//must be blocked in every thread before this starts (and it runs forever)
+typedef struct _stats_server_info {
+    int sfd; //Bound socket for the stats port, or -1 for SIGUSR1 only
+    void (*dump)(FILE *fp, void *arg);
+    void *arg;
+} stats_server_info;
+
+void *stats_server(void *arg);
+
+#endif
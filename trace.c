@@ -0,0 +1,183 @@
+#define _GNU_SOURCE             /* See feature_test_macros(7) */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include "trace.h"
+
+__thread trace_ring *trace_self = NULL;
+
+//Every ring ever made. Rings are never freed, just handed to the next new
+//thread once their owner exits
+static pthread_mutex_t rings_mutex = PTHREAD_MUTEX_INITIALIZER;
+static trace_ring *rings = NULL;
+
+//Used to find out when a thread exits
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+
+//Where the clock was when we started
+static unsigned long long start_ticks;
+static struct timespec start_time;
+
+#define X(id, fmt) fmt,
+static char const *trace_fmts[] = {
+    TRACE_EVENTS
+};
+#undef X
+
+static unsigned long long mono_ns(struct timespec const *ts) {
+    return ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+}
+
+void trace_init(void) {
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+    start_ticks = trace_ticks();
+}
+
+//Runs when a thread with a ring exits
+static void ring_release(void *arg) {
+    trace_ring *r = (trace_ring *) arg;
+    //Keep the final name for dumps after the thread is gone
+    prctl(PR_GET_NAME, r->name);
+    atomic_store(&r->in_use, 0);
+    trace_self = NULL;
+}
+
+static void make_ring_key(void) {
+    pthread_key_create(&ring_key, ring_release);
+}
+
+trace_ring *trace_register(void) {
+    pthread_once(&ring_key_once, make_ring_key);
+
+    pthread_mutex_lock(&rings_mutex);
+    trace_ring *r;
+    for (r = rings; r != NULL; r = r->next) {
+        if (!atomic_load(&r->in_use)) break;
+    }
+    if (r == NULL) {
+        r = calloc(1, sizeof(trace_ring));
+        if (r == NULL) {
+            pthread_mutex_unlock(&rings_mutex);
+            return NULL;
+        }
+        r->next = rings;
+        rings = r;
+    }
+    //Throw away a recycled ring's old events, or trace_dump would say they
+    //came from us. Nobody's logging to it, and trace_dump holds rings_mutex
+    //while it reads, so this can't race with either
+    atomic_store(&r->wr, 0);
+    r->tid = syscall(SYS_gettid);
+    prctl(PR_GET_NAME, r->name);
+    atomic_store(&r->in_use, 1);
+    pthread_mutex_unlock(&rings_mutex);
+
+    pthread_setspecific(ring_key, r);
+    trace_self = r;
+    return r;
+}
+
+typedef struct _dump_event {
+    trace_event ev;
+    trace_ring const *ring;
+} dump_event;
+
+static int cmp_events(void const *a, void const *b) {
+    unsigned long long x = ((dump_event const *) a)->ev.ts;
+    unsigned long long y = ((dump_event const *) b)->ev.ts;
+    return (x > y) - (x < y);
+}
+
+//Copies out whatever is still valid in r. Returns how many events it wrote
+//into out
+static int copy_ring(trace_ring const *r, dump_event *out) {
+    unsigned long long wr = atomic_load_explicit(&r->wr, memory_order_acquire);
+    unsigned long long first = (wr > TRACE_RING_EVENTS) ? wr - TRACE_RING_EVENTS : 0;
+
+    unsigned long long i;
+    for (i = first; i < wr; i++) {
+        out[i - first].ev = r->ev[i & (TRACE_RING_EVENTS - 1)];
+        out[i - first].ring = r;
+    }
+
+    //Anything the thread overwrote while we were copying is garbage. The
+    //slot it's writing right now is the one at the new wr
+    atomic_thread_fence(memory_order_acquire);
+    unsigned long long wr2 = atomic_load_explicit(&r->wr, memory_order_relaxed);
+    unsigned long long valid = (wr2 >= TRACE_RING_EVENTS) ? wr2 - TRACE_RING_EVENTS + 1 : 0;
+    if (valid <= first) return wr - first;
+    if (valid >= wr) return 0;
+
+    int drop = valid - first;
+    memmove(out, out + drop, (wr - valid) * sizeof(dump_event));
+    return wr - valid;
+}
+
+void trace_dump(FILE *fp) {
+    pthread_mutex_lock(&rings_mutex);
+
+    int num_rings = 0;
+    trace_ring *r;
+    for (r = rings; r != NULL; r = r->next) num_rings++;
+
+    dump_event *evs = malloc((size_t) num_rings * TRACE_RING_EVENTS * sizeof(dump_event));
+    if (evs == NULL) {
+        pthread_mutex_unlock(&rings_mutex);
+        fprintf(fp, "trace: out of memory\n");
+        return;
+    }
+
+    int n = 0;
+    for (r = rings; r != NULL; r = r->next) {
+        n += copy_ring(r, evs + n);
+
+        //Threads that are still running might have been renamed since they
+        //registered
+        if (atomic_load(&r->in_use)) {
+            char path[64];
+            snprintf(path, sizeof(path), "/proc/self/task/%d/comm", r->tid);
+            FILE *comm = fopen(path, "r");
+            if (comm != NULL) {
+                char name[16];
+                if (fgets(name, sizeof(name), comm) != NULL) {
+                    name[strcspn(name, "\n")] = '\0';
+                    strcpy(r->name, name);
+                }
+                fclose(comm);
+            }
+        }
+    }
+
+    //Work out how fast the clock ticks, using how far it and CLOCK_MONOTONIC
+    //have both gone since trace_init
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    unsigned long long now_ticks = trace_ticks();
+    double ns_per_tick = 1.0;
+    if (now_ticks > start_ticks && mono_ns(&now) > mono_ns(&start_time)) {
+        ns_per_tick = (double) (mono_ns(&now) - mono_ns(&start_time)) / (now_ticks - start_ticks);
+    }
+
+    qsort(evs, n, sizeof(dump_event), cmp_events);
+
+    fprintf(fp, "---- trace: %d events from %d threads ----\n", n, num_rings);
+    int i;
+    for (i = 0; i < n; i++) {
+        trace_event const *e = &evs[i].ev;
+        double secs = ((double) e->ts - (double) start_ticks) * ns_per_tick * 1e-9;
+        fprintf(fp, "[%14.9f] %-15s %5d  ", secs, evs[i].ring->name, evs[i].ring->tid);
+        if (e->id < TR_NUM_EVENTS) fprintf(fp, trace_fmts[e->id], e->a, e->b);
+        else fprintf(fp, "unknown event %u (%u, %llu)", e->id, e->a, e->b);
+        fputc('\n', fp);
+    }
+    fprintf(fp, "---- end of trace ----\n");
+    fflush(fp);
+
+    pthread_mutex_unlock(&rings_mutex);
+    free(evs);
+}
@@ -0,0 +1,103 @@
+#ifndef TRACE_H
+#define TRACE_H 1
+
+#include <stdio.h>
+#include <stdatomic.h>
+#include <time.h>
+
+//Always-on binary tracing for the hot loops. Every thread gets its own ring
+//of the last TRACE_RING_EVENTS events (id, raw timestamp, and two numbers),
+//so logging one is a handful of plain stores and no locks, syscalls or
+//formatting. Old events are overwritten. trace_dump turns all of the rings
+//into text, merged in time order; we do that on SIGUSR2, when a FIFO reports
+//an error, and on exit in DEBUG_ON builds.
+
+//Must be a power of two
+#define TRACE_RING_EVENTS 4096
+
+//Every event, and how to print it. The format gets the event's a (unsigned)
+//and then b (unsigned long long), and is free to ignore either one
+#define TRACE_EVENTS \
+    X(TR_FIFO_READ, "read %u words from RX FIFO (%llu words total)") \
+    X(TR_FIFO_SENT, "sent %u command words to TX FIFO (%llu words total)") \
+    X(TR_NET_SENT, "sent %u bytes to client (%llu bytes total)") \
+    X(TR_NET_RECV, "got %u bytes of commands from client (%llu bytes total)") \
+    X(TR_RX_ERR, "RX FIFO error interrupt: ISR=0x%08x") \
+    X(TR_TX_ERR, "TX FIFO error interrupt: ISR=0x%08x")
+
+#define X(id, fmt) id,
+typedef enum _trace_id {
+    TRACE_EVENTS
+    TR_NUM_EVENTS
+} trace_id;
+#undef X
+
+typedef struct _trace_event {
+    unsigned long long ts; //Raw ticks; see trace_ticks
+    unsigned id;
+    unsigned a;
+    unsigned long long b;
+} trace_event;
+
+typedef struct _trace_ring {
+    trace_event ev[TRACE_RING_EVENTS];
+    _Atomic unsigned long long wr; //How many events were ever logged
+
+    //For trace_dump
+    int tid;
+    char name[16];
+    _Atomic int in_use; //Zero once the thread is gone, so the ring can be reused
+    struct _trace_ring *next;
+} trace_ring;
+
+//The calling thread's ring, or NULL if it hasn't logged anything yet
+extern __thread trace_ring *trace_self;
+
+//Makes (or recycles) a ring for the calling thread. Returns NULL if we're
+//out of memory, in which case this thread's events are dropped
+trace_ring *trace_register(void);
+
+//The cheapest clock we can get. Only trace_dump converts these to real time
+static inline unsigned long long trace_ticks(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#elif defined(__aarch64__)
+    unsigned long long v;
+    __asm__ __volatile__("mrs %0, cntvct_el0" : "=r"(v));
+    return v;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+static inline void trace_emit(trace_id id, unsigned a, unsigned long long b) {
+    trace_ring *r = trace_self;
+    if (__builtin_expect(r == NULL, 0)) {
+        r = trace_register();
+        if (r == NULL) return;
+    }
+
+    unsigned long long wr = atomic_load_explicit(&r->wr, memory_order_relaxed);
+    trace_event *e = &r->ev[wr & (TRACE_RING_EVENTS - 1)];
+    e->ts = trace_ticks();
+    e->id = id;
+    e->a = a;
+    e->b = b;
+    atomic_store_explicit(&r->wr, wr + 1, memory_order_release);
+    //Same as in flit_ring_write: the next event's stores mustn't show up
+    //before this wr does, or trace_dump could keep a slot that was changing
+    atomic_thread_fence(memory_order_release);
+}
+
+//Call once at startup, before any events are logged. Remembers where the
+//clock started so trace_dump can print times in seconds
+void trace_init(void);
+
+//Prints every thread's recent events to fp, oldest first. Safe to call while
+//the other threads keep logging (anything they overwrite during the dump is
+//left out)
+void trace_dump(FILE *fp);
+
+#endif